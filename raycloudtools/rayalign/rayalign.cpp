@@ -7,10 +7,13 @@
 #include "raylib/raycloud.h"
 #include "raylib/rayalignment.h"
 #include "raylib/rayaxisalign.h"
+#include "raylib/raybatchalignment.h"
 #include "raylib/rayfinealignment.h"
 #include "raylib/raydebugdraw.h"
 #include "raylib/rayparse.h"
+#include "raylib/rayply.h"
 #include "raylib/raypose.h"
+#include "raylib/raywarp.h"
 
 #include <nabo/nabo.h>
 
@@ -31,6 +34,26 @@ void usage(int exit_code = 1)
   std::cout
     << "                             --local    - fine alignment only, assumes clouds are already approximately aligned"
     << std::endl;
+  std::cout
+    << "                             --refine_width 0.02 - refine the coarse translation down to this voxel width (m)"
+    << std::endl;
+  std::cout
+    << "                             --out_of_core - aligns decimated copies, then streams raycloudA through the result,"
+    << std::endl;
+  std::cout << "                                             for clouds that are larger than memory" << std::endl;
+  std::cout
+    << "                             --save_warp - also saves the transformation of raycloudA to raycloudA_warp.txt,"
+    << std::endl;
+  std::cout << "                                           which raywarp can apply to other clouds" << std::endl;
+  std::cout
+    << "                             --cache    - with --out_of_core or batch, keeps the decimated copies beside the"
+    << std::endl;
+  std::cout << "                                          clouds, so that repeated runs on unchanged files start quickly"
+    << std::endl;
+  std::cout << "rayalign batch raycloud1 raycloud2 raycloud3 ... - aligns the overlapping clouds to each other, rigidly,"
+    << std::endl;
+  std::cout << "                             in the frame of raycloud1. Outputs the transformed version of the others."
+    << std::endl;
   std::cout << "rayalign raycloud  - axis aligns to the walls, placing the major walls at (0,0,0), biggest along y."
     << std::endl;
   exit(exit_code);
@@ -40,25 +63,75 @@ int main(int argc, char *argv[])
 {
   ray::FileArgument cloud_a, cloud_b;
   ray::OptionalFlagArgument nonrigid("nonrigid", 'n'), is_verbose("verbose", 'v'), local("local", 'l');
-  bool cross_align = ray::parseCommandLine(argc, argv, {&cloud_a, &cloud_b}, {&nonrigid, &is_verbose, &local});
+  ray::OptionalFlagArgument out_of_core("out_of_core", 'o'), save_warp("save_warp", 'w'), cache("cache", 'c');
+  ray::DoubleArgument refine_width(0.001, 0.5);
+  ray::OptionalKeyValueArgument refine_option("refine_width", 'r', &refine_width);
+  bool cross_align = ray::parseCommandLine(argc, argv, {&cloud_a, &cloud_b}, 
+                                           {&nonrigid, &is_verbose, &local, &refine_option, &out_of_core, &save_warp, 
+                                            &cache});
   bool self_align  = ray::parseCommandLine(argc, argv, {&cloud_a});
-  if (!cross_align && !self_align)
+  ray::TextArgument batch_text("batch");
+  ray::FileArgumentList cloud_files(2);
+  bool batch_align = ray::parseCommandLine(argc, argv, {&batch_text, &cloud_files}, {&is_verbose, &cache});
+  if (!cross_align && !self_align && !batch_align)
     usage();
 
   std::string aligned_name = cloud_a.nameStub() + "_aligned.ply";
-  if (self_align)
+  if (batch_align)
+  {
+    std::vector<std::string> file_names;
+    for (auto &file : cloud_files.files())
+      file_names.push_back(file.name());
+    std::vector<ray::Pose> poses;
+    if (!ray::alignCloudSet(file_names, poses, is_verbose.isSet(), cache.isSet()))
+      usage();
+    // the transformations are applied to the full clouds one chunk at a time, so they need not fit in memory
+    for (size_t i = 1; i < poses.size(); i++)
+    {
+      const ray::Pose &pose = poses[i];
+      auto transform = [&pose](Eigen::Vector3d &start, Eigen::Vector3d &end, double &, ray::RGBA &)
+      {
+        start = pose * start;
+        end = pose * end;
+      };
+      const std::string out_name = cloud_files.files()[i].nameStub() + "_aligned.ply";
+      if (!ray::convertCloud(file_names[i], out_name, transform, true))
+        usage();
+      Eigen::Vector3d rotation = Eigen::AngleAxisd(pose.rotation).axis() * Eigen::AngleAxisd(pose.rotation).angle();
+      std::cout << "Transformation of " << cloud_files.files()[i].nameStub() << ":" << std::endl;
+      std::cout << "          rotation: (" << rotation.transpose() * 180.0 / ray::kPi << ") degrees (axis * angle)"
+                << std::endl;
+      std::cout << "  then translation: (" << pose.position.transpose() << ")" << std::endl;
+    }
+  }
+  else if (self_align)
   {
     if (!ray::alignCloudToAxes(cloud_a.name(), aligned_name))
       usage();
   }
   else // cross_align
   {
-    ray::Pose transform;
     ray::Cloud clouds[2];
-    if (!clouds[0].load(cloud_a.name()))
-      usage();
-    if (!clouds[1].load(cloud_b.name()))
-      usage();
+    double point_spacings[2] = { 0.0, 0.0 };  // estimated by the fine alignment unless known
+    if (out_of_core.isSet())
+    {
+      // only copies decimated to the fine alignment's resolution are held in memory. The decimation estimates the
+      // point spacings of the full clouds, which the fine alignment then uses
+      for (int c = 0; c < 2; c++)
+      {
+        double voxel_width = 0.0;
+        if (!clouds[c].loadDecimated(c == 0 ? cloud_a.name() : cloud_b.name(), voxel_width, cache.isSet(),
+                                     &point_spacings[c]))
+          usage();
+      }
+    }
+    else
+    {
+      if (!clouds[0].load(cloud_a.name()))
+        usage();
+      if (!clouds[1].load(cloud_b.name()))
+        usage();
+    }
 
     // Here we pick two distant points in the cloud as an independent method of determining the total transformation applied
     size_t min_i = 0, max_i = 0;
@@ -78,14 +151,16 @@ int main(int argc, char *argv[])
     if (verbose)
       ray::DebugDraw::init(argc, argv, "rayalign");
     
+    ray::Pose coarse_transform = ray::Pose::identity();
     if (!local_only)
     {
-      alignCloud0ToCloud1(clouds, 0.5, verbose);
+      const double fine_voxel_width = refine_option.isSet() ? refine_width.value() : 0.0;
+      coarse_transform = alignCloud0ToCloud1(clouds, 0.5, verbose, fine_voxel_width);
       if (verbose)
         clouds[0].save(cloud_a.nameStub() + "_coarse_aligned.ply");
     }
 
-    ray::FineAlignment fineAlign(clouds, non_rigid, verbose);
+    ray::FineAlignment fineAlign(clouds, non_rigid, verbose, point_spacings);
     fineAlign.align();
 
     // Now we calculate the rigid transformation from the change in the position of the two points:
@@ -102,7 +177,25 @@ int main(int argc, char *argv[])
       std::cout << "This rigid transformation is approximate as a non-rigid transformation was applied" << std::endl;
     }
     
-    clouds[0].save(aligned_name);
+    // the coarse then fine transformations
+    ray::Warp warp;
+    warp.addStep(coarse_transform);
+    warp.append(fineAlign.warp());
+    if (save_warp.isSet() && !warp.save(cloud_a.nameStub() + "_warp.txt"))
+      usage();
+    if (out_of_core.isSet())
+    {
+      // apply the warp to the full cloud, one chunk at a time
+      auto transform = [&warp](Eigen::Vector3d &start, Eigen::Vector3d &end, double &, ray::RGBA &)
+      {
+        start = warp.apply(start);
+        end = warp.apply(end);
+      };
+      if (!ray::convertCloud(cloud_a.name(), aligned_name, transform, true))
+        usage();
+    }
+    else
+      clouds[0].save(aligned_name);
   }
   return 0;
 }
@@ -15,6 +15,7 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <fstream>
 #include <iostream>
 
 void usage(int exit_code = 1)
@@ -50,6 +51,10 @@ void usage(int exit_code = 1)
             << std::endl;
   std::cout << "                                                       For merge conflicts it uses the specified merge type." << std::endl;
   std::cout << "        --output raycloud_combined.ply               - optionally specify the output file name." << std::endl;
+  std::cout << "        --incremental map.state                      - merge raycloud2 into the map raycloud1 using (and updating) its "
+               "stored merge state, so only the new cloud is processed." << std::endl;
+  std::cout << "        --tile_width 50                              - merge in 50 m tiles, streaming the clouds rather than "
+               "loading them, to bound memory use." << std::endl;
   exit(exit_code);
 }
 
@@ -64,15 +69,29 @@ int main(int argc, char *argv[])
   // Below: false = allow unusual file extensions, for auto-merging, which occurs on non-standard temporary file names
   ray::FileArgument base_cloud(false), cloud_1(false), cloud_2(false), output_file(false); 
   ray::OptionalKeyValueArgument output("output", 'o', &output_file);
+  ray::FileArgument state_file(false);
+  ray::OptionalKeyValueArgument incremental("incremental", 'i', &state_file);
+  ray::DoubleArgument tile_width(0.01, 100000.0);
+  ray::OptionalKeyValueArgument tiled("tile_width", 't', &tile_width);
 
   // three-way merge option
-  bool standard_format = ray::parseCommandLine(argc, argv, {&merge_type, &cloud_files, &num_rays, &rays_text}, {&output});
+  bool standard_format = ray::parseCommandLine(argc, argv, {&merge_type, &cloud_files, &num_rays, &rays_text}, {&output, &incremental, &tiled});
   bool concatenate = ray::parseCommandLine(argc, argv, {&all_text, &cloud_files}, {&output}); 
   bool threeway = ray::parseCommandLine(argc, argv, {&base_cloud, &merge_type, &cloud_1, &cloud_2, &num_rays, &rays_text},
                                                     {&output});
   bool threeway_concatenate = ray::parseCommandLine(argc, argv, {&base_cloud, &all_text, &cloud_1, &cloud_2}, {&output});
   if (!standard_format && !concatenate && !threeway && !threeway_concatenate)
     usage();
+  if (incremental.isSet() && cloud_files.files().size() != 2)
+  {
+    std::cerr << "Error: incremental merging requires exactly two clouds, the map and the new cloud" << std::endl;
+    usage();
+  }
+  if (incremental.isSet() && tiled.isSet())
+  {
+    std::cerr << "Error: incremental merging cannot be tiled" << std::endl;
+    usage();
+  }
 
   // we know there is at least one file, as we specified a minimum number in FileArgumentList
   std::string file_stub = (threeway || threeway_concatenate) ? base_cloud.nameStub() : cloud_files.files()[0].nameStub(); 
@@ -86,7 +105,7 @@ int main(int argc, char *argv[])
     if (!clouds[1].load(cloud_2.name(), false))
       usage();
   }
-  else
+  else if (!tiled.isSet() && !concatenate)
   {
     clouds.resize(cloud_files.files().size());
     for (int i = 0; i < (int)cloud_files.files().size(); i++) 
@@ -128,8 +147,6 @@ int main(int argc, char *argv[])
   ray::Merger merger(config);
   ray::Progress progress;
   ray::ProgressThread progress_thread(progress);
-  ray::Cloud concatenated_cloud;
-  const ray::Cloud *fixed_cloud = &merger.fixedCloud();
 
   if (threeway || threeway_concatenate)
   {
@@ -140,14 +157,47 @@ int main(int argc, char *argv[])
   }
   else if (concatenate)
   {
-    fixed_cloud = &concatenated_cloud;
-    for (auto &cloud : clouds)
+    // stream directly from the input files to the output file
+    std::vector<std::string> file_names;
+    for (auto &file : cloud_files.files())
+      file_names.push_back(file.name());
+    const std::string combined_file = output.isSet() ? output_file.name() : file_stub + "_combined.ply";
+    if (!ray::concatenateClouds(file_names, combined_file))
+      usage();
+    progress_thread.join();
+    return 0;
+  }
+  else if (tiled.isSet())
+  {
+    std::vector<std::string> file_names;
+    for (auto &file : cloud_files.files())
+      file_names.push_back(file.name());
+    const std::string fixed_file = output.isSet() ? output_file.name() : file_stub + "_combined.ply";
+    if (!merger.mergeMultipleTiled(file_names, tile_width.value(), fixed_file, file_stub + "_differences.ply", &progress))
+      usage();
+    progress_thread.join();
+    return 0;
+  }
+  else if (incremental.isSet())
+  {
+    ray::MergerMapState state;
+    if (std::ifstream(state_file.name()).good())
+    {
+      if (!state.load(state_file.name()))
+        usage();
+    }
+    else
     {
-      concatenated_cloud.starts.insert(concatenated_cloud.starts.end(), cloud.starts.begin(), cloud.starts.end());
-      concatenated_cloud.ends.insert(concatenated_cloud.ends.end(), cloud.ends.begin(), cloud.ends.end());
-      concatenated_cloud.times.insert(concatenated_cloud.times.end(), cloud.times.begin(), cloud.times.end());
-      concatenated_cloud.colours.insert(concatenated_cloud.colours.end(), cloud.colours.begin(), cloud.colours.end());
+      std::cout << "no merge state found, generating it from " << cloud_files.files()[0].name() << std::endl;
+      merger.generateMapState(clouds[0], &state, &progress);
     }
+    if (!merger.mergeIncremental(clouds[0], &state, clouds[1], &progress))
+      usage();
+    std::cout << merger.differenceCloud().rayCount() << " transients, " << merger.fixedCloud().rayCount()
+              << " fixed rays." << std::endl;
+    merger.differenceCloud().save(file_stub + "_differences.ply");
+    if (!state.save(state_file.name()))
+      usage();
   }
   else
   {
@@ -160,8 +210,8 @@ int main(int argc, char *argv[])
   progress_thread.join();
 
   if (output.isSet())
-    fixed_cloud->save(output_file.name());
+    merger.fixedCloud().save(output_file.name());
   else
-    fixed_cloud->save(file_stub + "_combined.ply");
+    merger.fixedCloud().save(file_stub + "_combined.ply");
   return 0;
 }
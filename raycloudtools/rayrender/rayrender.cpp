@@ -33,19 +33,43 @@ void usage(int exit_code = 1)
   std::cout << "                     --pixel_width 0.1     - optional pixel width in m" << std::endl;
   std::cout << "                     --output name.png     - optional output file name. " << std::endl;
   std::cout << "                                             Supports .png, .tga, .hdr, .jpg, .bmp" << std::endl;
+  std::cout << "                     --tile_size 4096      - optional, write the image as a grid of tiles of this many"
+    << std::endl;
+  std::cout << "                                             pixels square, named name_column_row.png" << std::endl;
+  std::cout << "                                             Images too large to hold at once are rendered in bands"
+    << std::endl;
+  std::cout << "                                             of tile rows, with one pass over the cloud per band" << std::endl;
+  std::cout << "                     --pyramid             - optional, also write half resolution levels of tiles,"
+    << std::endl;
+  std::cout << "                                             named name_level_column_row.png, level 0 is full res"
+    << std::endl;
+  std::cout << "                     --density_volume name.dns - optional, load the density volume from this file"
+    << std::endl;
+  std::cout << "                                             if it is from the same cloud contents and matches,"
+    << std::endl;
+  std::cout << "                                             otherwise calculate and save it here" << std::endl;
   std::cout << "Default output is raycloudfile.png" << std::endl;
+  std::cout << "Multiple views and styles can be rendered in one pass, e.g. rayrender cloud.ply top,left,front ends,density"
+    << std::endl;
+  std::cout << "these are output as raycloudfile_top_ends.png etc." << std::endl;
   exit(exit_code);
 }
 
 int main(int argc, char *argv[])
 {
-  ray::KeyChoice viewpoint({"top", "left", "right", "front", "back"});
-  ray::KeyChoice style({"ends", "mean", "sum", "starts", "rays", "density", "density_rgb"});
+  ray::KeyChoiceList viewpoints({"top", "left", "right", "front", "back"});
+  ray::KeyChoiceList styles({"ends", "mean", "sum", "starts", "rays", "density", "density_rgb"});
   ray::DoubleArgument pixel_width(0.0001, 1000.0);
-  ray::FileArgument cloud_file, image_file;
+  ray::IntArgument tile_size(1, 1000000);
+  ray::FileArgument cloud_file, image_file, density_file;
   ray::OptionalKeyValueArgument pixel_width_option("pixel_width", 'p', &pixel_width);
   ray::OptionalKeyValueArgument output_file_option("output", 'o', &image_file);
-  if (!ray::parseCommandLine(argc, argv, {&cloud_file, &viewpoint, &style}, {&pixel_width_option, &output_file_option}))
+  ray::OptionalKeyValueArgument tile_size_option("tile_size", 't', &tile_size);
+  ray::OptionalFlagArgument pyramid_option("pyramid", 'y');
+  ray::OptionalKeyValueArgument density_file_option("density_volume", 'd', &density_file);
+  if (!ray::parseCommandLine(argc, argv, {&cloud_file, &viewpoints, &styles}, 
+                             {&pixel_width_option, &output_file_option, &tile_size_option, &pyramid_option,
+                              &density_file_option}))
   {
     usage();
   }
@@ -54,14 +78,38 @@ int main(int argc, char *argv[])
     image_file.name() = cloud_file.nameStub() + ".png";
   }
 
+  // when only rendering density from a saved volume, its bounds and voxel width avoid two passes over the cloud
+  bool only_density = true;
+  for (auto &key: styles.selectedKeys())
+  {
+    only_density = only_density && (key == "density" || key == "density_rgb");
+  }
+  ray::Cuboid volume_bounds(Eigen::Vector3d::Zero(), Eigen::Vector3d::Zero());
+  double volume_width = 0.0;
+  Eigen::Vector3i volume_dims;
+  ray::FileStamp volume_source, cloud_source;
+  const bool use_volume = only_density && density_file_option.isSet() && 
+    ray::DensityGrid::loadHeader(density_file.name(), volume_bounds, volume_width, volume_dims, volume_source) &&
+    ray::getFileStamp(cloud_file.name(), cloud_source) && volume_source == cloud_source;
+
   ray::Cloud::Info info;
-  if (!ray::Cloud::getInfo(cloud_file.name(), info))
+  if (use_volume)
+  {
+    // the saved grid is padded by one voxel below the cloud bounds
+    volume_bounds.min_bound_ += Eigen::Vector3d(volume_width, volume_width, volume_width);
+    info.ends_bound = volume_bounds;
+  }
+  else if (!ray::Cloud::getInfo(cloud_file.name(), info))
   {
     usage();
   }
   const ray::Cuboid bounds = info.ends_bound; // exclude the unbounded ray lengths (e.g. up into the sky)
   double pix_width = pixel_width.value();
-  if (!pixel_width_option.isSet())
+  if (use_volume && !pixel_width_option.isSet())
+  {
+    pix_width = volume_width;
+  }
+  else if (!pixel_width_option.isSet())
   {
     const double spacing_scale = 2.0; // a reasonable default multiplier on the spacing between points
     pix_width = spacing_scale * ray::Cloud::estimatePointSpacing(cloud_file.name(), bounds, info.num_bounded);
@@ -71,14 +119,47 @@ int main(int argc, char *argv[])
     usage();
   }
 
-  // quick casting allowed, taking care that the text and enums are in the same order
-  const ray::ViewDirection view_dir = static_cast<ray::ViewDirection>(viewpoint.selectedID());
-  const ray::RenderStyle render_style = static_cast<ray::RenderStyle>(style.selectedID());
+  // one image per view and style, named by the view and style when there is more than one of them
+  std::vector<ray::RenderView> views;
+  const std::string image_stub = ray::getFileNameStub(image_file.name());
+  const std::string image_ext = ray::getFileNameExtension(image_file.name());
+  for (size_t i = 0; i < viewpoints.selectedIDs().size(); i++)
+  {
+    for (size_t j = 0; j < styles.selectedIDs().size(); j++)
+    {
+      ray::RenderView view;
+      // quick casting allowed, taking care that the text and enums are in the same order
+      view.direction = static_cast<ray::ViewDirection>(viewpoints.selectedIDs()[i]);
+      view.style = static_cast<ray::RenderStyle>(styles.selectedIDs()[j]);
+      view.image_file = image_stub;
+      if (viewpoints.selectedIDs().size() > 1)
+      {
+        view.image_file += "_" + viewpoints.selectedKeys()[i];
+      }
+      if (styles.selectedIDs().size() > 1)
+      {
+        view.image_file += "_" + styles.selectedKeys()[j];
+      }
+      view.image_file += "." + image_ext;
+      views.push_back(view);
+    }
+  }
 
-  if (!ray::renderCloud(cloud_file.name(), bounds, view_dir, render_style, pix_width, image_file.name()))
+  ray::RenderConfig config;
+  if (tile_size_option.isSet())
+  {
+    config.tile_size = tile_size.value();
+  }
+  config.pyramid = pyramid_option.isSet();
+  if (density_file_option.isSet())
+  {
+    config.density_file = density_file.name();
+  }
+
+  if (!ray::renderCloud(cloud_file.name(), bounds, views, pix_width, config))
   {
     usage();
   }
 
   return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,69 @@
+// Copyright (c) 2020
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#include "raylib/raycloud.h"
+#include "raylib/rayparse.h"
+#include "raylib/rayply.h"
+#include "raylib/raywarp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+
+void usage(int exit_code = 1)
+{
+  std::cout << "Warp a raycloud, by a (possibly non-rigid) transformation file such as saved by rayalign --save_warp" 
+            << std::endl;
+  std::cout << "usage:" << std::endl;
+  std::cout << "raywarp raycloud warp.txt" << std::endl;
+  std::cout << "                          --time_varying - the file contains a warp per time, which are interpolated"
+            << std::endl;
+  std::cout << "                                           according to the time of each ray" << std::endl;
+  exit(exit_code);
+}
+
+int main(int argc, char *argv[])
+{
+  ray::FileArgument cloud_file, warp_file;
+  ray::OptionalFlagArgument time_varying("time_varying", 't');
+  if (!ray::parseCommandLine(argc, argv, {&cloud_file, &warp_file}, {&time_varying}))
+    usage();
+
+  const std::string temp_name = cloud_file.nameStub() + "~.ply"; // tilde is a common suffix for temporary files
+
+  // the warp is applied one chunk at a time, in parallel, so the cloud needn't fit in memory
+  bool converted = false;
+  if (time_varying.isSet())
+  {
+    ray::TimeVaryingWarp warp;
+    if (!warp.load(warp_file.name()))
+      usage();
+    auto apply = [&warp](Eigen::Vector3d &start, Eigen::Vector3d &end, double &time, ray::RGBA &)
+    {
+      start = warp.apply(start, time);
+      end = warp.apply(end, time);
+    };
+    converted = ray::convertCloud(cloud_file.name(), temp_name, apply, true);
+  }
+  else
+  {
+    ray::Warp warp;
+    if (!warp.load(warp_file.name()))
+      usage();
+    auto apply = [&warp](Eigen::Vector3d &start, Eigen::Vector3d &end, double &, ray::RGBA &)
+    {
+      start = warp.apply(start);
+      end = warp.apply(end);
+    };
+    converted = ray::convertCloud(cloud_file.name(), temp_name, apply, true);
+  }
+  if (!converted)
+    usage();
+
+  std::rename(temp_name.c_str(), cloud_file.name().c_str());
+
+  return 0;
+}
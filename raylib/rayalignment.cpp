@@ -8,60 +8,77 @@
 #include "rayply.h"
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "imagewrite.h"
-
-#include "simple_fft/fft.h"
+#include "rayfft.h"
 
 #include <cinttypes>
+#include <map>
 #include <iostream>
 #include <complex>
+#if RAYLIB_WITH_TBB
+#include <tbb/parallel_for.h>
+#endif  // RAYLIB_WITH_TBB
 
 using Complex = std::complex<double>;
 static const double kHighPassPower = 0.25;  // This fixes inout->inout11, inoutD->inoutB2 and house_inside->house3.
                                             // Doesn't break any. power=0.25. 0 is turned off.
 namespace ray
 {
+/// A real valued grid and its Fourier transform. Since the grid is real, only half of the spectrum is stored,
+/// the other half being its complex conjugate
 struct Array3D
 {
   void init(const Eigen::Vector3d &box_min, const Eigen::Vector3d &box_max, double voxel_width);
 
+  /// Transform the grid values into the spectrum, freeing the grid values
   void fft();
+  /// Transform the spectrum back into the grid values, freeing the spectrum
   void inverseFft();
 
   void operator*=(const Array3D &other);
 
-  inline Complex &operator()(int x, int y, int z) { return cells_[x + dims_[0] * y + dims_[0] * dims_[1] * z]; }
-  inline const Complex &operator()(int x, int y, int z) const { return cells_[x + dims_[0] * y + dims_[0] * dims_[1] * z]; }
-  inline Complex &operator()(const Eigen::Vector3i &index) { return (*this)(index[0], index[1], index[2]); }
-  inline const Complex &operator()(const Eigen::Vector3i &index) const { return (*this)(index[0], index[1], index[2]); }
-  Complex &operator()(const Eigen::Vector3d &pos)
+  /// The grid values, available before @c fft() and after @c inverseFft()
+  inline double &operator()(int x, int y, int z) { return values_[x + dims_[0] * y + dims_[0] * dims_[1] * z]; }
+  inline const double &operator()(int x, int y, int z) const { return values_[x + dims_[0] * y + dims_[0] * dims_[1] * z]; }
+  inline double &operator()(const Eigen::Vector3i &index) { return (*this)(index[0], index[1], index[2]); }
+  inline const double &operator()(const Eigen::Vector3i &index) const { return (*this)(index[0], index[1], index[2]); }
+  double &operator()(const Eigen::Vector3d &pos)
   {
     Eigen::Vector3d index = (pos - box_min_) / voxel_width_;
     if (index[0] >= 0.0 && index[1] >= 0.0 && index[2] >= 0.0 && index[0] < (double)dims_[0] &&
         index[1] < (double)dims_[1] && index[2] < (double)dims_[2])
       return (*this)(Eigen::Vector3i(index.cast<int>()));
-    return null_cell_;
+    return null_value_;
   }
-  const Complex &operator()(const Eigen::Vector3d &pos) const
+  /// The stored half of the spectrum, for x up to spectrumWidth()-1. Available between @c fft() and @c inverseFft()
+  inline Complex &spectrum(int x, int y, int z) { return spectrum_[x + spectrumWidth() * (y + dims_[1] * z)]; }
+  inline const Complex &spectrum(int x, int y, int z) const { return spectrum_[x + spectrumWidth() * (y + dims_[1] * z)]; }
+  /// The magnitude of the spectrum at any x, y, z in the dimensions, using the conjugate symmetry for the half that 
+  /// is not stored
+  inline double magnitude(int x, int y, int z) const
   {
-    Eigen::Vector3d index = (pos - box_min_) / voxel_width_;
-    if (index[0] >= 0.0 && index[1] >= 0.0 && index[2] >= 0.0 && index[0] < (double)dims_[0] &&
-        index[1] < (double)dims_[1] && index[2] < (double)dims_[2])
-      return (*this)(Eigen::Vector3i(index.cast<int>()));
-    return null_cell_;
+    if (x < spectrumWidth())
+      return std::abs(spectrum(x, y, z));
+    return std::abs(spectrum(dims_[0] - x, (dims_[1] - y) % dims_[1], (dims_[2] - z) % dims_[2]));
   }
   void conjugate();
   Eigen::Vector3i maxRealIndex() const;
   void fillWithRays(const Cloud &cloud);
   inline Eigen::Vector3i &dimensions(){ return dims_; }
   inline const Eigen::Vector3i &dimensions() const { return dims_; }
+  inline int spectrumWidth() const { return dims_[0] / 2 + 1; }
   inline double voxelWidth(){ return voxel_width_; }
-  void clearCells(){ cells_.clear(); }
+  void clearCells()
+  { 
+    values_.clear(); 
+    spectrum_.clear(); 
+  }
 private:
   Eigen::Vector3d box_min_, box_max_;
   double voxel_width_;
   Eigen::Vector3i dims_;
-  std::vector<Complex> cells_;
-  Complex null_cell_;
+  std::vector<double> values_;
+  std::vector<Complex> spectrum_;
+  double null_value_;
 };
 
 struct Array1D
@@ -99,48 +116,45 @@ void Array3D::init(const Eigen::Vector3d &box_min, const Eigen::Vector3d &box_ma
   box_max_ = box_max;
   voxel_width_ = voxel_width;
   Eigen::Vector3d diff = (box_max - box_min) / voxel_width;
-  // HERE we need to make it a power of two
+  // the FFT backend supports any size, but some sizes are much faster than others
   for (int i = 0; i < 3; i++) 
-    dims_[i] = 1 << (int)ceil(log2(ceil(diff[i])));  // next power of two larger than diff
-  cells_.resize(dims_[0] * dims_[1] * dims_[2]);
-  memset(&cells_[0], 0, cells_.size() * sizeof(Complex));
-  null_cell_ = 0;
+    dims_[i] = fftBackend().goodSize((int)ceil(diff[i]));
+  values_.assign((size_t)dims_[0] * dims_[1] * dims_[2], 0.0);
+  spectrum_.clear();
+  null_value_ = 0;
 }
 
 void Array3D::operator*=(const Array3D &other)
 {
-  for (int i = 0; i < (int)cells_.size(); i++) 
-    cells_[i] *= other.cells_[i];
+  for (size_t i = 0; i < spectrum_.size(); i++) 
+    spectrum_[i] *= other.spectrum_[i];
 }
 
 void Array3D::conjugate()
 {
-  for (int i = 0; i < (int)cells_.size(); i++) 
-    cells_[i] = conj(cells_[i]);
+  for (size_t i = 0; i < spectrum_.size(); i++) 
+    spectrum_[i] = conj(spectrum_[i]);
 }
 
 void Array3D::fft()
 {
-  const char *error = nullptr;
-  // TODO: change to in-place (cells not repeated)
-  if (!simple_fft::FFT(*this, *this, dims_[0], dims_[1], dims_[2], error))
-    std::cout << "failed to calculate FFT: " << error << std::endl;
+  fftBackend().realFFT3D(dims_, values_, spectrum_);
+  std::vector<double>().swap(values_);
 }
 
 void Array3D::inverseFft()
 {
-  const char *error = nullptr;
-  if (!simple_fft::IFFT(*this, *this, dims_[0], dims_[1], dims_[2], error))
-    std::cout << "failed to calculate inverse FFT: " << error << std::endl;
+  fftBackend().inverseRealFFT3D(dims_, spectrum_, values_);
+  std::vector<Complex>().swap(spectrum_);
 }
 
 Eigen::Vector3i Array3D::maxRealIndex() const
 {
   Eigen::Vector3i index;
   double highest = std::numeric_limits<double>::lowest();
-  for (int i = 0; i < (int)cells_.size(); i++)
+  for (int i = 0; i < (int)values_.size(); i++)
   {
-    const double &score = cells_[i].real();
+    const double &score = values_[i];
     if (score > highest)
     {
       index = Eigen::Vector3i(i % dims_[0], (i / dims_[0]) % dims_[1], i / (dims_[0] * dims_[1]));
@@ -169,7 +183,7 @@ void Array3D::fillWithRays(const Cloud &cloud)
     {
       if (index[0] >= 0 && index[0] < dims_[0] && index[1] >= 0 && index[1] < dims_[1] && index[2] >= 0 &&
           index[2] < dims_[2])
-        (*this)(index[0], index[1], index[2]) += Complex(1, 0);  // add weight to these areas...
+        (*this)(index[0], index[1], index[2]) += 1.0;  // add weight to these areas...
 
       Eigen::Vector3d mid = box_min_ + voxel_width_ * Eigen::Vector3d(index[0] + 0.5, index[1] + 0.5, index[2] + 0.5);
       Eigen::Vector3d next_boundary = mid + 0.5 * voxel_width_ * dir_sign;
@@ -207,17 +221,12 @@ void Array1D::conjugate()
 
 void Array1D::fft()
 {
-  const char *error = nullptr;
-  // TODO: change to in-place (cells not repeated)
-  if (!simple_fft::FFT(*this, *this, cells_.size(), error))
-    std::cout << "failed to calculate FFT: " << error << std::endl;
+  fftBackend().complexFFT(cells_, false);
 }
 
 void Array1D::inverseFft()
 {
-  const char *error = nullptr;
-  if (!simple_fft::IFFT(*this, *this, cells_.size(), error))
-    std::cout << "failed to calculate inverse FFT: " << error << std::endl;
+  fftBackend().complexFFT(cells_, true);
 }
 
 int Array1D::maxRealIndex() const
@@ -246,7 +255,7 @@ void drawArray(const Array3D &array, const Eigen::Vector3i &dims, const std::str
     for (int y = 0; y < height; y++)
     {
       double val = 0.0;
-      for (int z = 0; z < dims[2]; z++) val += abs(array(x, y, z));
+      for (int z = 0; z < dims[2]; z++) val += array.magnitude(x, y, z);
       max_val = std::max(max_val, val);
     }
   }
@@ -264,7 +273,7 @@ void drawArray(const Array3D &array, const Eigen::Vector3i &dims, const std::str
         col[0] = 1.0 - h;
         col[2] = h;
         col[1] = 3.0 * col[0] * col[2];
-        colour += std::abs(array(x, y, z)) * col;
+        colour += array.magnitude(x, y, z) * col;
       }
       colour *= 15.0 * 255.0 / max_val;
       Col col;
@@ -329,23 +338,38 @@ void Array1D::polarCrossCorrelation(const Array3D *arrays, bool verbose)
   // OK cool, so next I need to re-map the two arrays into 4x1 grids...
   int max_rad = std::max(arrays[0].dimensions()[0], arrays[0].dimensions()[1]) / 2;
   Eigen::Vector3i polar_dims = Eigen::Vector3i(4 * max_rad, max_rad, arrays[0].dimensions()[2]);
+  const int num_rows = polar_dims[1] * polar_dims[2];
+  // the sample directions and high pass weights are shared by both arrays and all rows
+  std::vector<Eigen::Vector2d> directions(polar_dims[0]);
+  for (int i = 0; i < polar_dims[0]; i++)
+  {
+    double angle = 2.0 * kPi * (double)(i + 0.5) / (double)polar_dims[0];
+    directions[i] = Eigen::Vector2d(sin(angle), cos(angle));
+  }
+  std::vector<double> high_pass(polar_dims[0], 1.0);
+  if (kHighPassPower > 0.0)
+  {
+    for (int l = 0; l < polar_dims[0]; l++)
+      high_pass[l] = std::pow(std::min((double)l, (double)(polar_dims[0] - l)), kHighPassPower);
+  }
+
   std::vector<Array1D> polars[2];
   for (int c = 0; c < 2; c++)
   {
     std::vector<Array1D> &polar = polars[c];
     const Array3D &a = arrays[c];
-    polar.resize(polar_dims[1] * polar_dims[2]);
+    polar.resize(num_rows);
     for (int j = 0; j < polar_dims[1]; j++)
       for (int k = 0; k < polar_dims[2]; k++) polar[j + polar_dims[1] * k].init(polar_dims[0]);
 
-    // now map...
-    for (int i = 0; i < polar_dims[0]; i++)
+    // now map... each angle writes only its own cell of every row
+    auto map_angle = [&](int i)
     {
-      double angle = 2.0 * kPi * (double)(i + 0.5) / (double)polar_dims[0];
       for (int j = 0; j < polar_dims[1]; j++)
       {
         double radius = (0.5 + (double)j) / (double)polar_dims[1];
-        Eigen::Vector2d pos = radius * 0.5 * Eigen::Vector2d((double)a.dimensions()[0] * sin(angle), (double)a.dimensions()[1] * cos(angle));
+        Eigen::Vector2d pos = radius * 0.5 * Eigen::Vector2d((double)a.dimensions()[0] * directions[i][0], 
+                                                             (double)a.dimensions()[1] * directions[i][1]);
         if (pos[0] < 0.0)
           pos[0] += a.dimensions()[0];
         if (pos[1] < 0.0)
@@ -359,46 +383,211 @@ void Array1D::polarCrossCorrelation(const Array3D *arrays, bool verbose)
         for (int z = 0; z < polar_dims[2]; z++)
         {
           // bilinear interpolation -- for some reason LERP after abs is better than before abs
-          double val = abs(a(x, y, z)) * (1.0 - blend_x) * (1.0 - blend_y) +
-                       abs(a(x2, y, z)) * blend_x * (1.0 - blend_y) + abs(a(x, y2, z)) * (1.0 - blend_x) * blend_y +
-                       abs(a(x2, y2, z)) * blend_x * blend_y;
+          double val = a.magnitude(x, y, z) * (1.0 - blend_x) * (1.0 - blend_y) +
+                       a.magnitude(x2, y, z) * blend_x * (1.0 - blend_y) + a.magnitude(x, y2, z) * (1.0 - blend_x) * blend_y +
+                       a.magnitude(x2, y2, z) * blend_x * blend_y;
           polar[j + polar_dims[1] * z](i) = Complex(radius * val, 0);
         }
       }
-    }
+    };
+#if RAYLIB_WITH_TBB
+    tbb::parallel_for(0, polar_dims[0], map_angle);
+#else   // RAYLIB_WITH_TBB
+    for (int i = 0; i < polar_dims[0]; i++)
+      map_angle(i);
+#endif  // RAYLIB_WITH_TBB
     if (verbose)
       drawArray(polar, polar_dims, "translationInvPolar", c);
-    for (int j = 0; j < polar_dims[1]; j++)
+    auto transform_row = [&](int i)
     {
-      for (int k = 0; k < polar_dims[2]; k++)
+      polar[i].fft();
+      if (kHighPassPower > 0.0)
       {
-        int i = j + polar_dims[1] * k;
-        polar[i].fft();
-        if (kHighPassPower > 0.0)
-        {
-          for (int l = 0; l < polar[i].numCells(); l++)
-            polar[i].cell(l) *= std::pow(std::min((double)l, (double)(polar[i].numCells() - l)), kHighPassPower);
-        }
+        for (int l = 0; l < polar[i].numCells(); l++)
+          polar[i].cell(l) *= high_pass[l];
       }
-    }
+    };
+#if RAYLIB_WITH_TBB
+    tbb::parallel_for(0, num_rows, transform_row);
+#else   // RAYLIB_WITH_TBB
+    for (int i = 0; i < num_rows; i++)
+      transform_row(i);
+#endif  // RAYLIB_WITH_TBB
     if (verbose)
       drawArray(polar, polar_dims, "euclideanInvariant", c);
   }
 
-  // now get the inverse fft in place:
+  // now get the inverse fft of each row and add them all together. Each fixed block of rows has its own accumulator, 
+  // and the blocks are summed in order, so the result does not depend on the number of threads
+  const int rows_per_block = 16;
+  const int num_blocks = (num_rows + rows_per_block - 1) / rows_per_block;
+  std::vector<Array1D> block_sums(num_blocks);
+  auto correlate_block = [&](int b)
+  {
+    Array1D &sum = block_sums[b];
+    sum.init(polar_dims[0]);
+    for (int i = b * rows_per_block; i < std::min(num_rows, (b + 1) * rows_per_block); i++)
+    {
+      polars[1][i].conjugate();
+      polars[0][i] *= polars[1][i];
+      polars[0][i].inverseFft();
+      sum += polars[0][i];
+    }
+  };
+#if RAYLIB_WITH_TBB
+  tbb::parallel_for(0, num_blocks, correlate_block);
+#else   // RAYLIB_WITH_TBB
+  for (int b = 0; b < num_blocks; b++)
+    correlate_block(b);
+#endif  // RAYLIB_WITH_TBB
   init(polar_dims[0]);
-  for (size_t i = 0; i < polars[0].size(); i++)
+  for (auto &sum : block_sums)
+    (*this) += sum;
+}
+
+/************************************************************************************/
+namespace
+{
+// the refinement correlates cubic windows of this many voxels across, at each level
+const int kRefineWindowVoxels = 64;
+// and searches this many voxels either side of the current translation estimate
+const int kRefineSearchRadius = 4;
+// using at most this many windows, those with the most points in both clouds
+const int kRefineMaxWindows = 8;
+// windows with fewer points than this in either cloud are not used
+const int kRefineMinWindowPoints = 20;
+
+/// Estimate the remaining translation of clouds[0] from clouds[1], at @c voxel_width, assuming it is within 
+/// kRefineSearchRadius voxels. Rather than correlating the whole clouds, this sums the correlations over the densest
+/// windows that the clouds share, so the memory use depends only on the window size. Returns false if the clouds 
+/// do not share any suitable windows
+bool refineTranslation(const Cloud *clouds, double voxel_width, Eigen::Vector3d &translation)
+{
+  // the windows tile the region that the two clouds have in common
+  Eigen::Vector3d box_min(0, 0, 0), box_max(0, 0, 0);
+  for (int c = 0; c < 2; c++)
   {
-    polars[1][i].conjugate();
-    polars[0][i] *= polars[1][i];
-    polars[0][i].inverseFft();
-    (*this) += polars[0][i];  // add all the results together into the first array
+    Eigen::Vector3d cloud_min, cloud_max;
+    if (!clouds[c].calcBounds(&cloud_min, &cloud_max))
+      return false;
+    box_min = c == 0 ? cloud_min : maxVector(box_min, cloud_min);
+    box_max = c == 0 ? cloud_max : minVector(box_max, cloud_max);
   }
+  if (box_min[0] >= box_max[0] || box_min[1] >= box_max[1] || box_min[2] >= box_max[2])
+    return false;
+  const double window_width = kRefineWindowVoxels * voxel_width;
+  auto window_index = [&](const Eigen::Vector3d &pos)
+  {
+    Eigen::Vector3d index = (pos - box_min) / window_width;
+    return Eigen::Vector3i((int)std::floor(index[0]), (int)std::floor(index[1]), (int)std::floor(index[2]));
+  };
+  std::map<Eigen::Vector3i, Eigen::Vector2i, Vector3iLess> window_counts;
+  for (int c = 0; c < 2; c++)
+  {
+    for (size_t i = 0; i < clouds[c].ends.size(); i++)
+    {
+      if (clouds[c].rayBounded(i) && (clouds[c].ends[i].array() >= box_min.array()).all() && 
+          (clouds[c].ends[i].array() < box_max.array()).all())
+      {
+        auto window = window_counts.insert(std::make_pair(window_index(clouds[c].ends[i]), Eigen::Vector2i(0, 0)));
+        window.first->second[c]++;
+      }
+    }
+  }
+  std::vector<std::pair<int, Eigen::Vector3i>> windows;  // (score, window index)
+  for (auto &window : window_counts)
+  {
+    const int score = window.second.minCoeff();
+    if (score >= kRefineMinWindowPoints)
+      windows.push_back(std::make_pair(score, window.first));
+  }
+  if (windows.empty())
+    return false;
+  // the densest windows first, map order breaks ties so the choice is deterministic
+  std::stable_sort(windows.begin(), windows.end(), 
+    [](const std::pair<int, Eigen::Vector3i> &a, const std::pair<int, Eigen::Vector3i> &b){ return a.first > b.first; });
+  windows.resize(std::min((int)windows.size(), kRefineMaxWindows));
+
+  // correlation scores for each translation within the search radius, summed over the windows
+  const int search_width = 2 * kRefineSearchRadius + 1;
+  std::vector<double> scores(search_width * search_width * search_width, 0.0);
+  auto score = [&](const Eigen::Vector3i &offset) -> double &
+  {
+    const Eigen::Vector3i ind = offset + Eigen::Vector3i::Constant(kRefineSearchRadius);
+    return scores[ind[0] + search_width * (ind[1] + search_width * ind[2])];
+  };
+  const Eigen::Vector3d padding = Eigen::Vector3d::Constant(kRefineSearchRadius * voxel_width);
+  for (auto &window : windows)
+  {
+    const Eigen::Vector3d window_min = box_min + window.second.cast<double>() * window_width;
+    const Eigen::Vector3d window_max = window_min + Eigen::Vector3d::Constant(window_width);
+    // both clouds are cropped to the window, with an empty border so that the correlation doesn't wrap around 
+    Array3D arrays[2];
+    for (int c = 0; c < 2; c++)
+    {
+      arrays[c].init(window_min - padding, window_max + padding, voxel_width);
+      for (size_t i = 0; i < clouds[c].ends.size(); i++)
+      {
+        if (clouds[c].rayBounded(i) && (clouds[c].ends[i].array() >= window_min.array()).all() && 
+            (clouds[c].ends[i].array() < window_max.array()).all())
+          arrays[c](clouds[c].ends[i]) += 1.0;
+      }
+      arrays[c].fft();
+    }
+    arrays[1].conjugate();
+    arrays[0] *= arrays[1];
+    arrays[0].inverseFft();
+    const Eigen::Vector3i &dims = arrays[0].dimensions();
+    for (int x = -kRefineSearchRadius; x <= kRefineSearchRadius; x++)
+    {
+      for (int y = -kRefineSearchRadius; y <= kRefineSearchRadius; y++)
+      {
+        for (int z = -kRefineSearchRadius; z <= kRefineSearchRadius; z++)
+          score(Eigen::Vector3i(x, y, z)) += arrays[0]((x + dims[0]) % dims[0], (y + dims[1]) % dims[1], (z + dims[2]) % dims[2]);
+      }
+    }
+  }
+
+  // find the peak
+  Eigen::Vector3i peak(0, 0, 0);
+  double highest = std::numeric_limits<double>::lowest();
+  for (int x = -kRefineSearchRadius; x <= kRefineSearchRadius; x++)
+  {
+    for (int y = -kRefineSearchRadius; y <= kRefineSearchRadius; y++)
+    {
+      for (int z = -kRefineSearchRadius; z <= kRefineSearchRadius; z++)
+      {
+        const Eigen::Vector3i offset(x, y, z);
+        if (score(offset) > highest)
+        {
+          highest = score(offset);
+          peak = offset;
+        }
+      }
+    }
+  }
+  // add a little bit of sub-pixel accuracy, where the peak is not on the edge of the search region:
+  Eigen::Vector3d pos = peak.cast<double>();
+  for (int axis = 0; axis < 3; axis++)
+  {
+    if (std::abs(peak[axis]) == kRefineSearchRadius)
+      continue;
+    Eigen::Vector3i back = peak, fwd = peak;
+    back[axis]--;
+    fwd[axis]++;
+    const double y0 = score(back), y1 = score(peak), y2 = score(fwd);
+    const double denominator = y0 + y2 - 2.0 * y1;
+    if (denominator < 0.0)
+      pos[axis] += 0.5 * (y0 - y2) / denominator;  // just a quadratic maximum -b/2a for heights y0,y1,y2
+  }
+  translation = -voxel_width * pos;
+  return true;
+}
 }
 
-/************************************************************************************/
-void alignCloud0ToCloud1(Cloud *clouds, double voxel_width, bool verbose)
+Pose alignCloud0ToCloud1(Cloud *clouds, double voxel_width, bool verbose, double fine_voxel_width)
 {
+  Pose applied = Pose::identity();  // the total transformation of clouds[0]
   // first we need to decimate the clouds into intensity grids..
   // I need to get a maximum box width, and individual box_min, boxMaxs
   Eigen::Vector3d box_mins[2], box_width(0, 0, 0);
@@ -429,7 +618,7 @@ void alignCloud0ToCloud1(Cloud *clouds, double voxel_width, bool verbose)
     arrays[c].init(box_mins[c], box_mins[c] + box_width, voxel_width);
     for (int i = 0; i < (int)clouds[c].ends.size(); i++)
       if (clouds[c].rayBounded(i))
-        arrays[c](clouds[c].ends[i]) += Complex(1, 0);
+        arrays[c](clouds[c].ends[i]) += 1.0;
     arrays[c].fft();
     if (verbose)
       drawArray(arrays[c], arrays[c].dimensions(), "translationInvariant", c);
@@ -461,6 +650,7 @@ void alignCloud0ToCloud1(Cloud *clouds, double voxel_width, bool verbose)
     // ok, so let's rotate A towards B, and re-run the translation FFT
     Pose pose(Eigen::Vector3d(0, 0, 0), Eigen::Quaterniond(Eigen::AngleAxisd(angle, Eigen::Vector3d(0, 0, 1))));
     clouds[0].transform(pose, 0.0);
+    applied = pose * applied;
 
     const double mx = std::numeric_limits<double>::max();
     box_mins[0] = Eigen::Vector3d(mx,mx,mx);
@@ -472,7 +662,7 @@ void alignCloud0ToCloud1(Cloud *clouds, double voxel_width, bool verbose)
 
     for (int i = 0; i < (int)clouds[0].ends.size(); i++)
       if (clouds[0].rayBounded(i))
-        arrays[0](clouds[0].ends[i]) += Complex(1, 0);
+        arrays[0](clouds[0].ends[i]) += 1.0;
 
     arrays[0].fft();
     if (verbose)
@@ -483,7 +673,7 @@ void alignCloud0ToCloud1(Cloud *clouds, double voxel_width, bool verbose)
   {
     for (int c = 0; c < 2; c++)
     {
-      for (int x = 0; x < arrays[c].dimensions()[0]; x++)
+      for (int x = 0; x < arrays[c].spectrumWidth(); x++)
       {
         double coord_x = x < arrays[c].dimensions()[0] / 2 ? x : arrays[c].dimensions()[0] - x;
         for (int y = 0; y < arrays[c].dimensions()[1]; y++)
@@ -492,7 +682,7 @@ void alignCloud0ToCloud1(Cloud *clouds, double voxel_width, bool verbose)
           for (int z = 0; z < arrays[c].dimensions()[2]; z++)
           {
             double coord_z = z < arrays[c].dimensions()[2] / 2 ? z : arrays[c].dimensions()[2] - z;
-            arrays[c](x, y, z) *= pow(sqr(coord_x) + sqr(coord_y) + sqr(coord_z), kHighPassPower);
+            arrays[c].spectrum(x, y, z) *= pow(sqr(coord_x) + sqr(coord_y) + sqr(coord_z), kHighPassPower);
           }
         }
       }
@@ -517,9 +707,9 @@ void alignCloud0ToCloud1(Cloud *clouds, double voxel_width, bool verbose)
     int &dim = array.dimensions()[axis];
     back[axis] = (ind[axis] + dim - 1) % dim;
     fwd[axis] = (ind[axis] + 1) % dim;
-    double y0 = array(back).real();
-    double y1 = array(ind).real();
-    double y2 = array(fwd).real();
+    double y0 = array(back);
+    double y1 = array(ind);
+    double y2 = array(fwd);
     pos[axis] =
       ind[axis] + 0.5 * (y0 - y2) / (y0 + y2 - 2.0 * y1);  // just a quadratic maximum -b/2a for heights y0,y1,y2
     // but the FFT wraps around, so:
@@ -533,5 +723,27 @@ void alignCloud0ToCloud1(Cloud *clouds, double voxel_width, bool verbose)
 
   Pose transform(pos, Eigen::Quaterniond::Identity());
   clouds[0].transform(transform, 0.0);
+  applied = transform * applied;
+
+  // refine the translation at successively finer voxel widths, in windows around the current estimate. The widths
+  // halve, except for the last one which is exactly fine_voxel_width
+  double width = voxel_width;
+  while (fine_voxel_width > 0.0 && width > fine_voxel_width * (1.0 + 1e-6))
+  {
+    width = std::max(0.5 * width, fine_voxel_width);
+    Eigen::Vector3d translation;
+    if (!refineTranslation(clouds, width, translation))
+    {
+      if (verbose)
+        std::cout << "Coarse align: no common regions to refine the translation at voxel width " << width << std::endl;
+      break;
+    }
+    if (verbose)
+      std::cout << "Coarse align: refined translation at voxel width " << width << ": " << translation.transpose() << std::endl;
+    Pose refinement(translation, Eigen::Quaterniond::Identity());
+    clouds[0].transform(refinement, 0.0);
+    applied = refinement * applied;
+  }
+  return applied;
 }
 } // namespace ray
@@ -22,8 +22,13 @@ namespace ray
 /// This is a cross-correlation method that requires a @c voxel_width (typically on the order of a metre)
 /// the @c verbose argument saves out plan-view images at each step of the method.
 /// The method uses a scale-free Fourier-Mellin transform to efficiently cross-correlate the cloud's end point densities.
+/// If @c fine_voxel_width is smaller than @c voxel_width, the translation is then refined at successively halved 
+/// voxel widths, finishing with a refinement at exactly @c fine_voxel_width. Each refinement only correlates a few dense windows that the clouds 
+/// share, close to the current estimate, so its memory use does not grow with the cloud size.
+/// Returns the rigid transformation that was applied to the first cloud.
 /// NOTE @c clouds is a pair of clouds, it should point to an array with at least 2 elements
-void RAYLIB_EXPORT alignCloud0ToCloud1(Cloud *clouds, double voxel_width, bool verbose = false);
+Pose RAYLIB_EXPORT alignCloud0ToCloud1(Cloud *clouds, double voxel_width, bool verbose = false, 
+                                       double fine_voxel_width = 0.0);
 }  // namespace ray
 
 #endif  // RAYLIB_RAYALIGNMENT_H
@@ -9,6 +9,9 @@
 #include "raycloudwriter.h"
 #include "rayunused.h"
 #include "rayply.h"
+#if RAYLIB_WITH_TBB
+#include <tbb/parallel_for.h>
+#endif  // RAYLIB_WITH_TBB
 
 namespace ray
 {
@@ -71,7 +74,9 @@ Pose estimate2DPose(const Eigen::Array<Eigen::Vector3d, Eigen::Dynamic, Eigen::D
   
   Eigen::ArrayXXd weights(ang_res, amp_res); // this is the output of the radon transform
   weights.fill(0);
-  // Radon transform
+
+  // The occupied cells, as separate arrays of centroid coordinates (scaled by 1/radius) and weights. 
+  std::vector<double> xs, ys, cell_weights;
   for (int ii = 0; ii<amp_res; ii++)
   {
     for (int jj = 0; jj<amp_res; jj++)
@@ -80,25 +85,44 @@ Pose estimate2DPose(const Eigen::Array<Eigen::Vector3d, Eigen::Dynamic, Eigen::D
       const double weight = accumulator[2]; // the weight here is the number of end points under this pixel (array cell)
       if (weight == 0.0)
         continue;
-      const Eigen::Vector2d centroid(accumulator[0]/weight, accumulator[1]/weight);
-      const double angle = atan2(centroid[0], centroid[1]);
-      const double amplitude = std::sqrt(centroid[0]*centroid[0] + centroid[1]*centroid[1]) / radius;
-
-      // now draw the sine wave for this point.
-      for (int i = 0; i<ang_res; i++)
-      {
-        const double ang = kPi * static_cast<double>(i)/static_cast<double>(ang_res);
-        const double height = amplitude * std::sin(ang + angle);
-        const double y = (static_cast<double>(amp_res)-1.0-eps) * (0.5 + 0.5*height); // rescale the sine wave
-
-        // linear blend of the weight onto the two nearest neighbour pixels
-        const int j = static_cast<int>(y);
-        const double blend = y - static_cast<double>(j);        
-        weights(i, j) += (1.0-blend)*weight;
-        weights(i, j+1) += blend*weight;
-      }
+      xs.push_back(accumulator[0] / (weight * radius));
+      ys.push_back(accumulator[1] / (weight * radius));
+      cell_weights.push_back(weight);
     } 
   }
+  const int num_cells = static_cast<int>(cell_weights.size());
+
+  // Radon transform. Each cell draws a sine wave amplitude * sin(ang + angle) across the angles, where the 
+  // amplitude and phase are the polar coordinates of its centroid. Expanding the sine gives x cos(ang) + y sin(ang), 
+  // so no trigonometry is needed per cell. Each angle row is independent, so the rows are filled in parallel.
+  auto draw_row = [&](int i)
+  {
+    const double ang = kPi * static_cast<double>(i)/static_cast<double>(ang_res);
+    const double scale = 0.5 * (static_cast<double>(amp_res)-1.0-eps);
+    const double cos_ang = scale * std::cos(ang), sin_ang = scale * std::sin(ang);
+    // first the heights, in a loop simple enough for the compiler to vectorise,
+    std::vector<double> heights(num_cells);
+    for (int c = 0; c<num_cells; c++)
+      heights[c] = scale + xs[c]*cos_ang + ys[c]*sin_ang; // the sine wave, rescaled to the amplitude axis
+    // then a linear blend of each weight onto the two nearest neighbour pixels
+    std::vector<double> row(amp_res, 0.0);
+    for (int c = 0; c<num_cells; c++)
+    {
+      const double y = heights[c];
+      const int j = static_cast<int>(y);
+      const double blend = y - static_cast<double>(j);        
+      row[j] += (1.0-blend)*cell_weights[c];
+      row[j+1] += blend*cell_weights[c];
+    }
+    for (int j = 0; j<amp_res; j++)
+      weights(i, j) = row[j];
+  };
+#if RAYLIB_WITH_TBB
+  tbb::parallel_for(0, ang_res, draw_row);
+#else   // RAYLIB_WITH_TBB
+  for (int i = 0; i<ang_res; i++)
+    draw_row(i);
+#endif  // RAYLIB_WITH_TBB
   // now find greatest weight cell:   
   int max_i = 0, max_j = 0;
   weights.maxCoeff(&max_i, &max_j);
@@ -0,0 +1,273 @@
+// Copyright (c) 2020
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#include "raybatchalignment.h"
+#include "rayalignment.h"
+#include "raycloud.h"
+#include "rayfinealignment.h"
+
+#include <nabo/nabo.h>
+#include <iostream>
+#if RAYLIB_WITH_TBB
+#include <tbb/parallel_for.h>
+#endif  // RAYLIB_WITH_TBB
+
+namespace ray
+{
+namespace
+{
+// the coarse alignment voxel width, as used by rayalign
+const double kCoarseVoxelWidth = 0.5;
+// aligned points closer than this many decimation widths to the other cloud count as matching it
+const double kMatchWidths = 2.0;
+// aligned pairs with fewer than this proportion of matching points are not used in the pose graph
+const double kMinPairOverlap = 0.1;
+// the pose graph is solved iteratively, stopping after this many iterations
+const int kMaxPoseGraphIterations = 10;
+
+/// The alignment of cloud ids[0] onto cloud ids[1]
+struct PairAlignment
+{
+  int ids[2];
+  Pose transform;              // from the frame of cloud ids[0] to that of cloud ids[1]
+  int num_points;              // number of decimated bounded points in ids[0]
+  int num_matches;             // how many of these lie on cloud ids[1] once aligned
+  Eigen::Vector3d corners[8];  // corners of the overlapping region, in the frame of cloud ids[1]
+};
+
+/// Coarse then fine align a copy of @c cloud0 onto @c cloud1, filling in @c pair. The @c point_spacings are those of
+/// the full clouds. Returns false if the aligned clouds do not overlap
+bool alignPair(const Cloud &cloud0, const Cloud &cloud1, const double *point_spacings, double match_distance,
+               PairAlignment &pair)
+{
+  Cloud clouds[2] = { cloud0, cloud1 };
+  pair.transform = alignCloud0ToCloud1(clouds, kCoarseVoxelWidth, false);
+  FineAlignment fine_align(clouds, false, false, point_spacings);
+  fine_align.align();
+
+  // the fine alignment is rigid here, so each of its warp steps is just a pose
+  for (const auto &step : fine_align.warp().steps())
+    pair.transform = step.pose * pair.transform;
+
+  // count the points of the aligned cloud that lie on the other cloud
+  std::vector<Eigen::Vector3d> points[2];
+  for (int c = 0; c < 2; c++)
+  {
+    for (size_t i = 0; i < clouds[c].ends.size(); i++)
+      if (clouds[c].rayBounded(i))
+        points[c].push_back(clouds[c].ends[i]);
+  }
+  pair.num_points = (int)points[0].size();
+  if (points[0].empty() || points[1].empty())
+    return false;
+  Eigen::MatrixXd points_p(3, points[1].size());
+  for (size_t i = 0; i < points[1].size(); i++)
+    points_p.col(i) = points[1][i];
+  Eigen::MatrixXd points_q(3, points[0].size());
+  for (size_t i = 0; i < points[0].size(); i++)
+    points_q.col(i) = points[0][i];
+  Nabo::NNSearchD *nns = Nabo::NNSearchD::createKDTreeLinearHeap(points_p, 3);
+  Eigen::MatrixXi indices(1, points[0].size());
+  Eigen::MatrixXd dists2(1, points[0].size());
+  nns->knn(points_q, indices, dists2, 1, kNearestNeighbourEpsilon, 0, match_distance);
+  delete nns;
+  pair.num_matches = 0;
+  for (size_t i = 0; i < points[0].size(); i++)
+  {
+    if (indices(0, i) > -1 && dists2(0, i) <= match_distance * match_distance)
+      pair.num_matches++;
+  }
+
+  // the pose graph constrains the corners of the overlapping region
+  Eigen::Vector3d min_bounds[2], max_bounds[2];
+  for (int c = 0; c < 2; c++)
+    clouds[c].calcBounds(&min_bounds[c], &max_bounds[c]);
+  const Eigen::Vector3d box_min = maxVector(min_bounds[0], min_bounds[1]);
+  const Eigen::Vector3d box_max = minVector(max_bounds[0], max_bounds[1]);
+  if (box_min[0] > box_max[0] || box_min[1] > box_max[1] || box_min[2] > box_max[2])
+    return false;
+  for (int i = 0; i < 8; i++)
+    pair.corners[i] = Eigen::Vector3d(i & 1 ? box_max[0] : box_min[0], i & 2 ? box_max[1] : box_min[1],
+                                      i & 4 ? box_max[2] : box_min[2]);
+  return true;
+}
+
+/// The matrix M for which M * w = w.cross(vec)
+Eigen::Matrix3d crossMatrix(const Eigen::Vector3d &vec)
+{
+  Eigen::Matrix3d mat;
+  mat << 0, vec[2], -vec[1], -vec[2], 0, vec[0], vec[1], -vec[0], 0;
+  return mat;
+}
+
+/// Refine @c poses (all but the first) to best agree with the pairwise alignments. Each pair requires the corners of
+/// its overlap region to coincide in the two clouds, weighted by its number of matching points. This is solved by
+/// Gauss-Newton, with small translation and rotation vector updates to each pose
+void solvePoseGraph(const std::vector<PairAlignment> &pairs, std::vector<Pose> &poses, bool verbose)
+{
+  const int num_params = 6 * ((int)poses.size() - 1);
+  if (num_params == 0)
+    return;
+  for (int it = 0; it < kMaxPoseGraphIterations; it++)
+  {
+    Eigen::MatrixXd At_A = Eigen::MatrixXd::Zero(num_params, num_params);
+    Eigen::VectorXd At_b = Eigen::VectorXd::Zero(num_params);
+    double square_error = 0.0, total_weight = 0.0;
+    for (auto &pair : pairs)
+    {
+      const double weight = (double)pair.num_matches;
+      const Pose inverse = ~pair.transform;
+      for (auto &corner : pair.corners)
+      {
+        // the corner as seen from each of the two clouds, in the frame of the first cloud
+        Eigen::Vector3d positions[2] = { poses[pair.ids[0]] * (inverse * corner), poses[pair.ids[1]] * corner };
+        const Eigen::Vector3d error = positions[1] - positions[0];
+        square_error += weight * error.squaredNorm();
+        total_weight += weight;
+        Eigen::Matrix<double, 3, 6> jacobians[2];  // change in positions[c] with change in pose
+        for (int c = 0; c < 2; c++)
+        {
+          jacobians[c] << Eigen::Matrix3d::Identity(), crossMatrix(positions[c]);
+          if (c == 1)
+            jacobians[c] = -jacobians[c];
+        }
+        for (int c = 0; c < 2; c++)
+        {
+          const int row = 6 * (pair.ids[c] - 1);
+          if (row < 0)
+            continue;  // the first cloud's pose is fixed
+          At_b.segment<6>(row) += jacobians[c].transpose() * weight * error;
+          for (int d = 0; d < 2; d++)
+          {
+            const int col = 6 * (pair.ids[d] - 1);
+            if (col >= 0)
+              At_A.block<6, 6>(row, col) += jacobians[c].transpose() * weight * jacobians[d];
+          }
+        }
+      }
+    }
+    if (verbose)
+      std::cout << "pose graph rms corner error: " << std::sqrt(square_error / std::max(total_weight, 1e-10)) << "m"
+                << std::endl;
+    const Eigen::VectorXd x = At_A.ldlt().solve(At_b);
+    for (size_t i = 1; i < poses.size(); i++)
+    {
+      const Eigen::Vector3d translation = x.segment<3>(6 * (i - 1));
+      const Eigen::Vector3d rotation = x.segment<3>(6 * (i - 1) + 3);
+      Eigen::Quaterniond rot = Eigen::Quaterniond::Identity();
+      if (rotation.norm() > 0.0)
+        rot = Eigen::Quaterniond(Eigen::AngleAxisd(rotation.norm(), rotation.normalized()));
+      poses[i] = (Pose(translation, rot) * poses[i]).normalised();
+    }
+    if (x.cwiseAbs().maxCoeff() < 1e-9)
+      break;
+  }
+}
+}  // namespace
+
+bool alignCloudSet(const std::vector<std::string> &file_names, std::vector<Pose> &poses, bool verbose, bool use_cache)
+{
+  const int num_clouds = (int)file_names.size();
+  // each cloud is read only once, and the decimated copies are shared by all of its pairs
+  std::vector<Cloud> clouds(num_clouds);
+  std::vector<double> widths(num_clouds);
+  std::vector<double> spacings(num_clouds);
+  std::vector<Cuboid> bounds(num_clouds);
+  for (int i = 0; i < num_clouds; i++)
+  {
+    widths[i] = 0.0;  // decimated according to the estimated point spacing
+    if (!clouds[i].loadDecimated(file_names[i], widths[i], use_cache, &spacings[i]))
+    {
+      std::cerr << "Error: cannot read cloud " << file_names[i] << std::endl;
+      return false;
+    }
+    clouds[i].calcBounds(&bounds[i].min_bound_, &bounds[i].max_bound_);
+    if (verbose)
+      std::cout << file_names[i] << " decimated to " << clouds[i].ends.size() << " rays at " << widths[i] << "m"
+                << std::endl;
+  }
+
+  // align each overlapping pair in parallel
+  std::vector<PairAlignment> pairs;
+  for (int i = 0; i < num_clouds; i++)
+  {
+    for (int j = i + 1; j < num_clouds; j++)
+    {
+      if (!bounds[i].overlaps(bounds[j]))
+        continue;
+      PairAlignment pair;
+      pair.ids[0] = i;
+      pair.ids[1] = j;
+      pair.transform = Pose::identity();
+      pair.num_points = pair.num_matches = 0;
+      for (auto &corner : pair.corners)
+        corner.setZero();
+      pairs.push_back(pair);
+    }
+  }
+  auto align_pair = [&](int p)
+  {
+    PairAlignment &pair = pairs[p];
+    const double match_distance = kMatchWidths * std::max(widths[pair.ids[0]], widths[pair.ids[1]]);
+    const double point_spacings[2] = { spacings[pair.ids[0]], spacings[pair.ids[1]] };
+    if (!alignPair(clouds[pair.ids[0]], clouds[pair.ids[1]], point_spacings, match_distance, pair))
+      pair.num_matches = 0;
+  };
+#if RAYLIB_WITH_TBB
+  tbb::parallel_for(0, (int)pairs.size(), align_pair);
+#else   // RAYLIB_WITH_TBB
+  for (int p = 0; p < (int)pairs.size(); p++)
+    align_pair(p);
+#endif  // RAYLIB_WITH_TBB
+
+  // keep only the pairs that agree well once aligned, the best first
+  std::vector<PairAlignment> good_pairs;
+  for (auto &pair : pairs)
+  {
+    const double overlap = (double)pair.num_matches / (double)std::max(pair.num_points, 1);
+    if (verbose)
+      std::cout << "pair " << file_names[pair.ids[0]] << " to " << file_names[pair.ids[1]] << ": " << 100.0 * overlap
+                << "% overlap" << (overlap < kMinPairOverlap ? ", not used" : "") << std::endl;
+    if (overlap >= kMinPairOverlap)
+      good_pairs.push_back(pair);
+  }
+  std::stable_sort(good_pairs.begin(), good_pairs.end(),
+    [](const PairAlignment &a, const PairAlignment &b){ return a.num_matches > b.num_matches; });
+
+  // the initial poses come from chaining the best pairs outwards from the first cloud
+  poses.assign(num_clouds, Pose::identity());
+  std::vector<bool> placed(num_clouds, false);
+  placed[0] = true;
+  bool changed = true;
+  while (changed)
+  {
+    changed = false;
+    for (auto &pair : good_pairs)
+    {
+      if (placed[pair.ids[1]] && !placed[pair.ids[0]])
+        poses[pair.ids[0]] = poses[pair.ids[1]] * pair.transform;
+      else if (placed[pair.ids[0]] && !placed[pair.ids[1]])
+        poses[pair.ids[1]] = poses[pair.ids[0]] * ~pair.transform;
+      else
+        continue;
+      placed[pair.ids[0]] = placed[pair.ids[1]] = true;
+      changed = true;
+      break;  // so that the next cloud is also placed from the best available pair
+    }
+  }
+  for (int i = 0; i < num_clouds; i++)
+  {
+    if (!placed[i])
+    {
+      std::cerr << "Error: " << file_names[i] << " does not overlap sufficiently with " << file_names[0]
+                << " or the clouds connected to it" << std::endl;
+      return false;
+    }
+  }
+
+  solvePoseGraph(good_pairs, poses, verbose);
+  return true;
+}
+}  // namespace ray
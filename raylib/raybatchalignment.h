@@ -0,0 +1,27 @@
+// Copyright (c) 2020
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#ifndef RAYLIB_RAYBATCHALIGNMENT_H
+#define RAYLIB_RAYBATCHALIGNMENT_H
+
+#include "raylib/raylibconfig.h"
+
+#include "rayutils.h"
+#include "raypose.h"
+
+namespace ray
+{
+/// Rigidly align a set of overlapping ray cloud files to one another. Each cloud is streamed into a copy decimated
+/// according to its point spacing (see @c Cloud::loadDecimated()). Every pair whose bounds overlap is then coarse and
+/// fine aligned, in parallel, and the pairs that agree well after alignment are combined in a least squares pose 
+/// graph.
+/// On return @c poses holds the transformation of each cloud into the frame of the first cloud.
+/// If @c use_cache then the decimated copies are cached beside the files, for faster repeated runs.
+/// Returns false if a cloud cannot be read, or if any cloud could not be aligned to the others
+bool RAYLIB_EXPORT alignCloudSet(const std::vector<std::string> &file_names, std::vector<Pose> &poses,
+                                 bool verbose = false, bool use_cache = false);
+}  // namespace ray
+
+#endif  // RAYLIB_RAYBATCHALIGNMENT_H
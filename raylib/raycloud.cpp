@@ -7,14 +7,19 @@
 
 #include "raydebugdraw.h"
 #include "raylaz.h"
+#include "rayparse.h"
 #include "rayply.h"
 #include "rayprogress.h"
+#include "rayrandom.h"
 
 #include <nabo/nabo.h>
 
+#include <cstdio>
+#include <fstream>
 #include <iostream>
 #include <limits>
 #include <set>
+#include <sstream>
 // #define OUTPUT_CLOUD_MOMENTS // useful for setting up unit tests comparisons
 
 namespace ray
@@ -44,6 +49,150 @@ bool Cloud::load(const std::string &file_name, bool check_extension)
   return false;
 }
 
+namespace
+{
+/// Decimated clouds are loaded with this many times their estimated point spacing, unless a voxel width is requested
+const double kDecimationSpacings = 2.0;
+/// Part of the cache key, changed whenever the decimation of a given requested width changes, so old caches are unused
+const int kDecimationCacheVersion = 2;
+
+/// The description of a cached decimated cloud, used both to name it and to check that it is still valid
+struct DecimationCacheEntry
+{
+  std::string source;
+  FileStamp stamp;
+  double requested_width;
+  double voxel_width;
+
+  bool sameSource(const DecimationCacheEntry &other) const
+  {
+    return source == other.source && stamp == other.stamp && requested_width == other.requested_width;
+  }
+};
+
+/// Fill in the cache entry describing the current state of @c file_name, returning false if it cannot be found
+bool getCacheEntry(const std::string &file_name, double requested_width, DecimationCacheEntry &entry)
+{
+  if (!getFileStamp(file_name, entry.stamp))
+    return false;
+  entry.source = file_name;
+  entry.requested_width = requested_width;
+  entry.voxel_width = 0.0;
+  return true;
+}
+
+/// The stub of the cache files for @c entry: the source stub followed by a 64 bit FNV-1a hash of the cache version,
+/// source name and requested width. The source's stamp is not part of the name, so a changed source overwrites its stale cache 
+/// rather than adding another. The full description is stored alongside, and checked on loading
+std::string cacheStub(const DecimationCacheEntry &entry)
+{
+  std::ostringstream key;
+  key.precision(17);
+  key << kDecimationCacheVersion << "|" << entry.source << "|" << entry.requested_width;
+  uint64_t hash = 14695981039346656037ULL;
+  for (const char &c : key.str())
+  {
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 1099511628211ULL;
+  }
+  std::ostringstream stub;
+  stub << getFileNameStub(entry.source) << "_decimated_" << std::hex << hash;
+  return stub.str();
+}
+
+bool readCacheEntry(const std::string &file_name, DecimationCacheEntry &entry)
+{
+  std::ifstream ifs(file_name.c_str(), std::ios::in);
+  if (!ifs)
+    return false;
+  std::string comment;
+  getline(ifs, comment);
+  getline(ifs, entry.source);
+  ifs >> entry.stamp.size >> entry.stamp.modified >> entry.stamp.content_hash >> entry.requested_width >> 
+    entry.voxel_width;
+  return !ifs.fail();
+}
+
+bool writeCacheEntry(const std::string &file_name, const DecimationCacheEntry &entry)
+{
+  std::ofstream ofs(file_name.c_str(), std::ios::out);
+  if (ofs.fail())
+    return false;
+  ofs.precision(17);
+  ofs << "%source file, then its size, modification time (ns), content hash, requested voxel width and voxel width "
+         "used" << std::endl;
+  ofs << entry.source << std::endl;
+  ofs << entry.stamp.size << " " << entry.stamp.modified << " " << entry.stamp.content_hash << " " 
+      << entry.requested_width << " " << entry.voxel_width << std::endl;
+  return !ofs.fail();
+}
+}  // namespace
+
+bool Cloud::loadDecimated(const std::string &file_name, double &voxel_width, bool use_cache, double *point_spacing)
+{
+  clear();
+  const bool estimate_width = voxel_width <= 0.0;
+  if (point_spacing)
+    *point_spacing = 0.0;
+  DecimationCacheEntry entry;
+  std::string cache_stub;
+  if (use_cache)
+  {
+    if (!getCacheEntry(file_name, voxel_width, entry))
+    {
+      std::cerr << "Error: cannot find ray cloud file " << file_name << std::endl;
+      return false;
+    }
+    cache_stub = cacheStub(entry);
+    DecimationCacheEntry cached;
+    if (readCacheEntry(cache_stub + ".txt", cached) && cached.sameSource(entry) && load(cache_stub + ".ply"))
+    {
+      std::cout << "using cached decimation " << cache_stub << ".ply of " << file_name << std::endl;
+      voxel_width = cached.voxel_width;
+      if (point_spacing && estimate_width)
+        *point_spacing = voxel_width / kDecimationSpacings;
+      return true;
+    }
+    clear();
+  }
+  if (estimate_width)
+  {
+    Info info;
+    if (!getInfo(file_name, info))
+      return false;
+    std::string name = file_name;
+    const double spacing = estimatePointSpacing(name, info.ends_bound, info.num_bounded);
+    if (spacing <= 0.0)
+      return false;
+    voxel_width = kDecimationSpacings * spacing;
+    if (point_spacing)
+      *point_spacing = spacing;
+  }
+  std::unordered_set<Eigen::Vector3i, Vector3iHash> voxel_set;
+  std::vector<int64_t> subsample;
+  auto decimate = [&](std::vector<Eigen::Vector3d> &chunk_starts, std::vector<Eigen::Vector3d> &chunk_ends,
+                      std::vector<double> &chunk_times, std::vector<RGBA> &chunk_colours)
+  {
+    subsample.clear();
+    voxelSubsample(chunk_ends, voxel_width, subsample, voxel_set);
+    for (auto &id : subsample)
+      addRay(chunk_starts[id], chunk_ends[id], chunk_times[id], chunk_colours[id]);
+  };
+  if (!read(file_name, decimate))
+    return false;
+  if (use_cache)
+  {
+    // the cache is only an optimisation, so failing to write it is not an error. The stale description is removed
+    // first, so an interrupted write is never mistaken for a valid cache
+    entry.voxel_width = voxel_width;
+    std::remove((cache_stub + ".txt").c_str());
+    if (!writePlyRayCloud(cache_stub + ".ply", starts, ends, times, colours) || 
+        !writeCacheEntry(cache_stub + ".txt", entry))
+      std::cerr << "Warning: cannot write the decimation cache " << cache_stub << ".txt" << std::endl;
+  }
+  return true;
+}
+
 bool Cloud::loadPLY(const std::string &file)
 {
   bool res = readPly(file, starts, ends, times, colours, true);
@@ -322,82 +471,135 @@ bool RAYLIB_EXPORT Cloud::getInfo(const std::string &file_name, Info &info)
 }
 
 
-double Cloud::estimatePointSpacing(std::string &file_name, const Cuboid &bounds, int num_points)
+namespace
+{
+// two-iteration estimation, modelling the point distribution by the below exponent.
+// larger exponents (towards 2.5) match thick forests, lower exponents (towards 2) match smooth terrain and surfaces
+const double cloud_exponent = 2.0; // model num_points = (cloud_width/voxel_width)^cloud_exponent
+// larger clouds have their point spacing estimated from a random sample of this many points
+const size_t max_spacing_samples = 1000000;
+// the sampling error is estimated from the spread of estimates on this many interleaved subsets of the sample
+const int num_spacing_subsets = 4;
+
+/// Estimate the spacing of the points given by @c point(i) for i in @c 0 to @c num_items-1, which returns nullptr
+/// for any item that is not a point. There are @c num_points points within @c extent. 
+double voxelPointSpacing(const Eigen::Vector3d &extent, size_t num_items, size_t num_points, 
+                         const std::function<const Eigen::Vector3d *(size_t)> &point, bool verbose)
 {
-  // two-iteration estimation, modelling the point distribution by the below exponent.
-  // larger exponents (towards 2.5) match thick forests, lower exponents (towards 2) match smooth terrain and surfaces
-  const double cloud_exponent = 2.0; // model num_points = (cloud_width/voxel_width)^cloud_exponent
-
-  Eigen::Vector3d extent = bounds.max_bound_ - bounds.min_bound_;
   double cloud_width = pow(extent[0]*extent[1]*extent[2], 1.0/3.0); // an average
   double voxel_width = cloud_width / pow((double)num_points, 1.0/cloud_exponent);
   voxel_width *= 5.0; // we want to use a larger width because this process only works when the width is an overestimation
-  std::cout << "initial voxel width estimate: " << voxel_width << std::endl;
-  double num_voxels = 0;
+  if (verbose)
+    std::cout << "initial voxel width estimate: " << voxel_width << std::endl;
   std::set<Eigen::Vector3i, Vector3iLess> test_set;
+  for (size_t i = 0; i < num_items; i++)
+  {
+    const Eigen::Vector3d *p = point(i);
+    if (!p)
+      continue;
+    test_set.insert(Eigen::Vector3i(int(std::floor((*p)[0] / voxel_width)), int(std::floor((*p)[1] / voxel_width)),
+                                    int(std::floor((*p)[2] / voxel_width))));
+  }
+  double points_per_voxel = (double)num_points / (double)test_set.size();
+  return voxel_width / pow(points_per_voxel, 1.0/cloud_exponent);
+}
+
+/// Estimate the spacing of a cloud of @c num_points points from a random @c sample of them. Under the 
+/// cloud_exponent model, a sample is sparser than the full cloud by a known factor, so its spacing is scaled down
+/// accordingly. @c error is given the standard error, from the spread of the estimates on subsets of the sample
+double sampledPointSpacing(const Eigen::Vector3d &extent, size_t num_points, const std::vector<Eigen::Vector3d> &sample, 
+                           double *error)
+{
+  auto sample_point = [&](size_t i) { return &sample[i]; };
+  double width = voxelPointSpacing(extent, sample.size(), sample.size(), sample_point, true) * 
+    pow((double)sample.size() / (double)num_points, 1.0/cloud_exponent);
 
-  auto estimate_size = [&](std::vector<Eigen::Vector3d> &, std::vector<Eigen::Vector3d> &ends, std::vector<double> &, std::vector<ray::RGBA> &colours)
+  double sum = 0.0, sum_sqr = 0.0;
+  for (int j = 0; j < num_spacing_subsets; j++)
   {
-    for (unsigned int i = 0; i < ends.size(); i++)
-    {
-      if (colours[i].alpha == 0)
-        continue;
+    const size_t subset_size = (sample.size() + num_spacing_subsets - 1 - j) / num_spacing_subsets;
+    auto subset_point = [&](size_t i) { return &sample[j + i * num_spacing_subsets]; };
+    const double subset_width = voxelPointSpacing(extent, subset_size, subset_size, subset_point, false) * 
+      pow((double)subset_size / (double)num_points, 1.0/cloud_exponent);
+    sum += subset_width;
+    sum_sqr += subset_width * subset_width;
+  }
+  const double mean = sum / (double)num_spacing_subsets;
+  const double variance = std::max(0.0, sum_sqr / (double)num_spacing_subsets - mean * mean) * 
+    (double)num_spacing_subsets / (double)(num_spacing_subsets - 1);
+  // the full sample is num_spacing_subsets times larger than each subset, so its error is smaller by the square root
+  const double standard_error = std::sqrt(variance / (double)num_spacing_subsets);
+  std::cout << "estimated point spacing: " << width << " +- " << standard_error << " from " << sample.size() 
+            << " of " << num_points << " points" << std::endl;
+  if (error)
+    *error = standard_error;
+  return width;
+}
+}
 
-      const Eigen::Vector3d &point = ends[i];
-      Eigen::Vector3i place(int(std::floor(point[0] / voxel_width)), int(std::floor(point[1] / voxel_width)),
-                            int(std::floor(point[2] / voxel_width)));
-      if (test_set.find(place) == test_set.end())
-      {
-        test_set.insert(place);
-        num_voxels++;
-      }
+double Cloud::estimatePointSpacing(std::string &file_name, const Cuboid &bounds, int num_points, double *error)
+{
+  const Eigen::Vector3d extent = bounds.max_bound_ - bounds.min_bound_;
+  // a random sample of rows is read from larger files, only the bounded points are used
+  std::vector<Eigen::Vector3d> sample;
+  auto add_sample = [&](std::vector<Eigen::Vector3d> &, std::vector<Eigen::Vector3d> &ends, std::vector<double> &, std::vector<ray::RGBA> &colours)
+  {
+    for (size_t i = 0; i < ends.size(); i++)
+    {
+      if (colours[i].alpha != 0)
+        sample.push_back(ends[i]);
     }
   };  
-  if (!readPly(file_name, true, estimate_size, 0))
+  if (!readPly(file_name, true, add_sample, 0, 1000000, max_spacing_samples) || sample.empty())
     return 0;
 
-  double points_per_voxel = (double)num_points / num_voxels;
-  double width = voxel_width / pow(points_per_voxel, 1.0/cloud_exponent);
+  if (sample.size() < static_cast<size_t>(num_points))
+    return sampledPointSpacing(extent, num_points, sample, error);
+  auto sample_point = [&](size_t i) { return &sample[i]; };
+  const double width = voxelPointSpacing(extent, sample.size(), num_points, sample_point, true);
   std::cout << "estimated point spacing: " << width << std::endl;
+  if (error)
+    *error = 0.0;
   return width;
 }
 
-double Cloud::estimatePointSpacing() const
+double Cloud::estimatePointSpacing(double *error) const
 {
-  // two-iteration estimation, modelling the point distribution by the below exponent.
-  // larger exponents (towards 2.5) match thick forests, lower exponents (towards 2) match smooth terrain and surfaces
-  const double cloud_exponent = 2.0; // model num_points = (cloud_width/voxel_width)^cloud_exponent
-
   Eigen::Vector3d min_bound, max_bound;
   calcBounds(&min_bound, &max_bound, kBFEnd);
-  Eigen::Vector3d extent = max_bound - min_bound;
-  int num_points = 0;
+  const Eigen::Vector3d extent = max_bound - min_bound;
+  size_t num_points = 0;
   for (unsigned int i = 0; i < ends.size(); i++)
     if (rayBounded(i))
       num_points++;
-  double cloud_width = pow(extent[0]*extent[1]*extent[2], 1.0/3.0); // an average
-  double voxel_width = cloud_width / pow((double)num_points, 1.0/cloud_exponent);
-  voxel_width *= 5.0; // we want to use a larger width because this process only works when the width is an overestimation
-  std::cout << "initial voxel width estimate: " << voxel_width << std::endl;
-  double num_voxels = 0;
-  std::set<Eigen::Vector3i, Vector3iLess> test_set;
-  for (unsigned int i = 0; i < ends.size(); i++)
+
+  if (num_points > max_spacing_samples)
   {
-    if (rayBounded(i))
+    // a stratified random sample of the bounded points, one from each equal section of the cloud
+    std::vector<Eigen::Vector3d> sample;
+    sample.reserve(max_spacing_samples);
+    PCGRandomGenerator generator;
+    size_t section_end = 0, sample_index = 0, point_index = 0;
+    for (unsigned int i = 0; i < ends.size(); i++)
     {
-      const Eigen::Vector3d &point = ends[i];
-      Eigen::Vector3i place(int(std::floor(point[0] / voxel_width)), int(std::floor(point[1] / voxel_width)),
-                            int(std::floor(point[2] / voxel_width)));
-      if (test_set.find(place) == test_set.end())
+      if (!rayBounded(i))
+        continue;
+      if (point_index == section_end)
       {
-        test_set.insert(place);
-        num_voxels++;
+        const size_t section_start = section_end;
+        section_end = ((sample.size() + 1) * num_points) / max_spacing_samples;
+        sample_index = section_start + generator() % (section_end - section_start);
       }
+      if (point_index++ == sample_index)
+        sample.push_back(ends[i]);
     }
+    return sampledPointSpacing(extent, num_points, sample, error);
   }
-  double points_per_voxel = (double)num_points / num_voxels;
-  double width = voxel_width / pow(points_per_voxel, 1.0/cloud_exponent);
+  auto bounded_point = [&](size_t i) { return rayBounded(i) ? &ends[i] : nullptr; };
+  const double width = voxelPointSpacing(extent, ends.size(), num_points, bounded_point, true);
   std::cout << "estimated point spacing: " << width << std::endl;
+  if (error)
+    *error = 0.0;
   return width;
 }
 
@@ -57,6 +57,16 @@ public:
   void save(const std::string &file_name) const;
   /// load a ray cloud file. @c check_extension checks the file extension before proceeding
   bool load(const std::string &file_name, bool check_extension = true);
+  /// load a ray cloud file streamed, keeping only the first ray in each voxel of width @c voxel_width, so that only 
+  /// the decimated cloud needs to fit in memory. If @c voxel_width is 0 then it is set to twice the file's estimated 
+  /// point spacing, the finest spacing that @c FineAlignment uses, and the estimate is returned in @c point_spacing 
+  /// (otherwise @c point_spacing is set to 0, as it is not estimated)
+  /// If @c use_cache then the decimated cloud is also saved next to the file, as <stub>_decimated_<key>.ply, where the
+  /// key is a hash of the file's name and the requested @c voxel_width. Later calls load this copy instead of reading 
+  /// the whole file, provided the file's size, modification time and sampled contents (see @c FileStamp) are 
+  /// unchanged, so repeated runs on unchanged files start quickly. A changed file overwrites its stale copy
+  bool loadDecimated(const std::string &file_name, double &voxel_width, bool use_cache = false,
+                     double *point_spacing = nullptr);
 
   /// minimum bounds of all bounded rays
   Eigen::Vector3d calcMinBound() const;
@@ -95,8 +105,9 @@ public:
   void split(Cloud &cloud1, Cloud &cloud2, std::function<bool(int i)> fptr);
 
   /// estimate the average spacing between end points of the ray cloud. This should be similar to the voxel
-  /// width used on any spatially decimated ray clouds
-  double estimatePointSpacing() const;
+  /// width used on any spatially decimated ray clouds. Large clouds are estimated from a random sample of their
+  /// points, in which case @c error (if set) is given the standard error of the estimate, otherwise it is zero
+  double estimatePointSpacing(double *error = nullptr) const;
 
   /// Calculate the ray cloud bounds. By default, the bounds only consder the ray end points. This behaviour
   /// can be modified via the @p flags argument.
@@ -112,8 +123,10 @@ public:
 
   /// Static functions. These operate on the cloud file, and so do not require the full file to fit in memory
 
-  /// Version for estimating the spacing between points for raycloud files. 
-  static double estimatePointSpacing(std::string &file_name, const Cuboid &bounds, int num_points);
+  /// Version for estimating the spacing between points for raycloud files. Large files are estimated from a random
+  /// sample of rows, read without a full pass over the file. @c error is set as in the member version
+  static double estimatePointSpacing(std::string &file_name, const Cuboid &bounds, int num_points, 
+                                     double *error = nullptr);
 
   /// Calculate the key information of a ray cloud, such as its bounds
   /// @c ends are only the bounded ones. @c starts are for all rays
@@ -8,51 +8,342 @@
 #include "raycloud.h"
 #include "rayprogress.h"
 
-#include <nabo/nabo.h>
-
-#include <memory>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <unordered_map>
 
 #if RAYLIB_WITH_TBB
+#include <tbb/enumerable_thread_specific.h>
 #include <tbb/parallel_for.h>
+#include <tbb/parallel_sort.h>
 #endif // RAYLIB_WITH_TBB
 
 namespace ray
 {
+namespace
+{
+/// The number of nearest neighbours (including the point itself) used to shape each ellipsoid
+const int kSearchSize = 16;
+/// Neighbours are searched ring by ring up to this many voxels away. Beyond this the searched region doubles in width
+/// each step, using a pyramid of coarser voxels, so isolated points do not step through large empty regions.
+const int kMaxSearchRing = 4;
+
+/// Working memory for one thread's neighbour searches
+struct NeighbourScratch
+{
+  std::vector<int> candidates;
+  std::vector<int> shell;
+  std::vector<std::pair<double, int>> distances;
+  std::vector<int> neighbours;
+};
+
+/// The index of the voxel at @p level of a voxel pyramid that contains voxel @p index of the finest level, where each
+/// level's voxels are twice the width of the level below
+inline Eigen::Vector3i coarseIndex(const Eigen::Vector3i &index, int level)
+{
+  Eigen::Vector3i coarse;
+  for (int i = 0; i < 3; i++)
+  {
+    coarse[i] = index[i] >= 0 ? index[i] >> level : -((-index[i] - 1) >> level) - 1;
+  }
+  return coarse;
+}
+
+/// Calls @p visit for each voxel index at Chebyshev distance @p ring from @p centre
+template <class Visit>
+inline void visitRing(const Eigen::Vector3i &centre, int ring, const Visit &visit)
+{
+  for (int x = -ring; x <= ring; x++)
+  {
+    for (int y = -ring; y <= ring; y++)
+    {
+      const bool on_shell = std::abs(x) == ring || std::abs(y) == ring;
+      for (int z = -ring; z <= ring; z += on_shell ? 1 : 2 * std::max(ring, 1))
+      {
+        visit(centre + Eigen::Vector3i(x, y, z));
+      }
+    }
+  }
+}
+
+/// End points bucketed into a sparse voxel grid, for exact k-nearest neighbour searches that only look at the
+/// voxels near each point. The points of each voxel are contiguous in @c order . The occupied voxels are also grouped
+/// into a pyramid of coarser voxels, which bounds the search around isolated points.
+class PointVoxels
+{
+public:
+  PointVoxels(const std::vector<Eigen::Vector3d> &points, double voxel_width)
+    : points_(points)
+    , voxel_width_(voxel_width)
+  {
+    std::vector<std::pair<Eigen::Vector3i, int>> voxel_points(points.size());
+    for (size_t i = 0; i < points.size(); i++)
+    {
+      voxel_points[i] = std::make_pair(voxelOf(points[i]), (int)i);
+    }
+    const auto less = [](const std::pair<Eigen::Vector3i, int> &a, const std::pair<Eigen::Vector3i, int> &b) {
+      return Vector3iLess()(a.first, b.first) || (a.first == b.first && a.second < b.second);
+    };
+#if RAYLIB_WITH_TBB
+    tbb::parallel_sort(voxel_points.begin(), voxel_points.end(), less);
+#else   // RAYLIB_WITH_TBB
+    std::sort(voxel_points.begin(), voxel_points.end(), less);
+#endif  // RAYLIB_WITH_TBB
+
+    order.resize(points.size());
+    for (size_t i = 0; i < voxel_points.size(); i++)
+    {
+      order[i] = voxel_points[i].second;
+      if (i == 0 || voxel_points[i].first != voxel_points[i - 1].first)
+      {
+        voxels.push_back(Voxel{ voxel_points[i].first, (int)i, (int)i });
+      }
+      voxels.back().end++;
+    }
+    lookup_.reserve(voxels.size());
+    for (size_t i = 0; i < voxels.size(); i++)
+    {
+      lookup_[voxels[i].index] = (int)i;
+    }
+
+    // each coarser level holds the occupied voxels of the level below, until the top level's voxels are adjacent, so
+    // its first ring covers the whole cloud
+    size_t num_nodes = voxels.size();
+    for (;;)
+    {
+      Eigen::Vector3i min_index = Eigen::Vector3i::Constant(std::numeric_limits<int>::max());
+      Eigen::Vector3i max_index = Eigen::Vector3i::Constant(std::numeric_limits<int>::lowest());
+      for (size_t i = 0; i < num_nodes; i++)
+      {
+        min_index = min_index.cwiseMin(nodeIndex((int)pyramid_.size(), (int)i));
+        max_index = max_index.cwiseMax(nodeIndex((int)pyramid_.size(), (int)i));
+      }
+      if (((max_index - min_index).array() <= 1).all())
+      {
+        break;
+      }
+      const int level = (int)pyramid_.size() + 1;
+      pyramid_.emplace_back();
+      CoarseLevel &coarse = pyramid_.back();
+      for (size_t i = 0; i < num_nodes; i++)
+      {
+        const Eigen::Vector3i index = coarseIndex(nodeIndex(level - 1, (int)i), 1);
+        const auto found = coarse.lookup.insert(std::make_pair(index, (int)coarse.indices.size()));
+        if (found.second)
+        {
+          coarse.indices.push_back(index);
+          coarse.children.emplace_back();
+        }
+        coarse.children[found.first->second].push_back((int)i);
+      }
+      num_nodes = coarse.indices.size();
+    }
+  }
+
+  struct Voxel
+  {
+    Eigen::Vector3i index;
+    int begin, end;  ///< range within @c order
+  };
+
+  /// Add the points in the voxels at Chebyshev distance @p ring from @p centre to @p candidates
+  void addRing(const Eigen::Vector3i &centre, int ring, std::vector<int> &candidates) const
+  {
+    visitRing(centre, ring, [&](const Eigen::Vector3i &index) {
+      const auto it = lookup_.find(index);
+      if (it != lookup_.end())
+      {
+        const Voxel &voxel = voxels[it->second];
+        candidates.insert(candidates.end(), order.begin() + voxel.begin, order.begin() + voxel.end);
+      }
+    });
+  }
+
+  /// Find the @p k nearest neighbours of the point @p index in voxel @p voxel , given @p scratch.candidates already
+  /// holds the points within @p ring voxels. The result is in @p scratch.neighbours , nearest first. This has fewer
+  /// than @p k neighbours only when the whole cloud does.
+  void nearest(int index, const Voxel &voxel, int ring, int k, NeighbourScratch &scratch) const
+  {
+    const Eigen::Vector3d &point = points_[index];
+    scratch.distances.clear();
+    for (const auto &id : scratch.candidates)
+    {
+      scratch.distances.emplace_back((points_[id] - point).squaredNorm(), id);
+    }
+    // The searched region is the box of finest voxels from box_min to box_max. The k nearest candidates are exact once
+    // the k'th distance is within this box, since any point outside of it is further away. Otherwise we search the next
+    // ring, or once kMaxSearchRing rings have been searched, the box of the next coarser pyramid level that contains
+    // the searched region.
+    Eigen::Vector3i box_min = voxel.index - Eigen::Vector3i::Constant(ring);
+    Eigen::Vector3i box_max = voxel.index + Eigen::Vector3i::Constant(ring);
+    int level = 0;
+    for (;;)
+    {
+      const int num = std::min(k, (int)scratch.distances.size());
+      std::partial_sort(scratch.distances.begin(), scratch.distances.begin() + num, scratch.distances.end());
+      const Eigen::Vector3d clearance =
+        (point - box_min.cast<double>() * voxel_width_)
+          .cwiseMin((box_max + Eigen::Vector3i::Ones()).cast<double>() * voxel_width_ - point);
+      const double searched = std::max(clearance.minCoeff(), 0.0);
+      if ((num == k && scratch.distances[num - 1].first <= searched * searched) ||
+          scratch.distances.size() == points_.size())
+      {
+        break;
+      }
+      scratch.shell.clear();
+      const Eigen::Vector3i old_min = box_min, old_max = box_max;
+      if ((level == 0 && ring < kMaxSearchRing) || level == (int)pyramid_.size())
+      {
+        ring++;
+        visitRing(coarseIndex(voxel.index, level), ring, [&](const Eigen::Vector3i &node_index) {
+          addOutside(level, node_index, old_min, old_max, scratch.shell);
+        });
+      }
+      else
+      {
+        // the smallest ring of the coarser level that contains the searched box
+        level++;
+        const Eigen::Vector3i centre = coarseIndex(voxel.index, level);
+        for (ring = 1; (coarseIndex(old_min, level) - centre).cwiseAbs().maxCoeff() > ring ||
+                       (coarseIndex(old_max, level) - centre).cwiseAbs().maxCoeff() > ring;
+             ring++)
+        {
+        }
+        for (int r = 0; r <= ring; r++)
+        {
+          visitRing(centre, r, [&](const Eigen::Vector3i &node_index) {
+            addOutside(level, node_index, old_min, old_max, scratch.shell);
+          });
+        }
+      }
+      const int scale = 1 << level;
+      box_min = (coarseIndex(voxel.index, level) - Eigen::Vector3i::Constant(ring)) * scale;
+      box_max = (coarseIndex(voxel.index, level) + Eigen::Vector3i::Constant(ring + 1)) * scale -
+                Eigen::Vector3i::Ones();
+      for (const auto &id : scratch.shell)
+      {
+        scratch.distances.emplace_back((points_[id] - point).squaredNorm(), id);
+      }
+    }
+    scratch.neighbours.clear();
+    for (int j = 0; j < std::min(k, (int)scratch.distances.size()); j++)
+    {
+      scratch.neighbours.push_back(scratch.distances[j].second);
+    }
+  }
+
+  std::vector<int> order;
+  std::vector<Voxel> voxels;
+
+private:
+  /// The occupied voxels of one pyramid level, each with the ids of the occupied voxels within it at the level below
+  struct CoarseLevel
+  {
+    std::unordered_map<Eigen::Vector3i, int, Vector3iHash> lookup;
+    std::vector<Eigen::Vector3i> indices;
+    std::vector<std::vector<int>> children;
+  };
+
+  /// The voxel index of node @p node at pyramid level @p level , where level 0 is the finest voxels
+  inline const Eigen::Vector3i &nodeIndex(int level, int node) const
+  {
+    return level == 0 ? voxels[node].index : pyramid_[level - 1].indices[node];
+  }
+
+  /// Whether voxel @p node_index at pyramid level @p level lies within the box of finest voxels from @p old_min to
+  /// @p old_max
+  static bool within(int level, const Eigen::Vector3i &node_index, const Eigen::Vector3i &old_min,
+                     const Eigen::Vector3i &old_max)
+  {
+    const int scale = 1 << level;
+    const Eigen::Vector3i node_min = node_index * scale;
+    const Eigen::Vector3i node_max = node_min + Eigen::Vector3i::Constant(scale - 1);
+    return (node_min.array() >= old_min.array()).all() && (node_max.array() <= old_max.array()).all();
+  }
+
+  /// Add to @p shell the points in voxel @p node_index at pyramid level @p level , if occupied, excluding those in the
+  /// already searched box of finest voxels from @p old_min to @p old_max
+  void addOutside(int level, const Eigen::Vector3i &node_index, const Eigen::Vector3i &old_min,
+                  const Eigen::Vector3i &old_max, std::vector<int> &shell) const
+  {
+    if (within(level, node_index, old_min, old_max))
+    {
+      return;
+    }
+    const auto &lookup = level == 0 ? lookup_ : pyramid_[level - 1].lookup;
+    const auto it = lookup.find(node_index);
+    if (it != lookup.end())
+    {
+      addNode(level, it->second, old_min, old_max, shell);
+    }
+  }
+
+  void addNode(int level, int node, const Eigen::Vector3i &old_min, const Eigen::Vector3i &old_max,
+               std::vector<int> &shell) const
+  {
+    if (within(level, nodeIndex(level, node), old_min, old_max))
+    {
+      return;  // already searched
+    }
+    if (level == 0)
+    {
+      const Voxel &voxel = voxels[node];
+      shell.insert(shell.end(), order.begin() + voxel.begin, order.begin() + voxel.end);
+      return;
+    }
+    for (const auto &child : pyramid_[level - 1].children[node])
+    {
+      addNode(level - 1, child, old_min, old_max, shell);
+    }
+  }
+
+  inline Eigen::Vector3i voxelOf(const Eigen::Vector3d &point) const
+  {
+    return Eigen::Vector3i(int(std::floor(point[0] / voxel_width_)), int(std::floor(point[1] / voxel_width_)),
+                           int(std::floor(point[2] / voxel_width_)));
+  }
+
+  const std::vector<Eigen::Vector3d> &points_;
+  double voxel_width_;
+  std::unordered_map<Eigen::Vector3i, int, Vector3iHash> lookup_;
+  /// The coarser levels of the voxel pyramid, each with voxels twice the width of the level below
+  std::vector<CoarseLevel> pyramid_;
+};
+}  // namespace
+
 void generateEllipsoids(std::vector<Ellipsoid> *ellipsoids, Eigen::Vector3d *bounds_min, Eigen::Vector3d *bounds_max,
                         const Cloud &cloud, Progress *progress)
 {
   ellipsoids->clear();
   ellipsoids->resize(cloud.rayCount());
-  int search_size = 16;
   const double max_double = std::numeric_limits<double>::max();
   Eigen::Vector3d ellipsoids_min(max_double, max_double, max_double);
   Eigen::Vector3d ellipsoids_max(-max_double, -max_double, -max_double);
-  Nabo::Parameters params("bucketSize", 8);
 
   if (progress)
   {
-    progress->begin("generateEllipsoids - KDTree", 2);
+    progress->begin("generateEllipsoids - voxels", 1);
   }
 
-  Eigen::MatrixXd points_p(3, cloud.ends.size());
+  // Choose a voxel width that holds a few points per voxel, modelling the points as lying on a surface. This only
+  // affects speed, the neighbour search widens as required.
+  Eigen::Vector3d min_bound(0, 0, 0), max_bound(0, 0, 0);
+  size_t num_bounded = 0;
   for (size_t i = 0; i < cloud.rayCount(); ++i)
   {
-    points_p.col(i) = cloud.ends[i];
+    num_bounded += cloud.rayBounded(i) ? 1 : 0;
   }
-  std::unique_ptr<Nabo::NNSearchD> nns(Nabo::NNSearchD::createKDTreeLinearHeap(points_p, 3));
-
-  // Run the search
-  Eigen::MatrixXi indices;
-  Eigen::MatrixXd dists2;
-  indices.resize(search_size, cloud.rayCount());
-  dists2.resize(search_size, cloud.rayCount());
-
-  if (progress)
+  cloud.calcBounds(&min_bound, &max_bound);
+  Eigen::Vector3d extent = max_bound - min_bound;
+  std::sort(extent.data(), extent.data() + 3);
+  const double surface_width = std::sqrt(extent[1] * extent[2]);
+  double voxel_width = 2.0 * surface_width / std::sqrt((double)std::max(num_bounded, size_t(1)));
+  if (!(voxel_width > 0.0) || !std::isfinite(voxel_width))
   {
-    progress->increment();
+    voxel_width = 1.0;
   }
-  nns->knn(points_p, indices, dists2, search_size, kNearestNeighbourEpsilon, 0);
-  nns.reset(nullptr);
+  const PointVoxels point_voxels(cloud.ends, voxel_width);
 
   if (progress)
   {
@@ -60,7 +351,7 @@ void generateEllipsoids(std::vector<Ellipsoid> *ellipsoids, Eigen::Vector3d *bou
     progress->end();
     progress->begin("generateEllipsoids", cloud.ends.size());
   }
-  const auto generate_ellipsoid = [&](size_t i)  // 
+  const auto generate_ellipsoid = [&](size_t i, const std::vector<int> &neighbours)  //
   {
     Ellipsoid &ellipsoid = (*ellipsoids)[i];
     ellipsoid.clear();
@@ -82,9 +373,8 @@ void generateEllipsoids(std::vector<Ellipsoid> *ellipsoids, Eigen::Vector3d *bou
     scatter.setZero();
     Eigen::Vector3d centroid(0, 0, 0);
     double num_neighbours = 0;
-    for (int j = 0; j < search_size && indices(j, i) > -1; ++j)
+    for (const auto &index : neighbours)
     {
-      int index = indices(j, i);
       if (cloud.rayBounded(index))
       {
         centroid += cloud.ends[index];
@@ -96,9 +386,8 @@ void generateEllipsoids(std::vector<Ellipsoid> *ellipsoids, Eigen::Vector3d *bou
       return;
     }
     centroid /= num_neighbours;
-    for (int j = 0; j < search_size && indices(j, i) > -1; j++)
+    for (const auto &index : neighbours)
     {
-      int index = indices(j, i);
       if (cloud.rayBounded(index))
       {
         Eigen::Vector3d offset = cloud.ends[index] - centroid;
@@ -126,27 +415,43 @@ void generateEllipsoids(std::vector<Ellipsoid> *ellipsoids, Eigen::Vector3d *bou
     ellipsoid.setPlanarity(eigen_value);
   };
 
-#if RAYLIB_WITH_TBB
-  tbb::parallel_for<size_t>(0, cloud.rayCount(), generate_ellipsoid);
-
-  for (size_t i = 0; i < ellipsoids->size(); ++i)
+  // Each voxel is processed as a unit, its points sharing the candidate neighbours from the surrounding voxels
+  const auto process_voxel = [&](const PointVoxels::Voxel &voxel, NeighbourScratch &scratch)  //
   {
-    Ellipsoid &ellipsoid = (*ellipsoids)[i];
-    const auto ellipsoid_min = ellipsoid.pos - ellipsoid.extents;
-    const auto ellipsoid_max = ellipsoid.pos + ellipsoid.extents;
+    scratch.candidates.clear();
+    point_voxels.addRing(voxel.index, 0, scratch.candidates);
+    point_voxels.addRing(voxel.index, 1, scratch.candidates);
+    for (int j = voxel.begin; j < voxel.end; j++)
+    {
+      const int i = point_voxels.order[j];
+      if (cloud.rayBounded(i))
+      {
+        point_voxels.nearest(i, voxel, 1, kSearchSize, scratch);
+      }
+      else
+      {
+        scratch.neighbours.clear();
+      }
+      generate_ellipsoid(i, scratch.neighbours);
+    }
+  };
 
-    ellipsoids_min.x() = std::min(ellipsoids_min.x(), ellipsoid_min.x());
-    ellipsoids_min.y() = std::min(ellipsoids_min.y(), ellipsoid_min.y());
-    ellipsoids_min.z() = std::min(ellipsoids_min.z(), ellipsoid_min.z());
-    ellipsoids_max.x() = std::max(ellipsoids_max.x(), ellipsoid_max.x());
-    ellipsoids_max.y() = std::max(ellipsoids_max.y(), ellipsoid_max.y());
-    ellipsoids_max.z() = std::max(ellipsoids_max.z(), ellipsoid_max.z());
-  }
+#if RAYLIB_WITH_TBB
+  tbb::enumerable_thread_specific<NeighbourScratch> thread_scratch;
+  tbb::parallel_for<size_t>(0, point_voxels.voxels.size(), [&](size_t v)  //
+  {
+    process_voxel(point_voxels.voxels[v], thread_scratch.local());
+  });
 #else  // RAYLIB_WITH_TBB
-  for (size_t i = 0; i < cloud.rayCount(); ++i)
+  NeighbourScratch scratch;
+  for (const auto &voxel : point_voxels.voxels)
   {
-    generate_ellipsoid(i);
+    process_voxel(voxel, scratch);
+  }
+#endif // RAYLIB_WITH_TBB
 
+  for (size_t i = 0; i < ellipsoids->size(); ++i)
+  {
     Ellipsoid &ellipsoid = (*ellipsoids)[i];
     const auto ellipsoid_min = ellipsoid.pos - ellipsoid.extents;
     const auto ellipsoid_max = ellipsoid.pos + ellipsoid.extents;
@@ -158,7 +463,6 @@ void generateEllipsoids(std::vector<Ellipsoid> *ellipsoids, Eigen::Vector3d *bou
     ellipsoids_max.y() = std::max(ellipsoids_max.y(), ellipsoid_max.y());
     ellipsoids_max.z() = std::max(ellipsoids_max.z(), ellipsoid_max.z());
   }
-#endif // RAYLIB_WITH_TBB
 
   if (bounds_min)
   {
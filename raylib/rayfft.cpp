@@ -0,0 +1,423 @@
+// Copyright (c) 2020
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#include "rayfft.h"
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#if RAYLIB_WITH_TBB
+#include <tbb/parallel_for.h>
+#endif  // RAYLIB_WITH_TBB
+
+namespace ray
+{
+namespace
+{
+using Complex = std::complex<double>;
+
+/// A reusable factorisation and table of twiddle factors, for 1D complex transforms of one length and direction.
+/// The transforms are unscaled. Plans are immutable once built, so can be shared between threads
+class FFTPlan
+{
+public:
+  FFTPlan(int length, bool inverse);
+
+  /// Transform @c in, whose elements are @c in_stride apart, into the contiguous @c out. These must not overlap
+  void transform(const Complex *in, int in_stride, Complex *out) const;
+
+private:
+  /// Recursive mixed radix decimation in time
+  void work(Complex *out, const Complex *in, int fstride, int in_stride, const int *factors) const;
+  void butterfly2(Complex *out, int fstride, int m) const;
+  void butterfly3(Complex *out, int fstride, int m) const;
+  void butterfly4(Complex *out, int fstride, int m) const;
+  void butterfly5(Complex *out, int fstride, int m) const;
+  /// Bluestein's algorithm, expressing the transform as a convolution of a length that factorises well
+  void bluestein(const Complex *in, int in_stride, Complex *out) const;
+
+  int length_;
+  bool inverse_;
+  std::vector<int> factors_;  // pairs of radix and the remaining length after that radix
+  std::vector<Complex> twiddles_;
+  // Bluestein's algorithm is used when the length has prime factors other than 2, 3 and 5
+  bool bluestein_;
+  std::vector<Complex> chirp_;
+  std::vector<Complex> chirp_spectrum_;
+  std::shared_ptr<FFTPlan> convolution_forward_, convolution_inverse_;
+};
+
+bool hasSmallFactors(int length)
+{
+  for (int radix : { 2, 3, 5 })
+  {
+    while (length % radix == 0)
+      length /= radix;
+  }
+  return length == 1;
+}
+
+/// Plans are cached, as the alignment transforms many lines of the same few lengths
+std::shared_ptr<FFTPlan> getPlan(int length, bool inverse)
+{
+  static std::mutex mutex;
+  static std::map<std::pair<int, bool>, std::shared_ptr<FFTPlan>> plans;
+  const std::pair<int, bool> key(length, inverse);
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = plans.find(key);
+    if (found != plans.end())
+      return found->second;
+  }
+  // built outside of the lock, as Bluestein plans request their own sub-plans
+  std::shared_ptr<FFTPlan> plan = std::make_shared<FFTPlan>(length, inverse);
+  std::lock_guard<std::mutex> lock(mutex);
+  std::shared_ptr<FFTPlan> &stored = plans[key];
+  if (!stored)
+    stored = plan;
+  return stored;
+}
+
+FFTPlan::FFTPlan(int length, bool inverse)
+  : length_(length)
+  , inverse_(inverse)
+  , bluestein_(!hasSmallFactors(length))
+{
+  const double sign = inverse ? 1.0 : -1.0;
+  if (bluestein_)
+  {
+    // chirp_k = exp(sign i pi k^2/n). k^2 is taken modulo 2n to keep the angles accurate on long transforms
+    const int conv_length = DefaultFFTBackend().goodSize(2 * length - 1);
+    chirp_.resize(length);
+    for (int k = 0; k < length; k++)
+    {
+      const long long k_sqr = (static_cast<long long>(k) * k) % (2 * static_cast<long long>(length));
+      chirp_[k] = std::polar(1.0, sign * kPi * static_cast<double>(k_sqr) / static_cast<double>(length));
+    }
+    std::vector<Complex> kernel(conv_length, Complex(0, 0));
+    kernel[0] = std::conj(chirp_[0]);
+    for (int k = 1; k < length; k++)
+      kernel[k] = kernel[conv_length - k] = std::conj(chirp_[k]);
+    convolution_forward_ = getPlan(conv_length, false);
+    convolution_inverse_ = getPlan(conv_length, true);
+    chirp_spectrum_.resize(conv_length);
+    convolution_forward_->transform(kernel.data(), 1, chirp_spectrum_.data());
+    return;
+  }
+
+  // radix 4 first, as it has the cheapest butterfly per element
+  int remaining = length;
+  for (int radix : { 4, 2, 3, 5 })
+  {
+    while (remaining % radix == 0 && remaining > 1)
+    {
+      remaining /= radix;
+      factors_.push_back(radix);
+      factors_.push_back(remaining);
+    }
+  }
+  twiddles_.resize(length);
+  for (int i = 0; i < length; i++)
+    twiddles_[i] = std::polar(1.0, sign * 2.0 * kPi * static_cast<double>(i) / static_cast<double>(length));
+}
+
+void FFTPlan::transform(const Complex *in, int in_stride, Complex *out) const
+{
+  if (bluestein_)
+    bluestein(in, in_stride, out);
+  else if (factors_.empty())  // length 1
+    out[0] = in[0];
+  else
+    work(out, in, 1, in_stride, factors_.data());
+}
+
+void FFTPlan::work(Complex *out, const Complex *in, int fstride, int in_stride, const int *factors) const
+{
+  const int radix = factors[0];
+  const int m = factors[1];
+  Complex *out_end = out + radix * m;
+  if (m == 1)
+  {
+    for (Complex *o = out; o != out_end; o++, in += fstride * in_stride)
+      *o = *in;
+  }
+  else
+  {
+    // each of the radix sub-sequences is transformed into its own consecutive section of the output
+    for (Complex *o = out; o != out_end; o += m, in += fstride * in_stride)
+      work(o, in, fstride * radix, in_stride, factors + 2);
+  }
+  switch (radix)
+  {
+    case 2: butterfly2(out, fstride, m); break;
+    case 3: butterfly3(out, fstride, m); break;
+    case 4: butterfly4(out, fstride, m); break;
+    default: butterfly5(out, fstride, m); break;
+  }
+}
+
+void FFTPlan::butterfly2(Complex *out, int fstride, int m) const
+{
+  Complex *out2 = out + m;
+  for (int k = 0; k < m; k++)
+  {
+    const Complex t = out2[k] * twiddles_[k * fstride];
+    out2[k] = out[k] - t;
+    out[k] += t;
+  }
+}
+
+void FFTPlan::butterfly3(Complex *out, int fstride, int m) const
+{
+  const double epi3 = twiddles_[fstride * m].imag();
+  for (int k = 0; k < m; k++)
+  {
+    const Complex s1 = out[k + m] * twiddles_[k * fstride];
+    const Complex s2 = out[k + 2 * m] * twiddles_[2 * k * fstride];
+    const Complex s3 = s1 + s2;
+    const Complex s0 = (s1 - s2) * epi3;
+    const Complex mid = out[k] - 0.5 * s3;
+    out[k] += s3;
+    out[k + 2 * m] = Complex(mid.real() + s0.imag(), mid.imag() - s0.real());
+    out[k + m] = Complex(mid.real() - s0.imag(), mid.imag() + s0.real());
+  }
+}
+
+void FFTPlan::butterfly4(Complex *out, int fstride, int m) const
+{
+  for (int k = 0; k < m; k++)
+  {
+    const Complex s0 = out[k + m] * twiddles_[k * fstride];
+    const Complex s1 = out[k + 2 * m] * twiddles_[2 * k * fstride];
+    const Complex s2 = out[k + 3 * m] * twiddles_[3 * k * fstride];
+    const Complex s5 = out[k] - s1;
+    const Complex s6 = out[k] + s1;
+    const Complex s3 = s0 + s2;
+    const Complex s4 = s0 - s2;
+    out[k + 2 * m] = s6 - s3;
+    out[k] = s6 + s3;
+    if (inverse_)
+    {
+      out[k + m] = Complex(s5.real() - s4.imag(), s5.imag() + s4.real());
+      out[k + 3 * m] = Complex(s5.real() + s4.imag(), s5.imag() - s4.real());
+    }
+    else
+    {
+      out[k + m] = Complex(s5.real() + s4.imag(), s5.imag() - s4.real());
+      out[k + 3 * m] = Complex(s5.real() - s4.imag(), s5.imag() + s4.real());
+    }
+  }
+}
+
+void FFTPlan::butterfly5(Complex *out, int fstride, int m) const
+{
+  const Complex ya = twiddles_[fstride * m];
+  const Complex yb = twiddles_[fstride * 2 * m];
+  for (int u = 0; u < m; u++)
+  {
+    const Complex s0 = out[u];
+    const Complex s1 = out[u + m] * twiddles_[u * fstride];
+    const Complex s2 = out[u + 2 * m] * twiddles_[2 * u * fstride];
+    const Complex s3 = out[u + 3 * m] * twiddles_[3 * u * fstride];
+    const Complex s4 = out[u + 4 * m] * twiddles_[4 * u * fstride];
+    const Complex s7 = s1 + s4, s10 = s1 - s4;
+    const Complex s8 = s2 + s3, s9 = s2 - s3;
+    out[u] = s0 + s7 + s8;
+
+    const Complex s5 = s0 + s7 * ya.real() + s8 * yb.real();
+    const Complex s6(s10.imag() * ya.imag() + s9.imag() * yb.imag(), -s10.real() * ya.imag() - s9.real() * yb.imag());
+    out[u + m] = s5 - s6;
+    out[u + 4 * m] = s5 + s6;
+
+    const Complex s11 = s0 + s7 * yb.real() + s8 * ya.real();
+    const Complex s12(-s10.imag() * yb.imag() + s9.imag() * ya.imag(), s10.real() * yb.imag() - s9.real() * ya.imag());
+    out[u + 2 * m] = s11 + s12;
+    out[u + 3 * m] = s11 - s12;
+  }
+}
+
+void FFTPlan::bluestein(const Complex *in, int in_stride, Complex *out) const
+{
+  const int conv_length = static_cast<int>(chirp_spectrum_.size());
+  std::vector<Complex> a(conv_length, Complex(0, 0)), spectrum(conv_length);
+  for (int k = 0; k < length_; k++)
+    a[k] = in[k * in_stride] * chirp_[k];
+  convolution_forward_->transform(a.data(), 1, spectrum.data());
+  for (int k = 0; k < conv_length; k++)
+    spectrum[k] *= chirp_spectrum_[k];
+  convolution_inverse_->transform(spectrum.data(), 1, a.data());
+  const double scale = 1.0 / static_cast<double>(conv_length);
+  for (int k = 0; k < length_; k++)
+    out[k] = a[k] * chirp_[k] * scale;
+}
+
+/// Transform the lines of complex values along one axis of a grid. There are @c num_outer independent sets of
+/// lines, @c outer_step apart, which are transformed in parallel. Each set has @c width lines of @c length elements,
+/// @c stride apart. Neighbouring lines are gathered together so that the memory is read in contiguous runs
+void transformLines(std::vector<Complex> &data, int width, int num_outer, int outer_step, int length, int stride,
+                    const FFTPlan &plan)
+{
+  const int block_width = 8;
+  auto transform_outer = [&](int o)
+  {
+    std::vector<Complex> lines(block_width * length), transformed(block_width * length);
+    for (int x0 = 0; x0 < width; x0 += block_width)
+    {
+      const int count = std::min(block_width, width - x0);
+      Complex *base = &data[static_cast<size_t>(o) * outer_step + x0];
+      for (int i = 0; i < length; i++)
+      {
+        for (int b = 0; b < count; b++)
+          lines[b * length + i] = base[static_cast<size_t>(i) * stride + b];
+      }
+      for (int b = 0; b < count; b++)
+        plan.transform(&lines[b * length], 1, &transformed[b * length]);
+      for (int i = 0; i < length; i++)
+      {
+        for (int b = 0; b < count; b++)
+          base[static_cast<size_t>(i) * stride + b] = transformed[b * length + i];
+      }
+    }
+  };
+#if RAYLIB_WITH_TBB
+  tbb::parallel_for(0, num_outer, transform_outer);
+#else   // RAYLIB_WITH_TBB
+  for (int o = 0; o < num_outer; o++)
+    transform_outer(o);
+#endif  // RAYLIB_WITH_TBB
+}
+
+std::unique_ptr<FFTBackend> &pluggedBackend()
+{
+  static std::unique_ptr<FFTBackend> backend;
+  return backend;
+}
+}  // namespace
+
+int DefaultFFTBackend::goodSize(int length) const
+{
+  int size = std::max(length, 1);
+  while (!hasSmallFactors(size))
+    size++;
+  return size;
+}
+
+void DefaultFFTBackend::complexFFT(std::vector<Complex> &data, bool inverse) const
+{
+  if (data.empty())
+    return;
+  std::vector<Complex> transformed(data.size());
+  getPlan(static_cast<int>(data.size()), inverse)->transform(data.data(), 1, transformed.data());
+  if (inverse)
+  {
+    const double scale = 1.0 / static_cast<double>(data.size());
+    for (auto &value : transformed)
+      value *= scale;
+  }
+  data.swap(transformed);
+}
+
+void DefaultFFTBackend::realFFT3D(const Eigen::Vector3i &dims, const std::vector<double> &values,
+                                  std::vector<Complex> &spectrum) const
+{
+  const int nx = dims[0], ny = dims[1], nz = dims[2];
+  const int half_x = nx / 2 + 1;
+  const int num_rows = ny * nz;
+  spectrum.assign(static_cast<size_t>(half_x) * num_rows, Complex(0, 0));
+
+  // the x axis rows are real, so pairs of them are transformed together as the real and imaginary parts of one
+  // complex row, then separated using the conjugate symmetry of real transforms
+  std::shared_ptr<FFTPlan> plan_x = getPlan(nx, false);
+  auto transform_pair = [&](int pair)
+  {
+    std::vector<Complex> line(nx), transformed(nx);
+    const size_t row0 = 2 * static_cast<size_t>(pair), row1 = row0 + 1;
+    const bool has_row1 = row1 < static_cast<size_t>(num_rows);
+    for (int i = 0; i < nx; i++)
+      line[i] = Complex(values[row0 * nx + i], has_row1 ? values[row1 * nx + i] : 0.0);
+    plan_x->transform(line.data(), 1, transformed.data());
+    for (int k = 0; k < half_x; k++)
+    {
+      const Complex z = transformed[k];
+      const Complex z_reflected = std::conj(transformed[(nx - k) % nx]);
+      spectrum[row0 * half_x + k] = 0.5 * (z + z_reflected);
+      if (has_row1)
+        spectrum[row1 * half_x + k] = Complex(0, -0.5) * (z - z_reflected);
+    }
+  };
+  const int num_pairs = (num_rows + 1) / 2;
+#if RAYLIB_WITH_TBB
+  tbb::parallel_for(0, num_pairs, transform_pair);
+#else   // RAYLIB_WITH_TBB
+  for (int p = 0; p < num_pairs; p++)
+    transform_pair(p);
+#endif  // RAYLIB_WITH_TBB
+
+  // then the y axis lines of each z plane, and the z axis lines of each y row
+  transformLines(spectrum, half_x, nz, half_x * ny, ny, half_x, *getPlan(ny, false));
+  transformLines(spectrum, half_x, ny, half_x, nz, half_x * ny, *getPlan(nz, false));
+}
+
+void DefaultFFTBackend::inverseRealFFT3D(const Eigen::Vector3i &dims, std::vector<Complex> &spectrum,
+                                         std::vector<double> &values) const
+{
+  const int nx = dims[0], ny = dims[1], nz = dims[2];
+  const int half_x = nx / 2 + 1;
+  const int num_rows = ny * nz;
+  transformLines(spectrum, half_x, ny, half_x, nz, half_x * ny, *getPlan(nz, true));
+  transformLines(spectrum, half_x, nz, half_x * ny, ny, half_x, *getPlan(ny, true));
+
+  // each x row's full spectrum is rebuilt from its conjugate symmetry. Two rows whose results are real are
+  // transformed together, as the real and imaginary parts of one complex row
+  values.resize(static_cast<size_t>(nx) * num_rows);
+  const double scale = 1.0 / (static_cast<double>(nx) * static_cast<double>(ny) * static_cast<double>(nz));
+  std::shared_ptr<FFTPlan> plan_x = getPlan(nx, true);
+  auto transform_pair = [&](int pair)
+  {
+    std::vector<Complex> line(nx), transformed(nx);
+    const size_t row0 = 2 * static_cast<size_t>(pair), row1 = row0 + 1;
+    const bool has_row1 = row1 < static_cast<size_t>(num_rows);
+    for (int k = 0; k < nx; k++)
+    {
+      const bool stored = k < half_x;
+      const int index = stored ? k : nx - k;
+      Complex a = spectrum[row0 * half_x + index];
+      Complex b = has_row1 ? spectrum[row1 * half_x + index] : Complex(0, 0);
+      if (!stored)
+      {
+        a = std::conj(a);
+        b = std::conj(b);
+      }
+      line[k] = a + Complex(0, 1) * b;
+    }
+    plan_x->transform(line.data(), 1, transformed.data());
+    for (int i = 0; i < nx; i++)
+    {
+      values[row0 * nx + i] = transformed[i].real() * scale;
+      if (has_row1)
+        values[row1 * nx + i] = transformed[i].imag() * scale;
+    }
+  };
+  const int num_pairs = (num_rows + 1) / 2;
+#if RAYLIB_WITH_TBB
+  tbb::parallel_for(0, num_pairs, transform_pair);
+#else   // RAYLIB_WITH_TBB
+  for (int p = 0; p < num_pairs; p++)
+    transform_pair(p);
+#endif  // RAYLIB_WITH_TBB
+}
+
+const FFTBackend &fftBackend()
+{
+  static DefaultFFTBackend default_backend;
+  const std::unique_ptr<FFTBackend> &backend = pluggedBackend();
+  return backend ? *backend : default_backend;
+}
+
+void setFFTBackend(std::unique_ptr<FFTBackend> backend)
+{
+  pluggedBackend() = std::move(backend);
+}
+}  // namespace ray
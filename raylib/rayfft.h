@@ -0,0 +1,66 @@
+// Copyright (c) 2020
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#ifndef RAYLIB_RAYFFT_H
+#define RAYLIB_RAYFFT_H
+
+#include "raylib/raylibconfig.h"
+
+#include "rayutils.h"
+
+#include <complex>
+#include <memory>
+#include <vector>
+
+namespace ray
+{
+/// The Fourier transforms used by the cloud alignment. A default backend is built in, a different implementation
+/// (for instance wrapping a vendor FFT library) can be plugged in with @c setFFTBackend()
+class RAYLIB_EXPORT FFTBackend
+{
+public:
+  virtual ~FFTBackend() = default;
+
+  /// The smallest length at least @c length that the backend transforms efficiently. Grids should be sized with this
+  virtual int goodSize(int length) const = 0;
+
+  /// In-place 1D complex transform of @c data, of any length. The inverse transform is scaled by 1/length,
+  /// so a forward then inverse transform returns the original data
+  virtual void complexFFT(std::vector<std::complex<double>> &data, bool inverse) const = 0;
+
+  /// 3D real to complex transform of the @c dims grid @c values, stored with x fastest, then y, then z.
+  /// Since the input is real, only the non-redundant half of the spectrum is returned in @c spectrum,
+  /// with dimensions (dims[0]/2 + 1, dims[1], dims[2]), also stored x fastest
+  virtual void realFFT3D(const Eigen::Vector3i &dims, const std::vector<double> &values,
+                         std::vector<std::complex<double>> &spectrum) const = 0;
+
+  /// The inverse of @c realFFT3D(), including the 1/(dims[0]*dims[1]*dims[2]) scale. The contents of @c spectrum
+  /// are overwritten
+  virtual void inverseRealFFT3D(const Eigen::Vector3i &dims, std::vector<std::complex<double>> &spectrum,
+                                std::vector<double> &values) const = 0;
+};
+
+/// The built in FFT backend. Lengths with prime factors of only 2, 3 and 5 use a mixed radix transform,
+/// other lengths use Bluestein's algorithm. The 3D transforms are parallelised over rows and planes when
+/// built with TBB
+class RAYLIB_EXPORT DefaultFFTBackend : public FFTBackend
+{
+public:
+  int goodSize(int length) const override;
+  void complexFFT(std::vector<std::complex<double>> &data, bool inverse) const override;
+  void realFFT3D(const Eigen::Vector3i &dims, const std::vector<double> &values,
+                 std::vector<std::complex<double>> &spectrum) const override;
+  void inverseRealFFT3D(const Eigen::Vector3i &dims, std::vector<std::complex<double>> &spectrum,
+                        std::vector<double> &values) const override;
+};
+
+/// The FFT backend in use, this is a @c DefaultFFTBackend unless replaced with @c setFFTBackend()
+const FFTBackend RAYLIB_EXPORT &fftBackend();
+
+/// Replace the FFT backend. Passing nullptr restores the default backend
+void RAYLIB_EXPORT setFFTBackend(std::unique_ptr<FFTBackend> backend);
+}  // namespace ray
+
+#endif  // RAYLIB_RAYFFT_H
@@ -6,9 +6,61 @@
 #include "rayfinealignment.h"
 #include "raydebugdraw.h"
 #include <nabo/nabo.h>
+#if RAYLIB_WITH_TBB
+#include <tbb/parallel_for.h>
+#endif  // RAYLIB_WITH_TBB
 
 namespace ray
 {
+namespace
+{
+// queries and matches are split into blocks of this size, for processing in parallel
+const int kBlockSize = 1024;
+
+// Nearest neighbour search of the @c queries columns, split into blocks that are searched in parallel. The search 
+// is const, so the blocks can share @c nns, and the results are identical to a single search
+void blockedKnn(const Nabo::NNSearchD &nns, const Eigen::MatrixXd &queries, Eigen::MatrixXi &indices, 
+                Eigen::MatrixXd &dists2, int search_size, double epsilon, double max_radius)
+{
+  const int num_queries = (int)queries.cols();
+  indices.resize(search_size, num_queries);
+  dists2.resize(search_size, num_queries);
+  const int num_blocks = (num_queries + kBlockSize - 1) / kBlockSize;
+  auto search_block = [&](int b)
+  {
+    const int start = b * kBlockSize;
+    const int count = std::min(kBlockSize, num_queries - start);
+    Eigen::MatrixXi block_indices(search_size, count);
+    Eigen::MatrixXd block_dists2(search_size, count);
+    nns.knn(queries.middleCols(start, count), block_indices, block_dists2, search_size, epsilon, 0, max_radius);
+    indices.middleCols(start, count) = block_indices;
+    dists2.middleCols(start, count) = block_dists2;
+  };
+#if RAYLIB_WITH_TBB
+  tbb::parallel_for(0, num_blocks, search_block);
+#else   // RAYLIB_WITH_TBB
+  for (int b = 0; b < num_blocks; b++)
+    search_block(b);
+#endif  // RAYLIB_WITH_TBB
+}
+}  // namespace
+
+/// The search structure over the fixed cloud's surfels. The tree refers to the points, so they are kept alongside
+struct FineAlignment::SurfelSearch
+{
+  Eigen::MatrixXd points;
+  std::unique_ptr<Nabo::NNSearchD> nns;
+};
+
+FineAlignment::FineAlignment(Cloud *clouds, bool non_rigid, bool verbose, const double *point_spacings) 
+  : clouds_(clouds), non_rigid_(non_rigid), verbose_(verbose) 
+{
+  for (int c = 0; c < 2; c++)
+    point_spacings_[c] = point_spacings ? point_spacings[c] : 0.0;
+}
+
+FineAlignment::~FineAlignment() = default;
+
 // Simple conversion of surfels for rendering as ellipsoids
 void FineAlignment::Surfel::draw(const std::vector<Surfel> &surfels, const Eigen::Vector3d &colour)
 {
@@ -59,7 +111,7 @@ void FineAlignment::generateSurfels()
   double avg_max_spacing = 0.0; 
   for (int c = 0; c < 2; c++)
   {
-    point_spacings[c] = clouds_[c].estimatePointSpacing();
+    point_spacings[c] = point_spacings_[c] > 0.0 ? point_spacings_[c] : clouds_[c].estimatePointSpacing();
     ASSERT(point_spacings[c] >= 0.0);
     const double min_spacing_scale = 2.0;
     const double max_spacing_scale = 20.0;
@@ -113,23 +165,24 @@ void FineAlignment::generateSurfels()
     // Run the search
     Eigen::MatrixXi indices;
     Eigen::MatrixXd dists2;
-    indices.resize(search_size, q_size);
-    dists2.resize(search_size, q_size);
-    nns->knn(points_q, indices, dists2, search_size, 0.01*max_spacing, 0, max_spacing);
+    blockedKnn(*nns, points_q, indices, dists2, search_size, 0.01*max_spacing, max_spacing);
     delete nns;
 
-    // Convert these set of nearest neighbours into surfels
-    surfels_[c].reserve(q_size);
-    std::vector<int> ids;
-    ids.reserve(search_size);
+    // Convert these set of nearest neighbours into surfels. Each candidate makes up to two surfels, these are 
+    // found in parallel then gathered in candidate order
+    std::vector<Surfel> candidate_surfels(2 * q_size);
+    std::vector<int> num_candidate_surfels(q_size, 0);
     const size_t min_points_per_ellipsoid = 5;
-    for (size_t i = 0; i < q_size; i++)
+    auto make_surfels = [&](size_t i)
     {
-      ids.clear();
+      Surfel *surfels = &candidate_surfels[2 * i];
+      int &num_surfels = num_candidate_surfels[i];
+      std::vector<int> ids;
+      ids.reserve(search_size);
       for (int j = 0; j < search_size && indices(j, i) > -1; j++) 
         ids.push_back(indices(j, i));
       if (ids.size() < min_points_per_ellipsoid)  // not dense enough
-        continue;
+        return;
 
       Eigen::Vector3d centroid;
       Eigen::Vector3d width;
@@ -140,11 +193,11 @@ void FineAlignment::generateSurfels()
       if (q2 < q1)  // cylindrical
       {
         if (q2 > 0.5)  // not cylinderical enough
-          continue;
+          return;
         // register two ellipsoids as the normal is ambiguous
-        surfels_[c].push_back(Surfel(centroid, mat, width, mat.col(2), false));
+        surfels[num_surfels++] = Surfel(centroid, mat, width, mat.col(2), false);
         if (c == 1)
-          surfels_[c].push_back(Surfel(centroid, mat, width, -mat.col(2), false));
+          surfels[num_surfels++] = Surfel(centroid, mat, width, -mat.col(2), false);
       }
       else // planar
       {
@@ -162,17 +215,29 @@ void FineAlignment::generateSurfels()
           }
         }
         if (ids.size() < min_points_per_ellipsoid)  // not dense enough
-          continue;
+          return;
         getSurfel(decimated_points, ids, centroid, width, mat);
         normal = mat.col(0);
         double q1 = width[0] / width[1];
 
         if (q1 > 0.5)  // not planar enough
-          continue;
+          return;
         if ((centroid - candidate_starts[i]).dot(normal) > 0.0)
           normal = -normal;
-        surfels_[c].push_back(Surfel(centroid, mat, width, normal, true));
+        surfels[num_surfels++] = Surfel(centroid, mat, width, normal, true);
       }
+    };
+#if RAYLIB_WITH_TBB
+    tbb::parallel_for<size_t>(0, q_size, make_surfels);
+#else   // RAYLIB_WITH_TBB
+    for (size_t i = 0; i < q_size; i++)
+      make_surfels(i);
+#endif  // RAYLIB_WITH_TBB
+    surfels_[c].reserve(q_size);
+    for (size_t i = 0; i < q_size; i++)
+    {
+      for (int j = 0; j < num_candidate_surfels[i]; j++)
+        surfels_[c].push_back(candidate_surfels[2 * i + j]);
     }
     if (verbose_)
       DebugDraw::instance()->drawCloud(decimated_points, 0.5 + 0.4 * (double)c, c);
@@ -183,14 +248,28 @@ void FineAlignment::generateSurfels()
 }
 
 // Match surfels_[0] to surfels_[1] based on proximity, normal difference and whether it is a plane or cylinder
+void FineAlignment::buildSurfelSearch()
+{
+  size_t p_size = surfels_[1].size();
+  surfel_search_.reset(new SurfelSearch);
+  Eigen::MatrixXd &points_p = surfel_search_->points;
+  points_p.resize(7, p_size);
+  for (size_t i = 0; i < p_size; i++)
+  {
+    Surfel &s = surfels_[1][i];
+    Eigen::Vector3d p = s.centroid * translation_weight_;
+    p[2] *= 2.0;
+    points_p.col(i) << p, s.normal, s.is_plane ? 1.0 : 0.0;
+  }
+  surfel_search_->nns.reset(Nabo::NNSearchD::createKDTreeLinearHeap(points_p, 7));
+}
+
 void FineAlignment::generateSurfelMatches(std::vector<Match> &matches)
 {
   std::vector<Eigen::Vector3d> line_starts;
   std::vector<Eigen::Vector3d> line_ends;
   int search_size = 1;
   size_t q_size = surfels_[0].size();
-  size_t p_size = surfels_[1].size();
-  Nabo::NNSearchD *nns;
   Eigen::MatrixXd points_q(7, q_size);
   for (size_t i = 0; i < q_size; i++)
   {
@@ -199,23 +278,12 @@ void FineAlignment::generateSurfelMatches(std::vector<Match> &matches)
     p[2] *= 2.0;  // doen't make much difference...
     points_q.col(i) << p, s.normal, s.is_plane ? 1.0 : 0.0;
   }
-  Eigen::MatrixXd points_p(7, p_size);
-  for (size_t i = 0; i < p_size; i++)
-  {
-    Surfel &s = surfels_[1][i];
-    Eigen::Vector3d p = s.centroid * translation_weight_;
-    p[2] *= 2.0;
-    points_p.col(i) << p, s.normal, s.is_plane ? 1.0 : 0.0;
-  }
-  nns = Nabo::NNSearchD::createKDTreeLinearHeap(points_p, 7);
 
-  // Run the search
+  // Run the search, only the moving surfels are queried, against the tree built once over the fixed surfels
   Eigen::MatrixXi indices;
   Eigen::MatrixXd dists2;
-  indices.resize(search_size, q_size);
-  dists2.resize(search_size, q_size);
-  nns->knn(points_q, indices, dists2, search_size, ray::kNearestNeighbourEpsilon*max_normal_difference_, 0, max_normal_difference_);
-  delete nns;
+  blockedKnn(*surfel_search_->nns, points_q, indices, dists2, search_size, 
+             ray::kNearestNeighbourEpsilon*max_normal_difference_, max_normal_difference_);
 
   for (int i = 0; i < (int)q_size; i++)
   {
@@ -257,52 +325,74 @@ void FineAlignment::generateSurfelMatches(std::vector<Match> &matches)
 void FineAlignment::buildLinearSystem(const std::vector<Match> &matches, double d, FineAlignment::LinearSystem &system)
 {
   // don't go above 30*... or below 10*...
-  double square_error = 0.0;
-  for (size_t i = 0; i < matches.size(); i++)
+  // Each block of matches is accumulated into its own system, and the blocks are summed in order, so the result
+  // does not depend on the number of threads
+  const int num_blocks = ((int)matches.size() + kBlockSize - 1) / kBlockSize;
+  std::vector<LinearSystem, Eigen::aligned_allocator<LinearSystem>> block_systems(num_blocks);
+  std::vector<double> block_square_errors(num_blocks, 0.0);
+  auto add_block = [&](int b)
   {
-    auto &match = matches[i];
-    Surfel &s0 = surfels_[0][match.ids[0]];
-    Surfel &s1 = surfels_[1][match.ids[1]];
-    Eigen::Vector3d positions[2] = { s0.centroid, s1.centroid };
-    double error = (positions[1] - positions[0]).dot(match.normal);  // mahabolonis instead?
-    double error_sqr;
-    if (s0.is_plane)
-      error_sqr = ray::sqr(error * translation_weight_);
-    else
+    LinearSystem &block_system = block_systems[b];
+    double &square_error = block_square_errors[b];
+    for (size_t i = (size_t)b * kBlockSize; i < std::min(matches.size(), (size_t)(b + 1) * kBlockSize); i++)
     {
-      Eigen::Vector3d flat = positions[1] - positions[0];
-      Eigen::Vector3d norm = s0.normal;
-      flat -= norm * flat.dot(norm);
-      error_sqr = (flat * translation_weight_).squaredNorm();
-    }
-    // the normal difference is part of the error,
-    error_sqr += (s0.normal - s1.normal).squaredNorm();
-    double weight = pow(std::max(1.0 - error_sqr / ray::sqr(max_normal_difference_), 0.0), d * d);
-    square_error += ray::sqr(error);
-    Eigen::Matrix<double, 1, LinearSystem::state_size> a;  // the Jacobian
-    a.setZero();
+      auto &match = matches[i];
+      Surfel &s0 = surfels_[0][match.ids[0]];
+      Surfel &s1 = surfels_[1][match.ids[1]];
+      Eigen::Vector3d positions[2] = { s0.centroid, s1.centroid };
+      double error = (positions[1] - positions[0]).dot(match.normal);  // mahabolonis instead?
+      double error_sqr;
+      if (s0.is_plane)
+        error_sqr = ray::sqr(error * translation_weight_);
+      else
+      {
+        Eigen::Vector3d flat = positions[1] - positions[0];
+        Eigen::Vector3d norm = s0.normal;
+        flat -= norm * flat.dot(norm);
+        error_sqr = (flat * translation_weight_).squaredNorm();
+      }
+      // the normal difference is part of the error,
+      error_sqr += (s0.normal - s1.normal).squaredNorm();
+      double weight = pow(std::max(1.0 - error_sqr / ray::sqr(max_normal_difference_), 0.0), d * d);
+      square_error += ray::sqr(error);
+      Eigen::Matrix<double, 1, LinearSystem::state_size> a;  // the Jacobian
+      a.setZero();
 
-    for (int i = 0; i < 3; i++)  // change in error with change in raycloud translation
-      a[i] = match.normal[i];
-    for (int i = 0; i < 3; i++)  // change in error with change in raycloud orientation
-    {
-      Eigen::Vector3d axis(0, 0, 0);
-      axis[i] = 1.0;
-      a[3 + i] = -(positions[0].cross(axis)).dot(match.normal);
-    }
-    if (non_rigid_) 
-    {
-      positions[0] -= centres_[0];
-      positions[1] -= centres_[1];
-      a[6] = ray::sqr(positions[0][0]) * match.normal[0];
-      a[7] = ray::sqr(positions[0][0]) * match.normal[1];
-      a[8] = ray::sqr(positions[0][1]) * match.normal[0];
-      a[9] = ray::sqr(positions[0][1]) * match.normal[1];
-      a[10] = positions[0][0] * positions[0][1] * match.normal[0];
-      a[11] = positions[0][0] * positions[0][1] * match.normal[1];
+      for (int i = 0; i < 3; i++)  // change in error with change in raycloud translation
+        a[i] = match.normal[i];
+      for (int i = 0; i < 3; i++)  // change in error with change in raycloud orientation
+      {
+        Eigen::Vector3d axis(0, 0, 0);
+        axis[i] = 1.0;
+        a[3 + i] = -(positions[0].cross(axis)).dot(match.normal);
+      }
+      if (non_rigid_) 
+      {
+        positions[0] -= centres_[0];
+        positions[1] -= centres_[1];
+        a[6] = ray::sqr(positions[0][0]) * match.normal[0];
+        a[7] = ray::sqr(positions[0][0]) * match.normal[1];
+        a[8] = ray::sqr(positions[0][1]) * match.normal[0];
+        a[9] = ray::sqr(positions[0][1]) * match.normal[1];
+        a[10] = positions[0][0] * positions[0][1] * match.normal[0];
+        a[11] = positions[0][0] * positions[0][1] * match.normal[1];
+      }
+      block_system.At_A += a.transpose() * weight * a;
+      block_system.At_b += a.transpose() * weight * error;
     }
-    system.At_A += a.transpose() * weight * a;
-    system.At_b += a.transpose() * weight * error;
+  };
+#if RAYLIB_WITH_TBB
+  tbb::parallel_for(0, num_blocks, add_block);
+#else   // RAYLIB_WITH_TBB
+  for (int b = 0; b < num_blocks; b++)
+    add_block(b);
+#endif  // RAYLIB_WITH_TBB
+  double square_error = 0.0;
+  for (int b = 0; b < num_blocks; b++)
+  {
+    system.At_A += block_systems[b].At_A;
+    system.At_b += block_systems[b].At_b;
+    square_error += block_square_errors[b];
   }
   if (verbose_)
     std::cout << "rmse: " << sqrt(square_error / (double)matches.size()) << std::endl;
@@ -335,13 +425,25 @@ void FineAlignment::updateLinearSystem(std::vector<Match> &matches, const Quadra
 
   // NOTE: transforming the whole cloud each time is a bit slow,
   // we should be able to concatenate these transforms and only apply them once at the end
-  for (auto &end : clouds_[0].ends)
+  auto transform_point = [&](Eigen::Vector3d &point)
   {
-    Eigen::Vector3d relPos = end - centres_[0];
+    Eigen::Vector3d relPos = point - centres_[0];
     if (non_rigid_)
-      end += trans.a * ray::sqr(relPos[0]) + trans.b * ray::sqr(relPos[1]) + trans.c * relPos[0] * relPos[1];
-    end = shift * end;
-  }
+      point += trans.a * ray::sqr(relPos[0]) + trans.b * ray::sqr(relPos[1]) + trans.c * relPos[0] * relPos[1];
+    point = shift * point;
+  };
+  // the starts move with the ends, matching the result of applying warp() to the full cloud
+  auto transform_ray = [&](size_t i)
+  {
+    transform_point(clouds_[0].starts[i]);
+    transform_point(clouds_[0].ends[i]);
+  };
+#if RAYLIB_WITH_TBB
+  tbb::parallel_for<size_t>(0, clouds_[0].ends.size(), transform_ray);
+#else   // RAYLIB_WITH_TBB
+  for (size_t i = 0; i < clouds_[0].ends.size(); i++)
+    transform_ray(i);
+#endif  // RAYLIB_WITH_TBB
 }
 
 // The fine grained alignment method
@@ -350,10 +452,13 @@ void FineAlignment::align()
   // For each cloud: decimate the cloud to make it even, but still quite detailed, e.g. one point per cubic 10cm
   // Decimate again to pick one point per cubic 1m (for instance)
   // Now match the closest X points in 1 to those in 2, and generate surfel per point in 2.
+  warp_ = Warp();
   generateSurfels();
+  buildSurfelSearch();
  
   // Iteratively reweighted least squares. Iteration loop:
   int max_iterations = 8;
+  int num_settled = 0;
   for (int it = 0; it < max_iterations; it++) 
   {
     // Match surfels in cloud0 to those in cloud1
@@ -370,6 +475,24 @@ void FineAlignment::align()
 
     // Update the ray cloud and surfels from on the transformation of best fit
     updateLinearSystem(matches, perturbation);
+    if (non_rigid_)
+      warp_.addStep(centres_[0], perturbation.a, perturbation.b, perturbation.c, perturbation.getEuclideanPart());
+    else
+      warp_.addStep(perturbation.getEuclideanPart());
+
+    // stop once the transformation has settled over consecutive iterations of the robust weighting. The first
+    // iteration weights every match equally, so a small update there does not mean the alignment has converged
+    const bool settled =
+      perturbation.translation.norm() < min_translation_update_ && perturbation.rotation.norm() < min_rotation_update_ &&
+      (!non_rigid_ || (perturbation.a.norm() < min_quadratic_update_ && perturbation.b.norm() < min_quadratic_update_ &&
+                       perturbation.c.norm() < min_quadratic_update_));
+    num_settled = settled && d > 0.0 ? num_settled + 1 : 0;
+    if (num_settled == min_settled_iterations_)
+    {
+      if (verbose_)
+        std::cout << "fine alignment converged after " << it + 1 << " iterations" << std::endl;
+      break;
+    }
   }
 }
 
@@ -10,6 +10,8 @@
 
 #include "rayutils.h"
 #include "raycloud.h"
+#include "raywarp.h"
+#include <memory>
 
 
 namespace ray
@@ -23,13 +25,20 @@ public:
   /// Constructor takes two clouds as input @c clouds, also:
   /// @c non_rigid denotes whether the alignment transformation is quadratic or linear (Euclidean)
   /// @c verbose outputs debug text and debug draw messages
-  FineAlignment(Cloud *clouds, bool non_rigid, bool verbose) : clouds_(clouds), non_rigid_(non_rigid), verbose_(verbose) {}
+  /// @c point_spacings optionally gives the point spacing of each cloud, such as those of the full files that the 
+  /// clouds were decimated from (see @c Cloud::loadDecimated()). Spacings of 0, or no array, are estimated from @c clouds
+  FineAlignment(Cloud *clouds, bool non_rigid, bool verbose, const double *point_spacings = nullptr);
+  ~FineAlignment();
   
   /// This function modifies clouds[0] (supplied in constructor) to match clouds[1]
   /// The alignment is either a rigid (Euclidean) transformation, or it contains some quadratic components to account for
   /// slight bend or warping within the cloud. 
   void align();
 
+  /// The transformation found by @c align(), from clouds[0] as it was before alignment. 
+  /// This allows an alignment found on decimated clouds to be saved, or applied to the full cloud via @c convertCloud()
+  inline const Warp &warp() const { return warp_; }
+
 private:
   /// Surfel object, suited to this alignment method
   struct RAYLIB_EXPORT Surfel
@@ -87,6 +96,9 @@ private:
 
   /// Create surfels per voxel of a vexelisation of the ray end points
   void generateSurfels();
+  /// Build the nearest neighbour search over the surfels of the fixed cloud, surfels_[1]. These don't move, so this
+  /// is done once per alignment
+  void buildSurfelSearch();
   /// Find the list of correspondences between the two surfel sets surfels_[0] and surfels_[1]
   void generateSurfelMatches(std::vector<Match> &matches);
   /// Convert the matches into a linear system
@@ -98,12 +110,23 @@ private:
   Cloud *clouds_;
   double non_rigid_;
   double verbose_;
+  double point_spacings_[2];
   const double max_normal_difference_ = 0.5;
+  /// The iterations stop early once the transformation updates are smaller than these, for this many consecutive
+  /// robustly weighted iterations
+  const double min_translation_update_ = 1e-5;  // metres
+  const double min_rotation_update_ = 1e-6;     // radians
+  const double min_quadratic_update_ = 1e-7;    // per metre
+  const int min_settled_iterations_ = 2;
 
   /// Derived data
   std::vector<Surfel> surfels_[2];
   double translation_weight_;
   Eigen::Vector3d centres_[2];
+  /// The transformation of each iteration, applied in order
+  Warp warp_;
+  struct SurfelSearch;
+  std::unique_ptr<SurfelSearch> surfel_search_;
 };
 }  // namespace ray
 
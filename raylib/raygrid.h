@@ -141,6 +141,16 @@ public:
     null_cell_.index = Eigen::Vector3i(-1, -1, -1);
   }
 
+  /// exchange the contents of this grid with @p other , without copying any cells
+  void swap(Grid<T> &other)
+  {
+    std::swap(box_min, other.box_min);
+    std::swap(box_max, other.box_max);
+    std::swap(voxel_width, other.voxel_width);
+    std::swap(dims, other.dims);
+    buckets_.swap(other.buckets_);
+  }
+
   Cell &cell(int x, int y, int z) { return cell(Eigen::Vector3i(x, y, z)); }
   Cell &cell(const Eigen::Vector3i &index)
   {
@@ -5,7 +5,9 @@
 // Author: Kazys Stepanas, Tom Lowe
 #include "raymerger.h"
 
+#include "raycloudwriter.h"
 #include "raygrid.h"
+#include "rayparse.h"
 #include "rayprogress.h"
 #include "rayunused.h"
 
@@ -15,9 +17,16 @@
 #endif  // RAYLIB_WITH_TBB
 
 #include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <set>
+#include <sstream>
 
 #if RAYLIB_WITH_TBB
 // With threads we use std::atomic_bool for the transient marks. These are default initialised to false. No additional
@@ -31,6 +40,90 @@
 
 namespace ray
 {
+namespace
+{
+/// Identifies a merger map state file, followed by the file format version
+const char kMapStateHeader[] = "raymergerstate";
+const int kMapStateVersion = 1;
+
+template <typename T>
+void writeValue(std::ofstream &out, const T &value)
+{
+  out.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+template <typename T>
+void readValue(std::ifstream &in, T &value)
+{
+  in.read(reinterpret_cast<char *>(&value), sizeof(T));
+}
+
+/// The number of bytes after the current read position of @c in
+std::streamoff bytesRemaining(std::ifstream &in)
+{
+  const std::streampos pos = in.tellg();
+  in.seekg(0, std::ios::end);
+  const std::streamoff remaining = in.tellg() - pos;
+  in.seekg(pos);
+  return remaining;
+}
+
+/// The size of each ellipsoid record in a merger state file
+const std::streamoff kEllipsoidRecordSize = sizeof(Eigen::Vector3d) + sizeof(Eigen::Matrix3d) +
+                                            sizeof(Eigen::Vector3d) + 3 * sizeof(double) + 2 * sizeof(uint64_t);
+/// The largest cell index magnitude accepted from a merger state file, small enough for the grid hash not to overflow
+const int kMaxCellIndex = 1 << 20;
+
+/// Tile coordinates for the tiled merge
+typedef std::pair<int, int> TileKey;
+
+/// A ray as stored in the temporary tile files of the tiled merge, with its origin
+struct TileRay
+{
+  Eigen::Vector3d start;
+  Eigen::Vector3d end;
+  double time;
+  RGBA colour;
+  uint32_t cloud_id;  ///< index of the input file
+  uint64_t ray_id;    ///< index of the ray within its input file
+};
+
+/// The number of rays buffered in memory before they are written to the tile files
+const size_t kMaxBufferedTileRays = 4000000;
+
+/// Read all the rays of a temporary tile file. Returns false if it is missing or truncated
+bool readTileRays(const std::string &file_name, std::vector<TileRay> &rays)
+{
+  std::ifstream in(file_name, std::ios::binary | std::ios::in | std::ios::ate);
+  const std::streamoff size = in.tellg();
+  if (!in || size < 0 || size % (std::streamoff)sizeof(TileRay) != 0)
+  {
+    return false;
+  }
+  in.seekg(0);
+  rays.resize((size_t)size / sizeof(TileRay));
+  in.read(reinterpret_cast<char *>(rays.data()), sizeof(TileRay) * rays.size());
+  return !in.fail();
+}
+
+/// Removes the added temporary files when it goes out of scope, so that they are removed on every exit path
+class TemporaryFiles
+{
+public:
+  ~TemporaryFiles()
+  {
+    for (const auto &name : names_)
+    {
+      std::remove(name.c_str());
+    }
+  }
+  void add(const std::string &name) { names_.push_back(name); }
+
+private:
+  std::vector<std::string> names_;
+};
+}  // namespace
+
 class EllipsoidTransientMarker
 {
 public:
@@ -67,45 +160,165 @@ private:
   std::vector<unsigned> pass_through_ids;
 };
 
-typedef Eigen::Matrix<double, 6, 1> Vector6i;
-class Vector6iLess
+// TODO: Make config value
+const double test_width = 0.01;  // allows a minor variation when checking for similarity of rays
+
+/// A ray quantised to @c test_width , packed as its 3 start and 3 end integer coordinates
+struct RayKey
 {
-public:
-  inline bool operator()(const Vector6i &a, const Vector6i &b) const
-  {
-    if (a[0] != b[0])
-      return a[0] < b[0];
-    if (a[1] != b[1])
-      return a[1] < b[1];
-    if (a[2] != b[2])
-      return a[2] < b[2];
-    if (a[3] != b[3])
-      return a[3] < b[3];
-    if (a[4] != b[4])
-      return a[4] < b[4];
-    return a[5] < b[5];
-  }
+  int32_t coords[6];
+
+  inline bool operator==(const RayKey &other) const { return std::equal(coords, coords + 6, other.coords); }
 };
 
-// TODO: Make config value
-const double test_width = 0.01;  // allows a minor variation when checking for similarity of rays
+inline RayKey quantiseRay(const Eigen::Vector3d &start, const Eigen::Vector3d &end)
+{
+  RayKey key;
+  for (int j = 0; j < 3; j++)
+  {
+    key.coords[j] = int32_t(std::floor(start[j] / test_width));
+    key.coords[3 + j] = int32_t(std::floor(end[j] / test_width));
+  }
+  return key;
+}
 
-void rayLookup(const Cloud *cloud, std::set<Vector6i, Vector6iLess> &ray_lookup)
+inline uint64_t hashRayKey(const RayKey &key)
 {
-  for (size_t i = 0; i < cloud->rayCount(); i++)
+  uint64_t hash = 0x9E3779B97F4A7C15ull;
+  for (int j = 0; j < 6; j++)
   {
-    const Eigen::Vector3d &point = cloud->ends[i];
-    const Eigen::Vector3d &start = cloud->starts[i];
-    Vector6i ray;
-    for (int j = 0; j < 3; j++)
+    hash ^= (uint64_t)(uint32_t)key.coords[j];
+    hash *= 0xBF58476D1CE4E5B9ull;
+    hash ^= hash >> 31;
+  }
+  return hash;
+}
+
+/// The ray key sets are split into 2^kRayKeyShardBits shards
+const int kRayKeyShardBits = 6;
+const size_t kNumShards = size_t(1) << kRayKeyShardBits;
+
+/// Set of quantised rays, used to find matching rays between clouds in the three way merge.
+/// It is a flat, linear probing hash set, split into shards by the top bits of the hash so that the shards can be
+/// filled in parallel.
+class RayKeySet
+{
+public:
+  /// Fill the set with the quantised rays of @p cloud
+  void build(const Cloud &cloud)
+  {
+    const size_t count = cloud.rayCount();
+    std::vector<RayKey> keys(count);
+    std::vector<uint64_t> hashes(count);
+    const auto quantise = [&cloud, &keys, &hashes](size_t i)  //
+    {
+      keys[i] = quantiseRay(cloud.starts[i], cloud.ends[i]);
+      hashes[i] = hashRayKey(keys[i]);
+    };
+#if RAYLIB_WITH_TBB
+    tbb::parallel_for<size_t>(0u, count, quantise);
+#else   // RAYLIB_WITH_TBB
+    for (size_t i = 0; i < count; i++)
+    {
+      quantise(i);
+    }
+#endif  // RAYLIB_WITH_TBB
+
+    // bucket the key indices by shard, then fill each shard independently
+    std::vector<size_t> shard_starts(kNumShards + 1, 0);
+    for (size_t i = 0; i < count; i++)
+    {
+      shard_starts[shardOf(hashes[i]) + 1]++;
+    }
+    for (size_t s = 0; s < kNumShards; s++)
+    {
+      shard_starts[s + 1] += shard_starts[s];
+    }
+    std::vector<size_t> ordered(count);
+    std::vector<size_t> heads(shard_starts.begin(), shard_starts.end() - 1);
+    for (size_t i = 0; i < count; i++)
+    {
+      ordered[heads[shardOf(hashes[i])]++] = i;
+    }
+
+    shards_.clear();
+    shards_.resize(kNumShards);
+    const auto fill_shard = [this, &keys, &hashes, &ordered, &shard_starts](size_t s)  //
+    {
+      Shard &shard = shards_[s];
+      size_t capacity = 16;
+      while (capacity < 2 * (shard_starts[s + 1] - shard_starts[s]))
+      {
+        capacity *= 2;
+      }
+      shard.slots.resize(capacity);
+      shard.used.assign(capacity, 0);
+      shard.mask = capacity - 1;
+      shard.size = 0;
+      for (size_t j = shard_starts[s]; j < shard_starts[s + 1]; j++)
+      {
+        const size_t i = ordered[j];
+        size_t slot = hashes[i] & shard.mask;
+        while (shard.used[slot] && !(shard.slots[slot] == keys[i]))
+        {
+          slot = (slot + 1) & shard.mask;
+        }
+        if (!shard.used[slot])
+        {
+          shard.used[slot] = 1;
+          shard.slots[slot] = keys[i];
+          shard.size++;
+        }
+      }
+    };
+#if RAYLIB_WITH_TBB
+    tbb::parallel_for<size_t>(0u, kNumShards, fill_shard);
+#else   // RAYLIB_WITH_TBB
+    for (size_t s = 0; s < kNumShards; s++)
     {
-      ray[j] = int(floor(start[j] / test_width));
-      ray[3 + j] = int(floor(point[j] / test_width));
+      fill_shard(s);
     }
-    if (ray_lookup.find(ray) == ray_lookup.end())
-      ray_lookup.insert(ray);
+#endif  // RAYLIB_WITH_TBB
   }
-}
+
+  /// Is the ray with the (quantised) @p key in the set. This is thread safe.
+  inline bool contains(const RayKey &key) const
+  {
+    const uint64_t hash = hashRayKey(key);
+    const Shard &shard = shards_[shardOf(hash)];
+    for (size_t slot = hash & shard.mask; shard.used[slot]; slot = (slot + 1) & shard.mask)
+    {
+      if (shard.slots[slot] == key)
+      {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /// The number of unique rays in the set
+  size_t size() const
+  {
+    size_t total = 0;
+    for (const auto &shard : shards_)
+    {
+      total += shard.size;
+    }
+    return total;
+  }
+
+private:
+  static inline size_t shardOf(uint64_t hash) { return size_t(hash >> (64 - kRayKeyShardBits)); }
+
+  struct Shard
+  {
+    std::vector<RayKey> slots;
+    std::vector<uint8_t> used;
+    uint64_t mask = 0;
+    size_t size = 0;
+  };
+  std::vector<Shard> shards_;
+};
 
 void EllipsoidTransientMarker::mark(Ellipsoid *ellipsoid, std::vector<Merger::Bool> *transient_ray_marks,
                                     const Cloud &cloud, const Grid<unsigned> &ray_grid, double num_rays,
@@ -316,6 +529,168 @@ void EllipsoidTransientMarker::mark(Ellipsoid *ellipsoid, std::vector<Merger::Bo
   }
 }
 
+bool MergerMapState::save(const std::string &file_name) const
+{
+  std::ofstream out(file_name, std::ios::binary | std::ios::out);
+  if (out.fail())
+  {
+    std::cerr << "Error: cannot open " << file_name << " for writing." << std::endl;
+    return false;
+  }
+  out.write(kMapStateHeader, sizeof(kMapStateHeader));
+  writeValue(out, kMapStateVersion);
+
+  writeValue(out, (uint64_t)ellipsoids.size());
+  for (const auto &ellipsoid : ellipsoids)
+  {
+    writeValue(out, ellipsoid.pos);
+    writeValue(out, ellipsoid.eigen_mat);
+    writeValue(out, ellipsoid.extents);
+    writeValue(out, ellipsoid.time);
+    writeValue(out, ellipsoid.opacity);
+    writeValue(out, ellipsoid.planarity);
+    writeValue(out, (uint64_t)ellipsoid.num_rays);
+    writeValue(out, (uint64_t)ellipsoid.num_gone);
+  }
+
+  writeValue(out, ray_grid.box_min);
+  writeValue(out, ray_grid.box_max);
+  writeValue(out, ray_grid.voxel_width);
+  // each occupied cell is stored as its index, followed by its list of ray ids
+  ray_grid.walkCells([&out](const Grid<unsigned> &, const Grid<unsigned>::Cell &cell) {
+    if (cell.data.empty())
+    {
+      return;
+    }
+    writeValue(out, cell.index);
+    writeValue(out, (uint32_t)cell.data.size());
+    out.write(reinterpret_cast<const char *>(cell.data.data()), sizeof(unsigned) * cell.data.size());
+  });
+  writeValue(out, Eigen::Vector3i(-1, -1, -1));  // terminator
+  if (out.fail())
+  {
+    std::cerr << "Error: failed writing merger state to " << file_name << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool MergerMapState::load(const std::string &file_name)
+{
+  std::ifstream in(file_name, std::ios::binary | std::ios::in);
+  if (in.fail())
+  {
+    std::cerr << "Error: cannot open " << file_name << " for reading." << std::endl;
+    return false;
+  }
+  char header[sizeof(kMapStateHeader)];
+  int version = 0;
+  in.read(header, sizeof(header));
+  readValue(in, version);
+  if (in.fail() || std::string(header, sizeof(header) - 1) != kMapStateHeader || version != kMapStateVersion)
+  {
+    std::cerr << "Error: " << file_name << " is not a compatible merger state file." << std::endl;
+    return false;
+  }
+
+  uint64_t num_ellipsoids = 0;
+  readValue(in, num_ellipsoids);
+  // check the count against the file size, so that a corrupt count fails here rather than in a huge allocation
+  if (in.fail() || num_ellipsoids > (uint64_t)(bytesRemaining(in) / kEllipsoidRecordSize))
+  {
+    std::cerr << "Error: " << file_name << " is truncated." << std::endl;
+    return false;
+  }
+  ellipsoids.resize(num_ellipsoids);
+  for (auto &ellipsoid : ellipsoids)
+  {
+    uint64_t num_rays, num_gone;
+    readValue(in, ellipsoid.pos);
+    readValue(in, ellipsoid.eigen_mat);
+    readValue(in, ellipsoid.extents);
+    readValue(in, ellipsoid.time);
+    readValue(in, ellipsoid.opacity);
+    readValue(in, ellipsoid.planarity);
+    readValue(in, num_rays);
+    readValue(in, num_gone);
+    ellipsoid.num_rays = (size_t)num_rays;
+    ellipsoid.num_gone = (size_t)num_gone;
+    ellipsoid.transient = false;
+  }
+  if (in.fail())
+  {
+    std::cerr << "Error: " << file_name << " is truncated." << std::endl;
+    return false;
+  }
+
+  Eigen::Vector3d box_min, box_max;
+  double voxel_width = 0;
+  readValue(in, box_min);
+  readValue(in, box_max);
+  readValue(in, voxel_width);
+  if (in.fail() || !(voxel_width > 0.0))
+  {
+    std::cerr << "Error: " << file_name << " is truncated." << std::endl;
+    return false;
+  }
+  if (!box_min.allFinite() || !box_max.allFinite() || (box_max.array() < box_min.array()).any())
+  {
+    std::cerr << "Error: " << file_name << " is not a compatible merger state file." << std::endl;
+    return false;
+  }
+  ray_grid.init(box_min, box_max, voxel_width);
+  std::vector<unsigned> ids;
+  for (;;)
+  {
+    Eigen::Vector3i index;
+    uint32_t count = 0;
+    readValue(in, index);
+    if (in.fail())
+    {
+      std::cerr << "Error: " << file_name << " is truncated." << std::endl;
+      return false;
+    }
+    if (index == Eigen::Vector3i(-1, -1, -1))
+    {
+      break;
+    }
+    // unbounded rays are walked beyond the grid bounds, so cells may lie outside dims, but not so far that the
+    // grid's cell hash overflows
+    if ((index.array().abs() > kMaxCellIndex).any())
+    {
+      std::cerr << "Error: " << file_name << " is not a compatible merger state file." << std::endl;
+      return false;
+    }
+    readValue(in, count);
+    if (in.fail() || count > (uint64_t)(bytesRemaining(in) / (std::streamoff)sizeof(unsigned)))
+    {
+      std::cerr << "Error: " << file_name << " is truncated." << std::endl;
+      return false;
+    }
+    ids.resize(count);
+    in.read(reinterpret_cast<char *>(ids.data()), sizeof(unsigned) * count);
+    if (in.fail())
+    {
+      std::cerr << "Error: " << file_name << " is truncated." << std::endl;
+      return false;
+    }
+    // the ids are map ray indices, and there is one ellipsoid per map ray
+    for (const auto &id : ids)
+    {
+      if (id >= num_ellipsoids)
+      {
+        std::cerr << "Error: " << file_name << " is not a compatible merger state file." << std::endl;
+        return false;
+      }
+    }
+    for (const auto &id : ids)
+    {
+      ray_grid.insert(index[0], index[1], index[2], id);
+    }
+  }
+  return !in.fail();
+}
+
 Merger::Merger(const MergerConfig &config)
   : config_(config)
 {}
@@ -368,32 +743,85 @@ bool Merger::mergeMultiple(std::vector<Cloud> &clouds, Progress *progress)
 
   clear();
 
+  std::vector<std::vector<Bool>> transient_ray_marks;
+  markMultiple(clouds, &transient_ray_marks, true, progress);
+
+  for (size_t c = 0; c < clouds.size(); c++)
+  {
+    auto &cloud = clouds[c];
+    for (size_t i = 0; i < cloud.rayCount(); i++)
+    {
+      if (transient_ray_marks[c][i])
+      {
+        difference_.addRay(cloud, i);
+      }
+      else
+      {
+        fixed_.addRay(cloud, i);
+      }
+    }
+  }
+
+  return true;
+}
+
+void Merger::markMultiple(const std::vector<Cloud> &clouds, std::vector<std::vector<Bool>> *transient_ray_marks,
+                          bool verbose, Progress *progress, const std::vector<std::vector<bool>> *active_ellipsoids,
+                          const Cuboid *bounds)
+{
+  std::vector<double> voxel_sizes(clouds.size());
+  double min_voxel_size = std::numeric_limits<double>::max();
+  for (size_t c = 0; c < clouds.size(); c++)
+  {
+    voxel_sizes[c] = voxelSizeForCloud(clouds[c]);
+    if (std::isfinite(voxel_sizes[c]) && voxel_sizes[c] > 0.0)
+    {
+      min_voxel_size = std::min(min_voxel_size, voxel_sizes[c]);
+    }
+  }
   std::vector<Grid<unsigned>> grids(clouds.size());
   for (size_t c = 0; c < clouds.size(); c++)
   {
-    const double voxel_size = voxelSizeForCloud(clouds[c]);
-    if (config_.voxel_size == 0)
+    // a cloud with no bounded rays (such as one passing through a tile) has no spacing, so use the finest other one
+    const double voxel_size = (std::isfinite(voxel_sizes[c]) && voxel_sizes[c] > 0.0) ? voxel_sizes[c] :
+                              (min_voxel_size < std::numeric_limits<double>::max() ? min_voxel_size : 0.25);
+    if (config_.voxel_size == 0 && verbose)
     {
       std::cout << "estimated required voxel size for cloud " << c << ": " << voxel_size << std::endl;
     }
 
-    grids[c].init(clouds[c].calcMinBound(), clouds[c].calcMaxBound(), voxel_size);
+    if (bounds)
+    {
+      grids[c].init(bounds->min_bound_, bounds->max_bound_, voxel_size);
+    }
+    else
+    {
+      grids[c].init(clouds[c].calcMinBound(), clouds[c].calcMaxBound(), voxel_size);
+    }
     fillRayGrid(&grids[c], clouds[c], progress);
   }
 
-  std::vector<std::vector<Bool>> transient_ray_marks;
-  transient_ray_marks.reserve(clouds.size());
+  transient_ray_marks->clear();
+  transient_ray_marks->reserve(clouds.size());
   for (size_t c = 0; c < clouds.size(); c++)
   {
-    transient_ray_marks.emplace_back(std::vector<Bool>(clouds[c].rayCount() MARKER_BOOL_INIT));
+    transient_ray_marks->emplace_back(std::vector<Bool>(clouds[c].rayCount() MARKER_BOOL_INIT));
   }
 
   // now for each cloud, look for other clouds that penetrate it
   for (size_t c = 0; c < clouds.size(); c++)
   {
     generateEllipsoids(&ellipsoids_, nullptr, nullptr, clouds[c], progress);
+    if (active_ellipsoids)
+    {
+      // inactive ellipsoids are treated as already removed, so they are skipped by the marking below
+      for (size_t i = 0; i < ellipsoids_.size(); i++)
+      {
+        ellipsoids_[i].transient = !(*active_ellipsoids)[c][i];
+      }
+    }
     // just set opacity
-    markIntersectedEllipsoids(clouds[c], grids[c], &transient_ray_marks[c], 0, false, progress);
+    markIntersectedEllipsoids(clouds[c], grids[c], &(*transient_ray_marks)[c], 0, false, progress);
 
     for (size_t d = 0; d < clouds.size(); d++)
     {
@@ -403,34 +831,415 @@ bool Merger::mergeMultiple(std::vector<Cloud> &clouds, Progress *progress)
       }
       const bool ellipsoid_cloud_first = c < d; // used when argument order of the files is the merge type
       // use ellipsoid opacity to set transient flag true on transients
-      markIntersectedEllipsoids(clouds[d], grids[d], &transient_ray_marks[d], config_.num_rays_filter_threshold,
+      markIntersectedEllipsoids(clouds[d], grids[d], &(*transient_ray_marks)[d], config_.num_rays_filter_threshold,
                                 false, progress, ellipsoid_cloud_first);
     }
 
     for (size_t i = 0; i < clouds[c].rayCount(); i++)
     {
-      if (ellipsoids_[i].transient)
+      if (ellipsoids_[i].transient && (!active_ellipsoids || (*active_ellipsoids)[c][i]))
       {
-        transient_ray_marks[c][i] = true;  
+        (*transient_ray_marks)[c][i] = true;  
       }
     }
   }
+}
 
-  for (size_t c = 0; c < clouds.size(); c++)
+bool Merger::mergeMultipleTiled(const std::vector<std::string> &file_names, double tile_width,
+                                const std::string &fixed_file, const std::string &difference_file,
+                                Progress *progress)
+{
+  Progress tracker;
+  if (!progress)
   {
-    auto &cloud = clouds[c];
-    for (size_t i = 0; i < cloud.rayCount(); i++)
+    progress = &tracker;
+  }
+  clear();
+
+  // Tiles are centred on multiples of tile_width, as in splitGrid(). Rays passing through a tile's padding are
+  // included in the tile, so that the ellipsoids near the tile edge have their neighbours and intersecting rays.
+  const double padding = 0.1 * tile_width;
+  const std::string tile_stub = getFileNameStub(fixed_file) + "_tile";
+  auto tileOf = [tile_width](const Eigen::Vector3d &pos) {
+    return TileKey((int)std::floor(0.5 + pos[0] / tile_width), (int)std::floor(0.5 + pos[1] / tile_width));
+  };
+  auto tileBox = [tile_width, padding](const TileKey &tile, double min_z, double max_z) {
+    return Cuboid(Eigen::Vector3d(((double)tile.first - 0.5) * tile_width - padding,
+                                  ((double)tile.second - 0.5) * tile_width - padding, min_z - 1.0),
+                  Eigen::Vector3d(((double)tile.first + 0.5) * tile_width + padding,
+                                  ((double)tile.second + 0.5) * tile_width + padding, max_z + 1.0));
+  };
+  auto tileFileName = [&tile_stub](const TileKey &tile) {
+    std::stringstream name;
+    name << tile_stub << "_" << tile.first << "_" << tile.second << ".tmp";
+    return name.str();
+  };
+
+  // 1. bucket the rays of each input into the temporary tile files, a bounded number of rays at a time
+  std::map<TileKey, std::vector<TileRay>> buffers;
+  std::set<TileKey> tiles;
+  TemporaryFiles tile_files;
+  size_t num_buffered = 0;
+  bool write_failed = false;
+  auto flush = [&]() {
+    for (auto &buffer : buffers)
     {
-      if (transient_ray_marks[c][i])
+      if (buffer.second.empty())
       {
-        difference_.addRay(cloud, i);
+        continue;
+      }
+      const bool first_write = tiles.insert(buffer.first).second;
+      if (first_write)
+      {
+        tile_files.add(tileFileName(buffer.first));
+      }
+      std::ofstream out(tileFileName(buffer.first),
+                        std::ios::binary | (first_write ? std::ios::out : std::ios::app));
+      out.write(reinterpret_cast<const char *>(buffer.second.data()), sizeof(TileRay) * buffer.second.size());
+      write_failed |= out.fail();
+      std::vector<TileRay>().swap(buffer.second);
+    }
+    num_buffered = 0;
+  };
+  for (size_t c = 0; c < file_names.size(); c++)
+  {
+    uint64_t ray_id = 0;
+    auto bucket = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                      std::vector<double> &times, std::vector<RGBA> &colours) {
+      for (size_t i = 0; i < ends.size(); i++, ray_id++)
+      {
+        const Eigen::Vector3d lo = minVector(starts[i], ends[i]);
+        const Eigen::Vector3d hi = maxVector(starts[i], ends[i]);
+        const TileKey min_tile = tileOf(lo - Eigen::Vector3d(padding, padding, 0.0));
+        const TileKey max_tile = tileOf(hi + Eigen::Vector3d(padding, padding, 0.0));
+        for (int x = min_tile.first; x <= max_tile.first; x++)
+        {
+          for (int y = min_tile.second; y <= max_tile.second; y++)
+          {
+            const TileKey tile(x, y);
+            Eigen::Vector3d start = starts[i], end = ends[i];
+            if (!tileBox(tile, lo[2], hi[2]).clipRay(start, end))
+            {
+              continue;
+            }
+            TileRay ray;
+            ray.start = starts[i];
+            ray.end = ends[i];
+            ray.time = times[i];
+            ray.colour = colours[i];
+            ray.cloud_id = (uint32_t)c;
+            ray.ray_id = ray_id;
+            buffers[tile].push_back(ray);
+            num_buffered++;
+          }
+        }
+      }
+      if (num_buffered > kMaxBufferedTileRays)
+      {
+        flush();
+      }
+    };
+    if (!Cloud::read(file_names[c], bucket))
+    {
+      return false;
+    }
+  }
+  flush();
+  buffers.clear();
+  if (write_failed)
+  {
+    std::cerr << "Error: failed writing temporary tile files " << tile_stub << "_*.tmp" << std::endl;
+    return false;
+  }
+  std::cout << "bucketed rays into " << tiles.size() << " tiles" << std::endl;
+
+  // 2. merge each tile. Rays are marked for removal in the tile that resolves them, which need not be the tile that
+  // owns them (contains their end point), so the removals are collected per owning tile.
+  const std::vector<TileKey> tile_list(tiles.begin(), tiles.end());
+  std::map<TileKey, std::vector<uint64_t>> removals;
+  for (const auto &tile : tile_list)
+  {
+    removals[tile];
+  }
+  std::mutex removals_mutex;
+  std::atomic<bool> read_failed(false);
+  auto rayKey = [](uint64_t cloud_id, uint64_t ray_id) { return (cloud_id << 40) | ray_id; };
+
+  progress->begin("merge tiles", tile_list.size());
+  auto merge_tile = [&](size_t tile_index) {
+    const TileKey &tile = tile_list[tile_index];
+    std::vector<TileRay> rays;
+    if (!readTileRays(tileFileName(tile), rays))
+    {
+      read_failed = true;
+      progress->increment();
+      return;
+    }
+
+    // The clouds present in this tile, keeping their input order
+    std::vector<int> cloud_index(file_names.size(), -1);
+    std::vector<Cloud> clouds;
+    std::vector<std::vector<size_t>> ray_indices;
+    std::vector<std::vector<bool>> active;
+    double min_z = std::numeric_limits<double>::max(), max_z = std::numeric_limits<double>::lowest();
+    for (const auto &ray : rays)
+    {
+      min_z = std::min(min_z, std::min(ray.start[2], ray.end[2]));
+      max_z = std::max(max_z, std::max(ray.start[2], ray.end[2]));
+    }
+    const Cuboid box = tileBox(tile, min_z, max_z);
+    for (size_t i = 0; i < rays.size(); i++)
+    {
+      const TileRay &ray = rays[i];
+      int &c = cloud_index[ray.cloud_id];
+      if (c == -1)
+      {
+        c = (int)clouds.size();
+        clouds.emplace_back();
+        ray_indices.emplace_back();
+        active.emplace_back();
+      }
+      // clip to the padded tile. Rays that end outside it are unbounded in this tile
+      Eigen::Vector3d start = ray.start, end = ray.end;
+      box.clipRay(start, end);
+      RGBA colour = ray.colour;
+      if (end != ray.end)
+      {
+        colour.red = colour.green = colour.blue = colour.alpha = 0;
+      }
+      clouds[c].addRay(start, end, ray.time, colour);
+      ray_indices[c].push_back(i);
+      active[c].push_back(tileOf(ray.end) == tile);  // only this tile's ellipsoids are resolved here
+    }
+    if (clouds.size() < 2)
+    {
+      progress->increment();
+      return;
+    }
+
+    Merger merger(config_);
+    Progress tile_progress;
+    std::vector<std::vector<Bool>> transient_ray_marks;
+    merger.markMultiple(clouds, &transient_ray_marks, false, &tile_progress, &active, &box);
+    for (size_t c = 0; c < clouds.size(); c++)
+    {
+      for (size_t i = 0; i < clouds[c].rayCount(); i++)
+      {
+        if (transient_ray_marks[c][i])
+        {
+          const TileRay &ray = rays[ray_indices[c][i]];
+          std::lock_guard<std::mutex> lock(removals_mutex);
+          removals[tileOf(ray.end)].push_back(rayKey(ray.cloud_id, ray.ray_id));
+        }
+      }
+    }
+    progress->increment();
+  };
+#if RAYLIB_WITH_TBB
+  tbb::parallel_for<size_t>(0u, tile_list.size(), merge_tile);
+#else   // RAYLIB_WITH_TBB
+  for (size_t i = 0; i < tile_list.size(); i++)
+  {
+    merge_tile(i);
+  }
+#endif  // RAYLIB_WITH_TBB
+  progress->end();
+  if (read_failed)
+  {
+    std::cerr << "Error: failed reading temporary tile files " << tile_stub << "_*.tmp" << std::endl;
+    return false;
+  }
+
+  // 3. stream each tile's owned rays to the output files, and remove the temporary files
+  CloudWriter fixed_writer, difference_writer;
+  if (!fixed_writer.begin(fixed_file) || !difference_writer.begin(difference_file))
+  {
+    return false;
+  }
+  Cloud fixed_chunk, difference_chunk;
+  size_t num_transients = 0;
+  for (const auto &tile : tile_list)
+  {
+    std::vector<uint64_t> &removed = removals[tile];
+    std::sort(removed.begin(), removed.end());
+    std::vector<TileRay> rays;
+    if (!readTileRays(tileFileName(tile), rays))
+    {
+      std::cerr << "Error: failed reading temporary tile file " << tileFileName(tile) << std::endl;
+      return false;
+    }
+    for (const auto &ray : rays)
+    {
+      if (!(tileOf(ray.end) == tile))
+      {
+        continue;
+      }
+      if (std::binary_search(removed.begin(), removed.end(), rayKey(ray.cloud_id, ray.ray_id)))
+      {
+        difference_chunk.addRay(ray.start, ray.end, ray.time, ray.colour);
       }
       else
       {
-        fixed_.addRay(cloud, i);
+        fixed_chunk.addRay(ray.start, ray.end, ray.time, ray.colour);
       }
     }
+    num_transients += difference_chunk.rayCount();
+    fixed_writer.writeChunk(fixed_chunk);
+    difference_writer.writeChunk(difference_chunk);
+    fixed_chunk.clear();
+    difference_chunk.clear();
+    std::remove(tileFileName(tile).c_str());
+  }
+  std::cout << num_transients << " transients" << std::endl;
+  fixed_writer.end();
+  difference_writer.end();
+  return true;
+}
+
+void Merger::generateMapState(const Cloud &map_cloud, MergerMapState *state, Progress *progress)
+{
+  Progress tracker;
+  if (!progress)
+  {
+    progress = &tracker;
+  }
+
+  const double voxel_size = voxelSizeForCloud(map_cloud);
+  if (config_.voxel_size == 0)
+  {
+    std::cout << "estimated required voxel size for map: " << voxel_size << std::endl;
+  }
+  state->ray_grid.init(map_cloud.calcMinBound(), map_cloud.calcMaxBound(), voxel_size);
+  fillRayGrid(&state->ray_grid, map_cloud, progress);
+
+  // just set opacity
+  generateEllipsoids(&ellipsoids_, nullptr, nullptr, map_cloud, progress);
+  std::vector<Bool> transient_ray_marks(map_cloud.rayCount() MARKER_BOOL_INIT);
+  markIntersectedEllipsoids(map_cloud, state->ray_grid, &transient_ray_marks, 0, false, progress);
+  state->ellipsoids.swap(ellipsoids_);
+  ellipsoids_.clear();
+}
+
+bool Merger::mergeIncremental(const Cloud &map_cloud, MergerMapState *state, const Cloud &cloud, Progress *progress)
+{
+  Progress tracker;
+  if (!progress)
+  {
+    progress = &tracker;
+  }
+
+  clear();
+  if (state->ellipsoids.size() != map_cloud.rayCount())
+  {
+    std::cerr << "Error: merger state has " << state->ellipsoids.size() << " ellipsoids, but the map cloud has "
+              << map_cloud.rayCount() << " rays." << std::endl;
+    return false;
+  }
+  if (cloud.rayCount() == 0)
+  {
+    fixed_ = map_cloud;
+    return true;
+  }
+
+  // Only the new cloud needs gridding. We use the map's voxel width so the grids can be combined afterwards.
+  const double voxel_width = state->ray_grid.voxel_width;
+  Grid<unsigned> grid(cloud.calcMinBound(), cloud.calcMaxBound(), voxel_width);
+  fillRayGrid(&grid, cloud, progress);
+
+  std::vector<Bool> map_ray_marks(map_cloud.rayCount() MARKER_BOOL_INIT);
+  std::vector<Bool> ray_marks(cloud.rayCount() MARKER_BOOL_INIT);
+
+  // Map ellipsoids away from the new cloud cannot be intersected by its rays, so we only mark those that overlap it
+  std::vector<size_t> map_ids;
+  for (size_t i = 0; i < state->ellipsoids.size(); i++)
+  {
+    const Ellipsoid &ellipsoid = state->ellipsoids[i];
+    if (((ellipsoid.pos + ellipsoid.extents).array() >= grid.box_min.array()).all() &&
+        ((ellipsoid.pos - ellipsoid.extents).array() <= grid.box_max.array()).all())
+    {
+      map_ids.push_back(i);
+    }
+  }
+  ellipsoids_.resize(map_ids.size());
+  for (size_t i = 0; i < map_ids.size(); i++)
+  {
+    ellipsoids_[i] = state->ellipsoids[map_ids[i]];
+  }
+  // the map is the first cloud, for the purposes of 'order' merge type
+  markIntersectedEllipsoids(cloud, grid, &ray_marks, config_.num_rays_filter_threshold, false, progress, true);
+  for (size_t i = 0; i < map_ids.size(); i++)
+  {
+    if (ellipsoids_[i].transient)
+    {
+      map_ray_marks[map_ids[i]] = true;
+    }
+  }
+
+  // now the new cloud's ellipsoids, intersected by the stored map ray grid
+  generateEllipsoids(&ellipsoids_, nullptr, nullptr, cloud, progress);
+  markIntersectedEllipsoids(cloud, grid, &ray_marks, 0, false, progress);  // just set opacity
+  markIntersectedEllipsoids(map_cloud, state->ray_grid, &map_ray_marks, config_.num_rays_filter_threshold, false,
+                            progress, false);
+  for (size_t i = 0; i < cloud.rayCount(); i++)
+  {
+    if (ellipsoids_[i].transient)
+    {
+      ray_marks[i] = true;
+    }
+  }
+
+  // compose the new map, remembering where each surviving map ray is moved to
+  std::vector<Ellipsoid> map_ellipsoids;
+  std::vector<int> new_ids(map_cloud.rayCount(), -1);
+  for (size_t i = 0; i < map_cloud.rayCount(); i++)
+  {
+    if (map_ray_marks[i])
+    {
+      difference_.addRay(map_cloud, i);
+    }
+    else
+    {
+      new_ids[i] = (int)fixed_.rayCount();
+      fixed_.addRay(map_cloud, i);
+      map_ellipsoids.push_back(state->ellipsoids[i]);
+    }
+  }
+  const unsigned first_new_ray = (unsigned)fixed_.rayCount();
+  for (size_t i = 0; i < cloud.rayCount(); i++)
+  {
+    if (ray_marks[i])
+    {
+      difference_.addRay(cloud, i);
+    }
+    else
+    {
+      fixed_.addRay(cloud, i);
+      map_ellipsoids.push_back(ellipsoids_[i]);
+    }
   }
+  state->ellipsoids.swap(map_ellipsoids);
+  ellipsoids_.clear();
+
+  // The new ray grid covers both clouds. It is offset by a whole number of voxels from the old grid, so the existing
+  // cells are transferred without retracing the map rays.
+  const Grid<unsigned> &old_grid = state->ray_grid;
+  const Eigen::Vector3d shift =
+    ((old_grid.box_min - old_grid.box_min.cwiseMin(grid.box_min)) / voxel_width).array().ceil();
+  const Eigen::Vector3i offset = shift.cast<int>();
+  Grid<unsigned> new_grid(old_grid.box_min - shift * voxel_width, old_grid.box_max.cwiseMax(grid.box_max),
+                          voxel_width);
+  old_grid.walkCells([&new_grid, &new_ids, &offset](const Grid<unsigned> &, const Grid<unsigned>::Cell &cell) {
+    for (const auto &id : cell.data)
+    {
+      if (new_ids[id] >= 0)
+      {
+        const Eigen::Vector3i index = cell.index + offset;
+        new_grid.insert(index[0], index[1], index[2], (unsigned)new_ids[id]);
+      }
+    }
+  });
+  fillRayGrid(&new_grid, fixed_, progress, first_new_ray);
+  state->ray_grid.swap(new_grid);
 
   return true;
 }
@@ -445,10 +1254,10 @@ bool Merger::mergeThreeWay(const Cloud &base_cloud, Cloud &cloud1, Cloud &cloud2
 
   // generate quick lookup for the existance of a particular (quantised) ray
   Cloud *clouds[2] = { &cloud1, &cloud2 };
-  std::set<Vector6i, Vector6iLess> base_ray_lookup;
-  rayLookup(&base_cloud, base_ray_lookup);
-  std::set<Vector6i, Vector6iLess> ray_lookups[2];
-  for (int c = 0; c < 2; c++) rayLookup(clouds[c], ray_lookups[c]);
+  RayKeySet base_ray_lookup;
+  base_ray_lookup.build(base_cloud);
+  RayKeySet ray_lookups[2];
+  for (int c = 0; c < 2; c++) ray_lookups[c].build(*clouds[c]);
 
   std::cout << "set size " << ray_lookups[0].size() << ", " << ray_lookups[1].size() << ", " << base_ray_lookup.size()
             << std::endl;
@@ -459,42 +1268,49 @@ bool Merger::mergeThreeWay(const Cloud &base_cloud, Cloud &cloud1, Cloud &cloud2
   for (int c = 0; c < 2; c++)
   {
     Cloud &cloud = *clouds[c];
+    const int other = 1 - c;
+    // look up all the rays in parallel first
+    std::vector<uint8_t> in_other(cloud.rayCount()), in_base(cloud.rayCount());
+    const auto look_up = [&](size_t i)  //
+    {
+      const RayKey ray = quantiseRay(cloud.starts[i], cloud.ends[i]);
+      in_other[i] = ray_lookups[other].contains(ray);
+      in_base[i] = base_ray_lookup.contains(ray);
+    };
+#if RAYLIB_WITH_TBB
+    tbb::parallel_for<size_t>(0u, cloud.rayCount(), look_up);
+#else   // RAYLIB_WITH_TBB
+    for (size_t i = 0; i < cloud.rayCount(); i++)
+    {
+      look_up(i);
+    }
+#endif  // RAYLIB_WITH_TBB
+
+    size_t num_changed = 0;
     for (size_t i = 0; i < cloud.rayCount(); i++)
     {
-      Eigen::Vector3d &point = cloud.ends[i];
-      Eigen::Vector3d &start = cloud.starts[i];
-      Vector6i ray;
-      for (int j = 0; j < 3; j++)
-      {
-        ray[j] = int(std::floor(start[j] / test_width));
-        ray[3 + j] = int(std::floor(point[j] / test_width));
-      }
-      int other = 1 - c;
       // if the ray is in cloud1 and cloud2 there is no contention, so add the ray to the result
-      if (ray_lookups[other].find(ray) != ray_lookups[other].end())
+      if (in_other[i] && c == preferred_cloud)
       {
-        if (c == preferred_cloud)
-        {
-          fixed_.addRay(start, point, cloud.times[i], cloud.colours[i]);
-          u++;
-        }
+        fixed_.addRay(cloud, i);
+        u++;
       }
       // we want to run the combine (which revolves conflicts) on only the changed parts
       // so we want to keep only the changes for cloud[0] and cloud[1]...
       // which means removing rays that aren't changed:
-      if (base_ray_lookup.find(ray) != base_ray_lookup.end())
+      if (!in_base[i])
       {
-        cloud.starts[i] = cloud.starts.back();
-        cloud.starts.pop_back();
-        cloud.ends[i] = cloud.ends.back();
-        cloud.ends.pop_back();
-        cloud.times[i] = cloud.times.back();
-        cloud.times.pop_back();
-        cloud.colours[i] = cloud.colours.back();
-        cloud.colours.pop_back();
-        i--;
+        cloud.starts[num_changed] = cloud.starts[i];
+        cloud.ends[num_changed] = cloud.ends[i];
+        cloud.times[num_changed] = cloud.times[i];
+        cloud.colours[num_changed] = cloud.colours[i];
+        num_changed++;
       }
     }
+    cloud.starts.resize(num_changed);
+    cloud.ends.resize(num_changed);
+    cloud.times.resize(num_changed);
+    cloud.colours.resize(num_changed);
   }
   std::cout << u << " unaltered rays have been moved into combined cloud" << std::endl;
   std::cout << clouds[0]->rayCount() << " and " << clouds[1]->rayCount() << " rays to combine, that are different"
@@ -581,11 +1397,11 @@ void Merger::clear()
   ellipsoids_.clear();
 }
 
-void Merger::fillRayGrid(Grid<unsigned> *grid, const Cloud &cloud, Progress *progress)
+void Merger::fillRayGrid(Grid<unsigned> *grid, const Cloud &cloud, Progress *progress, unsigned first_ray)
 {
   if (progress)
   {
-    progress->begin("fillRayGrid", cloud.rayCount());
+    progress->begin("fillRayGrid", cloud.rayCount() - first_ray);
   }
 
   const auto add_ray = [grid, &cloud, progress](unsigned i)  //
@@ -632,9 +1448,9 @@ void Merger::fillRayGrid(Grid<unsigned> *grid, const Cloud &cloud, Progress *pro
   };
 
 #if RAYLIB_PARALLEL_GRID
-  tbb::parallel_for<unsigned>(0u, unsigned(cloud.rayCount()), add_ray);
+  tbb::parallel_for<unsigned>(first_ray, unsigned(cloud.rayCount()), add_ray);
 #else   // RAYLIB_PARALLEL_GRID
-  for (unsigned i = 0; i < unsigned(cloud.rayCount()); i++)
+  for (unsigned i = first_ray; i < unsigned(cloud.rayCount()); i++)
   {
     add_ray(i);
   }
@@ -663,7 +1479,7 @@ void Merger::markIntersectedEllipsoids(const Cloud &cloud, const Grid<unsigned>
                                        std::vector<Bool> *transient_ray_marks, double num_rays, 
                                        bool self_transient, Progress *progress, bool ellipsoid_cloud_first)
 {
-  progress->begin("transient-mark-ellipsoids", cloud.rayCount());
+  progress->begin("transient-mark-ellipsoids", ellipsoids_.size());
 
   // Check each ellipsoid against the ray grid for intersections.
 #if RAYLIB_WITH_TBB
@@ -681,7 +1497,7 @@ void Merger::markIntersectedEllipsoids(const Cloud &cloud, const Grid<unsigned>
                 config_.merge_type, self_transient, ellipsoid_cloud_first);
     progress->increment();
   };
-  tbb::parallel_for<size_t>(0u, cloud.rayCount(), tbb_process_ellipsoid);
+  tbb::parallel_for<size_t>(0u, ellipsoids_.size(), tbb_process_ellipsoid);
 #else   // RAYLIB_WITH_TBB
   std::vector<bool> ray_tested;
   ray_tested.resize(cloud.rayCount(), false);
@@ -9,10 +9,12 @@
 
 #include "raygrid.h"
 #include "raycloud.h"
+#include "raycuboid.h"
 #include "rayellipsoid.h"
 
 #include <atomic>
 #include <limits>
+#include <string>
 #include <vector>
 
 namespace ray
@@ -42,6 +44,20 @@ struct RAYLIB_EXPORT MergerConfig
   bool colour_cloud = true;
 };
 
+/// The persistent merge state of a map cloud, which allows new clouds to be merged into the map incrementally.
+/// It holds the map's ellipsoids, with their opacities resolved against the map's own rays, and the grid of map rays.
+/// Both are indexed by the ray index in the map cloud.
+struct RAYLIB_EXPORT MergerMapState
+{
+  std::vector<Ellipsoid> ellipsoids;
+  Grid<unsigned> ray_grid;
+
+  /// Save the state to a binary file, generally stored alongside the map cloud
+  bool save(const std::string &file_name) const;
+  /// Load the state from a file generated by @c save()
+  bool load(const std::string &file_name);
+};
+
 /// A cloud merger which supports filtering 'transient' rays and merging from a ray clouds. A transient ray is one which
 /// is in conflict with sample observations and rays passing through the observation. For example, transient points are
 /// generated by movable objects in a ray cloud such as people moving through a scan or doors being openned and closed.
@@ -70,6 +86,31 @@ public:
   /// Multi-merge
   bool mergeMultiple(std::vector<Cloud> &clouds, Progress *progress = nullptr);
 
+  /// Streaming multi-merge of the ray cloud files @p file_names , for inputs too large to hold in memory together.
+  /// Each file is read in chunks, and its rays are bucketed into temporary files (next to @p fixed_file ) for each
+  /// square tile of width @p tile_width in x,y that the ray passes within 0.1 x @p tile_width of. The tiles are then
+  /// merged independently and in parallel, with each ellipsoid resolved only in the tile that contains it. The results
+  /// are streamed to @p fixed_file and @p difference_file , so peak memory is bounded by the tile size rather than
+  /// the number or size of the inputs. @c fixedCloud() and @c differenceCloud() are not used.
+  bool mergeMultipleTiled(const std::vector<std::string> &file_names, double tile_width,
+                          const std::string &fixed_file, const std::string &difference_file,
+                          Progress *progress = nullptr);
+
+  /// Generate the persistent merge @p state of @p map_cloud, as used by @c mergeIncremental()
+  void generateMapState(const Cloud &map_cloud, MergerMapState *state, Progress *progress = nullptr);
+
+  /// Incremental merge of @p cloud into @p map_cloud, whose merge @p state was generated by @c generateMapState() or
+  /// loaded from file. Only the new cloud's ellipsoids and ray grid are generated, and only the map ellipsoids within
+  /// the new cloud's bounds are tested, so the cost is proportional to the new cloud rather than the whole map.
+  /// From a freshly generated state the result is equivalent to @c mergeMultiple() on the two clouds, and @p state is
+  /// updated to match the resulting @c fixedCloud() , ready for the next increment.
+  /// Successive increments only approximate @c mergeMultiple() on all of the clouds at once: the stored map
+  /// ellipsoid opacities are not recomputed against later rays, rays removed by earlier increments no longer pass
+  /// through the new cloud's ellipsoids, and the map rays are counted together against the filter threshold rather
+  /// than per input cloud.
+  bool mergeIncremental(const Cloud &map_cloud, MergerMapState *state, const Cloud &cloud,
+                        Progress *progress = nullptr);
+
   /// Three way merger
   bool mergeThreeWay(const Cloud &base_cloud, Cloud &cloud1, Cloud &cloud2, Progress *progress = nullptr);
 
@@ -84,12 +125,21 @@ public:
   /// @param grid The grid to populate
   /// @param cloud The cloud which grid indices reference rays in.
   /// @param progress Optional progress tracker.
+  /// @param first_ray Rays before this index in @p cloud are not added.
   /// @todo This needs a more global home
-  static void fillRayGrid(Grid<unsigned> *grid, const Cloud &cloud, Progress *progress = nullptr);
+  static void fillRayGrid(Grid<unsigned> *grid, const Cloud &cloud, Progress *progress = nullptr,
+                          unsigned first_ray = 0);
 
 private:
   double voxelSizeForCloud(const Cloud &cloud) const;
 
+  /// The marking stage of @c mergeMultiple() . Fills @p transient_ray_marks for each of the @p clouds .
+  /// @p active_ellipsoids optionally limits which rays' ellipsoids are resolved, and @p bounds optionally sets a
+  /// common ray grid bounds, rather than the bounds of each cloud's bounded rays.
+  void markMultiple(const std::vector<Cloud> &clouds, std::vector<std::vector<Bool>> *transient_ray_marks,
+                    bool verbose, Progress *progress, const std::vector<std::vector<bool>> *active_ellipsoids = nullptr,
+                    const Cuboid *bounds = nullptr);
+
   /// For all ellipsoids_ intersect with rays in @c cloud (accelerated using @c ray_grid)
   /// depending on config.merge_type, either mark the ellipsoid object as removed, or
   /// mark the ray (through @c transient_ray_marks) as removed.
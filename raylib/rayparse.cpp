@@ -3,8 +3,11 @@
 // ABN 41 687 119 230
 //
 // Author: Thomas Lowe
+#include <algorithm>
+#include <fstream>
 #include <iostream>
 #include <limits>
+#include <sys/stat.h>
 #include "rayutils.h"
 #include "rayparse.h"
 
@@ -26,6 +29,45 @@ std::string getFileNameExtension(const std::string &name)
   return "";
 }
 
+bool getFileStamp(const std::string &name, FileStamp &stamp)
+{
+  struct stat file_stat;
+  if (stat(name.c_str(), &file_stat) != 0)
+    return false;
+  stamp.size = static_cast<long long>(file_stat.st_size);
+  stamp.modified = static_cast<long long>(file_stat.st_mtime) * 1000000000LL;
+#if defined(__APPLE__)
+  stamp.modified += static_cast<long long>(file_stat.st_mtimespec.tv_nsec);
+#elif !defined(_WIN32)
+  stamp.modified += static_cast<long long>(file_stat.st_mtim.tv_nsec);
+#endif
+
+  // Timestamps can be too coarse to separate quick successive edits, so we also hash the first and last chunks of 
+  // the file and some chunks in between. An in-place transformation of a ray cloud changes all of them.
+  std::ifstream ifs(name.c_str(), std::ios::binary | std::ios::in);
+  if (ifs.fail())
+    return false;
+  const long long chunk_size = 4096;
+  const int num_chunks = 8;
+  std::vector<char> chunk(chunk_size);
+  uint64_t hash = 14695981039346656037ULL; // 64 bit FNV-1a
+  for (int i = 0; i < num_chunks; i++)
+  {
+    const long long start = std::max(0LL, (stamp.size - chunk_size) * i / (num_chunks - 1));
+    ifs.seekg(start);
+    ifs.read(chunk.data(), chunk_size);
+    const std::streamsize num_read = ifs.gcount();
+    ifs.clear();
+    for (std::streamsize j = 0; j < num_read; j++)
+    {
+      hash ^= static_cast<unsigned char>(chunk[j]);
+      hash *= 1099511628211ULL;
+    }
+  }
+  stamp.content_hash = hash;
+  return true;
+}
+
 // Process the command line according to the specified format.
 // fixed_arguments are always in order and don't have a "-" prefix. optional_arguments appear in any order after the fixed arguments, and have a "-" or "--" prefix.
 bool parseCommandLine(int argc, char *argv[], const std::vector<FixedArgument *> &fixed_arguments, std::vector<OptionalArgument *> optional_arguments, bool set_values_)
@@ -250,6 +292,36 @@ bool KeyChoice::parse(int argc, char *argv[], int &index, bool set_value)
   return false;
 }
 
+bool KeyChoiceList::parse(int argc, char *argv[], int &index, bool set_value)
+{
+  if (index >= argc)
+    return false;
+  std::string str(argv[index]);
+  index++;
+  std::vector<int> ids;
+  std::vector<std::string> keys;
+  size_t start = 0;
+  while (start <= str.length())
+  {
+    size_t end = str.find(',', start);
+    if (end == std::string::npos)
+      end = str.length();
+    const std::string key = str.substr(start, end - start);
+    const auto it = std::find(keys_.begin(), keys_.end(), key);
+    if (it == keys_.end())
+      return false;
+    ids.push_back(static_cast<int>(it - keys_.begin()));
+    keys.push_back(key);
+    start = end + 1;
+  }
+  if (set_value)
+  {
+    selected_ids_ = ids; 
+    selected_keys_ = keys;
+  }
+  return true;
+}
+
 bool KeyValueChoice::parse(int argc, char *argv[], int &index, bool set_value)
 {
   if (index >= argc)
@@ -7,6 +7,7 @@
 #define RAYLIB_RAYPARSE_H
 
 #include "rayutils.h"
+#include <cstdint>
 #include <iostream>
 #include <limits>
 
@@ -18,6 +19,25 @@ std::string RAYLIB_EXPORT getFileNameStub(const std::string &name);
 /// Helper function: get the part of the filename after the . 
 std::string RAYLIB_EXPORT getFileNameExtension(const std::string &name);
 
+/// Identifies the current contents of a file, so that data derived from it can be checked to still be up to date
+struct RAYLIB_EXPORT FileStamp
+{
+  long long size = 0;
+  long long modified = 0;     ///< modification time in nanoseconds, to the precision stored by the platform
+  uint64_t content_hash = 0;  ///< hash of the file's header and of chunks sampled through the file
+
+  inline bool operator==(const FileStamp &other) const
+  {
+    return size == other.size && modified == other.modified && content_hash == other.content_hash;
+  }
+  inline bool operator!=(const FileStamp &other) const { return !(*this == other); }
+};
+
+/// Helper function: get the @c stamp of the file @c name . This reads only a few small chunks of the file, so
+/// detects in-place edits that keep the file size, even within the modification time's precision.
+/// Returns false if the file cannot be read
+bool RAYLIB_EXPORT getFileStamp(const std::string &name, FileStamp &stamp);
+
 /// Parses a command line according to a given format which can include fixed arguments and then a set of optional arguments
 /// Values in the passed-in lists are only set when it returns true. This allows the function to be called multiple times for different formats
 /// Only make @param set_values false if you only need to know if the format matches the arguments @param argv.
@@ -175,6 +195,21 @@ private:
   std::string selected_key_;
 };
 
+/// A comma separated list of keys from a set of choices, e.g. "top,left,front". A single key is a list of one
+class RAYLIB_EXPORT KeyChoiceList : public FixedArgument 
+{
+public:
+  KeyChoiceList(const std::initializer_list<std::string> &keys) : keys_(keys) {}
+  virtual bool parse(int argc, char *argv[], int &index, bool set_value);
+  inline const std::vector<std::string> &keys() const { return keys_; }
+  inline const std::vector<int> &selectedIDs() const { return selected_ids_; }
+  inline const std::vector<std::string> &selectedKeys() const { return selected_keys_; }
+private:
+  std::vector<std::string> keys_;
+  std::vector<int> selected_ids_;
+  std::vector<std::string> selected_keys_;
+};
+
 /// A choice of different key-value pairs, e.g. "pos 1,2,3" / "distance 14.2" / "num_rays 120"
 class RAYLIB_EXPORT KeyValueChoice : public FixedArgument 
 {
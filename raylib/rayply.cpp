@@ -7,8 +7,17 @@
 #include "rayply.h"
 #include "raylib/rayprogress.h"
 #include "raylib/rayprogressthread.h"
-
+#include "raylib/rayrandom.h"
+#include "raylib/rayunused.h"
+
+#if RAYLIB_WITH_TBB
+#include <tbb/parallel_for.h>
+#endif  // RAYLIB_WITH_TBB
+#include <condition_variable>
+#include <deque>
 #include <iostream>
+#include <mutex>
+#include <thread>
 // #define OUTPUT_MOMENTS // useful when setting up unit test expected ray clouds
 
 namespace ray
@@ -263,7 +272,8 @@ bool writePlyPointCloud(const std::string &file_name, const std::vector<Eigen::V
 
 bool readPly(const std::string &file_name, bool is_ray_cloud, 
      std::function<void(std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends, 
-     std::vector<double> &times, std::vector<RGBA> &colours)> apply, double max_intensity, size_t chunk_size)
+     std::vector<double> &times, std::vector<RGBA> &colours)> apply, double max_intensity, size_t chunk_size,
+     size_t sample_size)
 {
   std::cout << "reading: " << file_name << std::endl;
   std::ifstream input(file_name.c_str());
@@ -333,6 +343,12 @@ bool readPly(const std::string &file_name, bool is_ray_cloud,
   size_t length = input.tellg() - start;
   input.seekg(start);
   size_t size = length / row_size;
+  // when sampling, row i is read from a random position within the i'th section of the file
+  const size_t file_size = size;
+  const bool sampling = sample_size > 0 && sample_size < size;
+  if (sampling)
+    size = sample_size;
+  PCGRandomGenerator sample_generator;
 
   ray::Progress progress;
   ray::ProgressThread progress_thread(progress);
@@ -381,6 +397,13 @@ bool readPly(const std::string &file_name, bool is_ray_cloud,
     intensities.reserve(reserve_size);
   for (size_t i = 0; i < size; i++)
   {
+    if (sampling)
+    {
+      const size_t section_start = (i * file_size) / size;
+      const size_t section_length = ((i + 1) * file_size) / size - section_start;
+      const size_t row = section_start + sample_generator() % section_length;
+      input.seekg(start + static_cast<std::streamoff>(row * row_size));
+    }
     input.read((char *)&vertices[0], row_size);
     Eigen::Vector3d end;
     if (pos_is_float)
@@ -628,7 +651,8 @@ bool readPlyMesh(const std::string &file, Mesh &mesh)
 }
 
 bool convertCloud(const std::string &in_name, const std::string &out_name, 
-  std::function<void(Eigen::Vector3d &start, Eigen::Vector3d &ends, double &time, RGBA &colour)> apply)
+  std::function<void(Eigen::Vector3d &start, Eigen::Vector3d &ends, double &time, RGBA &colour)> apply,
+  bool in_parallel)
 {
   std::ofstream ofs;
   if (!writeRayCloudChunkStart(out_name, ofs))
@@ -636,13 +660,25 @@ bool convertCloud(const std::string &in_name, const std::string &out_name,
   ray::RayPlyBuffer buffer;
 
   // run the function 'apply' on each ray as it is read in, and write it out, one chunk at a time
-  auto applyToChunk = [&apply, &buffer, &ofs](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends, std::vector<double> &times, std::vector<ray::RGBA> &colours)
+  auto applyToChunk = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends, std::vector<double> &times, std::vector<ray::RGBA> &colours)
   {
-    for (size_t i = 0; i < ends.size(); i++)
+    // We can adjust the applyToChunk arguments directly as they are non-const and their modification doesn't have side effects
+    auto applyToRay = [&](size_t i) { apply(starts[i], ends[i], times[i], colours[i]); };
+#if RAYLIB_WITH_TBB
+    if (in_parallel)
     {
-      // We can adjust the applyToChunk arguments directly as they are non-const and their modification doesn't have side effects
-      apply(starts[i], ends[i], times[i], colours[i]);
+      tbb::parallel_for<size_t>(0, ends.size(), applyToRay);
     }
+    else
+    {
+      for (size_t i = 0; i < ends.size(); i++)
+        applyToRay(i);
+    }
+#else   // RAYLIB_WITH_TBB
+    RAYLIB_UNUSED(in_parallel);
+    for (size_t i = 0; i < ends.size(); i++)
+      applyToRay(i);
+#endif  // RAYLIB_WITH_TBB
     ray::writeRayCloudChunk(ofs, buffer, starts, ends, times, colours);
   };
   if (!ray::readPly(in_name, true, applyToChunk, 0))
@@ -651,4 +687,88 @@ bool convertCloud(const std::string &in_name, const std::string &out_name,
   return true;
 }
 
+bool concatenateClouds(const std::vector<std::string> &in_names, const std::string &out_name)
+{
+  std::ofstream ofs;
+  if (!writeRayCloudChunkStart(out_name, ofs))
+    return false;
+  ray::RayPlyBuffer buffer;
+
+  // The reader thread fills a small queue with chunks from each file in turn, while this thread writes them out. 
+  // Written chunks are recycled back to the reader, to avoid reallocating them. 
+  struct Chunk
+  {
+    std::vector<Eigen::Vector3d> starts, ends;
+    std::vector<double> times;
+    std::vector<ray::RGBA> colours;
+  };
+  const size_t max_queued_chunks = 3;
+  std::deque<Chunk> queue, spares;
+  std::mutex mutex;
+  std::condition_variable changed;
+  bool reading = true;
+  bool read_ok = true;
+
+  std::thread reader([&]()
+  {
+    auto enqueue = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends, 
+                       std::vector<double> &times, std::vector<ray::RGBA> &colours)
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      changed.wait(lock, [&]{ return queue.size() < max_queued_chunks; });
+      Chunk chunk;
+      if (!spares.empty())
+      {
+        chunk = std::move(spares.front());
+        spares.pop_front();
+      }
+      // swap rather than copy. The emptied (recycled) vectors are refilled for the next chunk
+      chunk.starts.swap(starts);
+      chunk.ends.swap(ends);
+      chunk.times.swap(times);
+      chunk.colours.swap(colours);
+      starts.clear(); 
+      ends.clear();
+      times.clear();
+      colours.clear();
+      queue.push_back(std::move(chunk));
+      changed.notify_all();
+    };
+    for (const auto &in_name : in_names)
+    {
+      if (!ray::readPly(in_name, true, enqueue, 0))
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        read_ok = false;
+        break;
+      }
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    reading = false;
+    changed.notify_all();
+  });
+
+  bool write_ok = true;
+  for (;;)
+  {
+    Chunk chunk;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      changed.wait(lock, [&]{ return !queue.empty() || !reading; });
+      if (queue.empty())
+        break;
+      chunk = std::move(queue.front());
+      queue.pop_front();
+      changed.notify_all();
+    }
+    write_ok &= ray::writeRayCloudChunk(ofs, buffer, chunk.starts, chunk.ends, chunk.times, chunk.colours);
+    std::unique_lock<std::mutex> lock(mutex);
+    spares.push_back(std::move(chunk));
+  }
+  reader.join();
+  const unsigned long num_rays = ray::writeRayCloudChunkEnd(ofs);
+  std::cout << num_rays << " rays saved to " << out_name << std::endl;
+  return read_ok && write_ok;
+}
+
 } // ray
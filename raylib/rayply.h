@@ -32,9 +32,12 @@ bool RAYLIB_EXPORT writePlyMesh(const std::string &file_name_rawaw, const class
 /// ready in a ray cloud or point cloud .ply file, and call the @c apply function one chunk at a time, 
 /// @c chunk_size is the number of rays to read at one time. This method can be used on large clouds where
 /// the full set of rays is not required to be in memory at one time.
+/// When @c sample_size is non-zero and the file has more rows than this, only a random sample of @c sample_size rows 
+/// is read, one from each of @c sample_size equal sections of the file, seeking past the rest.
 bool RAYLIB_EXPORT readPly(const std::string &file_name, bool is_ray_cloud, 
      std::function<void(std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends, 
-     std::vector<double> &times, std::vector<RGBA> &colours)> apply, double max_intensity, size_t chunk_size = 1000000);
+     std::vector<double> &times, std::vector<RGBA> &colours)> apply, double max_intensity, size_t chunk_size = 1000000,
+     size_t sample_size = 0);
 
 /// write a .ply file representing a point cloud
 bool RAYLIB_EXPORT writePlyPointCloud(const std::string &file_name, const std::vector<Eigen::Vector3d> &points, 
@@ -58,8 +61,14 @@ bool RAYLIB_EXPORT writePointCloudChunk(std::ofstream &out, PointPlyBuffer &vert
 void RAYLIB_EXPORT writePointCloudChunkEnd(std::ofstream &out);
 
 /// Simple function for converting a ray cloud according to the per-ray function @c apply
+/// If @c in_parallel then @c apply is called concurrently on the rays of each chunk, so it must be thread safe
 bool convertCloud(const std::string &in_name, const std::string &out_name, 
-  std::function<void(Eigen::Vector3d &start, Eigen::Vector3d &ends, double &time, RGBA &colour)> apply);
+  std::function<void(Eigen::Vector3d &start, Eigen::Vector3d &ends, double &time, RGBA &colour)> apply,
+  bool in_parallel = false);
+
+/// Concatenate the ray clouds @c in_names into the single ray cloud @c out_name , streaming one chunk at a time.
+/// The files are read on a separate thread and written in order, so memory use is constant.
+bool RAYLIB_EXPORT concatenateClouds(const std::vector<std::string> &in_names, const std::string &out_name);
 }  // namespace ray
 
 #endif  // RAYLIB_RAYPLY_H
@@ -7,166 +7,660 @@
 #include "raycloud.h"
 #include "rayparse.h"
 #include "imagewrite.h"
+#include <fstream>
+#include <cstring>
+#if RAYLIB_WITH_TBB
+#include <tbb/parallel_for.h>
+#endif // RAYLIB_WITH_TBB
 
 #define DENSITY_MIN_RAYS 10 // larger is more accurate but more blurred. 0 for no adaptive blending
 
 namespace ray
 {
+// definitions of the brick constants, which are used by reference in unoptimised builds
+const int DensityGrid::brick_bits;
+const int DensityGrid::brick_width;
+const int DensityGrid::brick_size;
   
+template <class T> 
+void DensityGrid::walkRay(const Eigen::Vector3d &ray_start, const Eigen::Vector3d &ray_end, bool bounded, T func) const
+{
+  Eigen::Vector3d start = ray_start;
+  Eigen::Vector3d end   = ray_end;
+  if (!bounds_.clipRay(start, end))
+  {
+    return; // the ray misses the grid
+  }
+
+  // now walk the voxels
+  const Eigen::Vector3d dir = end - start;
+  const Eigen::Vector3d source = (start - bounds_.min_bound_)/voxel_width_;
+  const Eigen::Vector3d target = (end - bounds_.min_bound_)/voxel_width_;
+  const double length = dir.norm();
+  const double eps = 1e-9; // to stay away from edge cases
+  const double maxDist = (target - source).norm();
+  
+  // cached values to speed up the loop below
+  Eigen::Vector3i adds;
+  Eigen::Vector3d offsets;
+  for (int k = 0; k<3; ++k)
+  {
+    if (dir[k] > 0.0)
+    {
+      adds[k] = 1;
+      offsets[k] = 0.5;
+    }
+    else
+    {
+      adds[k] = -1;
+      offsets[k] = -0.5;
+    }
+  }
+
+  Eigen::Vector3d p = source; // our moving variable as we walk over the grid
+  // a ray clipped to the upper faces of the grid starts on their boundary, so it is kept within the voxels
+  Eigen::Vector3i inds = p.cast<int>().cwiseMax(0).cwiseMin(voxel_dims_ - Eigen::Vector3i(1, 1, 1));
+  double depth = 0;
+  // walk over the grid, one voxel at a time. 
+  do
+  {
+    double ls[3] = {(round(p[0] + offsets[0]) - p[0]) / dir[0],
+                    (round(p[1] + offsets[1]) - p[1]) / dir[1],
+                    (round(p[2] + offsets[2]) - p[2]) / dir[2]};
+    int axis = (ls[0] < ls[1] && ls[0] < ls[2]) ? 0 : (ls[1] < ls[2] ? 1 : 2);
+    inds[axis] += adds[axis];
+    if (inds[axis] < 0 || inds[axis] >= voxel_dims_[axis])
+    {
+      break;
+    }
+    double minL = ls[axis] * length;
+    depth += minL + eps;
+    p = source + dir * (depth / length);
+    if (bounded && depth > maxDist)
+    {
+      double length_in_voxel = minL + maxDist - depth;
+      func(inds, static_cast<float>(length_in_voxel*voxel_width_), true);
+    }
+    else
+    {
+      func(inds, static_cast<float>(minL*voxel_width_), false); 
+    }
+  } while (depth <= maxDist);
+}
+
+namespace
+{
+/// A single voxel visited by a ray, recorded so that it can be applied to the grid later
+struct VoxelVisit
+{
+  Eigen::Vector3i inds;
+  float length;
+  bool hit;
+};
+}
+
 /// Calculate the surface area per cubic metre within each voxel of the grid. Assuming an unbiased distribution
 /// of surface angles.
 void DensityGrid::calculateDensities(const std::string &file_name)
 {
   auto calculate = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends, std::vector<double> &, std::vector<RGBA> &colours)
   {
-    for (size_t i = 0; i<ends.size(); ++i)
-    {
-      Eigen::Vector3d start = starts[i];
-      Eigen::Vector3d end   = ends[i];
-      bounds_.clipRay(start, end);
-
-      // now walk the voxels
-      const Eigen::Vector3d dir = end - start;
-      const Eigen::Vector3d source = (start - bounds_.min_bound_)/voxel_width_;
-      const Eigen::Vector3d target = (end - bounds_.min_bound_)/voxel_width_;
-      const double length = dir.norm();
-      const double eps = 1e-9; // to stay away from edge cases
-      const double maxDist = (target - source).norm();
-      
-      // cached values to speed up the loop below
-      Eigen::Vector3i adds;
-      Eigen::Vector3d offsets;
-      for (int k = 0; k<3; ++k)
+    addRays(starts, ends, colours);
+  };
+  Cloud::read(file_name, calculate);
+}
+
+void DensityGrid::addRays(const std::vector<Eigen::Vector3d> &starts, const std::vector<Eigen::Vector3d> &ends, 
+                          const std::vector<RGBA> &colours)
+{
+  const auto add_visit = [this](const Eigen::Vector3i &inds, float length, bool hit)
+  {
+    Voxel &voxel = touchVoxel(inds);
+    if (hit)
+      voxel.addHitRay(length);
+    else
+      voxel.addMissRay(length); 
+  };
+#if RAYLIB_WITH_TBB
+  // The rays are walked in parallel, recording their voxel visits. Then the grid is split into slabs of bricks along 
+  // its longest axis, and each slab applies its visits in ray order, so the result is identical to a serial walk.
+  // Blocks of consecutive rays are limited by their number of visits as well as rays, so long rays do not grow the
+  // visit buffers without bound.
+  const int rays_per_block = 256;
+  const size_t visits_per_block = 1 << 14;
+  const int blocks_per_batch = 128;
+  int slab_axis = 0;
+  for (int k = 1; k < 3; k++)
+  {
+    if (brick_dims_[k] > brick_dims_[slab_axis])
+      slab_axis = k;
+  }
+  const int num_slabs = brick_dims_[slab_axis];
+  // an upper bound on the voxels that each ray visits, from its length within the grid
+  std::vector<uint32_t> max_visits(ends.size());
+  const size_t max_ray_visits = static_cast<size_t>(voxel_dims_.sum()) + 1;
+  tbb::parallel_for<size_t>(0, ends.size(), [&](size_t i)
+  {
+    Eigen::Vector3d start = starts[i];
+    Eigen::Vector3d end = ends[i];
+    bounds_.clipRay(start, end);
+    const double crossings = ((end - start) / voxel_width_).cwiseAbs().sum() + 4.0;
+    max_visits[i] = static_cast<uint32_t>(std::min(static_cast<double>(max_ray_visits), crossings));
+  });
+  // per block, the visits are sorted by slab, with the start of each slab's range in slab_starts
+  std::vector<std::vector<VoxelVisit>> block_visits(blocks_per_batch), block_sorted(blocks_per_batch);
+  std::vector<std::vector<int>> slab_starts(blocks_per_batch, std::vector<int>(num_slabs + 1));
+  std::vector<size_t> block_starts;
+  block_starts.reserve(blocks_per_batch + 1);
+  for (size_t batch_start = 0; batch_start < ends.size(); batch_start = block_starts.back())
+  {
+    // divide the batch into blocks of consecutive rays, each with at least one ray
+    block_starts.clear();
+    size_t ray = batch_start;
+    while (ray < ends.size() && static_cast<int>(block_starts.size()) < blocks_per_batch)
+    {
+      block_starts.push_back(ray);
+      size_t num_visits = 0;
+      for (int num_rays = 0; ray < ends.size() && num_rays < rays_per_block; num_rays++, ray++)
       {
-        if (dir[k] > 0.0)
-        {
-          adds[k] = 1;
-          offsets[k] = 0.5;
-        }
-        else
-        {
-          adds[k] = -1;
-          offsets[k] = -0.5;
-        }
+        if (num_rays > 0 && num_visits + max_visits[ray] > visits_per_block)
+          break;
+        num_visits += max_visits[ray];
       }
- 
-      Eigen::Vector3d p = source; // our moving variable as we walk over the grid
-      Eigen::Vector3i inds = p.cast<int>();
-      double depth = 0;
-      // walk over the grid, one voxel at a time. 
-      do
+    }
+    block_starts.push_back(ray);
+    const int num_blocks = static_cast<int>(block_starts.size()) - 1;
+    tbb::parallel_for(0, num_blocks, [&](int b)
+    {
+      std::vector<VoxelVisit> &visits = block_visits[b];
+      std::vector<int> &starts_b = slab_starts[b];
+      visits.clear();
+      std::fill(starts_b.begin(), starts_b.end(), 0);
+      for (size_t i = block_starts[b]; i < block_starts[b + 1]; i++)
       {
-        double ls[3] = {(round(p[0] + offsets[0]) - p[0]) / dir[0],
-                        (round(p[1] + offsets[1]) - p[1]) / dir[1],
-                        (round(p[2] + offsets[2]) - p[2]) / dir[2]};
-        int axis = (ls[0] < ls[1] && ls[0] < ls[2]) ? 0 : (ls[1] < ls[2] ? 1 : 2);
-        inds[axis] += adds[axis];
-        if (inds[axis] < 0 || inds[axis] >= voxel_dims_[axis])
-        {
-          break;
-        }
-        double minL = ls[axis] * length;
-        depth += minL + eps;
-        p = source + dir * (depth / length);
-        int index = getIndex(inds);
-        if (colours[i].alpha > 0 && depth > maxDist)
+        walkRay(starts[i], ends[i], colours[i].alpha > 0, [&](const Eigen::Vector3i &inds, float length, bool hit)
         {
-          double length_in_voxel = minL + maxDist - depth;
-          voxels_[index].addHitRay(static_cast<float>(length_in_voxel*voxel_width_));
-        }
-        else
+          visits.push_back(VoxelVisit{inds, length, hit});
+          starts_b[(inds[slab_axis] >> brick_bits) + 1]++;
+        });
+      }
+      // stable counting sort of the visits by slab
+      for (int s = 0; s < num_slabs; s++)
+        starts_b[s + 1] += starts_b[s];
+      std::vector<VoxelVisit> &sorted = block_sorted[b];
+      sorted.resize(visits.size());
+      std::vector<int> heads(starts_b.begin(), starts_b.end() - 1);
+      for (auto &visit: visits)
+        sorted[heads[visit.inds[slab_axis] >> brick_bits]++] = visit;
+    });
+    // each slab only allocates and modifies its own bricks
+    tbb::parallel_for(0, num_slabs, [&](int s)
+    {
+      for (int b = 0; b < num_blocks; b++)
+      {
+        const std::vector<VoxelVisit> &sorted = block_sorted[b];
+        for (int j = slab_starts[b][s]; j < slab_starts[b][s + 1]; j++)
+          add_visit(sorted[j].inds, sorted[j].length, sorted[j].hit);
+      }
+    });
+  }
+#else  // RAYLIB_WITH_TBB
+  for (size_t i = 0; i<ends.size(); ++i)
+  {
+    walkRay(starts[i], ends[i], colours[i].alpha > 0, add_visit);
+  }
+#endif // RAYLIB_WITH_TBB
+}
+
+size_t DensityGrid::numBricks() const
+{
+  size_t count = 0;
+  for (auto &brick: bricks_)
+  {
+    if (brick)
+      count++;
+  }
+  return count;
+}
+
+namespace
+{
+// file tag and version, to reject files that are not density grids, or are from an incompatible version
+const char density_file_tag[8] = {'R', 'A', 'Y', 'D', 'N', 'S', 'T', 'Y'};
+const int32_t density_file_version = 2;
+// one bit per voxel in a brick, set for the non-empty voxels that are stored
+const int brick_mask_words = DensityGrid::brick_size / 64;
+
+template <class T>
+void writeValue(std::ofstream &ofs, const T &value)
+{
+  ofs.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+template <class T>
+bool readValue(std::ifstream &ifs, T &value)
+{
+  ifs.read(reinterpret_cast<char *>(&value), sizeof(T));
+  return ifs.good();
+}
+
+bool readDensityHeader(std::ifstream &ifs, Cuboid &bounds, double &voxel_width, Eigen::Vector3i &dims, 
+                       FileStamp &source)
+{
+  char tag[sizeof(density_file_tag)];
+  int32_t version;
+  ifs.read(tag, sizeof(tag));
+  if (!ifs.good() || std::memcmp(tag, density_file_tag, sizeof(tag)) != 0)
+  {
+    std::cerr << "Error: file is not a density grid" << std::endl;
+    return false;
+  }
+  if (!readValue(ifs, version) || version != density_file_version)
+  {
+    std::cerr << "Error: unsupported density grid file version" << std::endl;
+    return false;
+  }
+  int32_t d[3];
+  bool ok = true;
+  for (int i = 0; i < 3; i++)
+    ok = ok && readValue(ifs, bounds.min_bound_[i]);
+  for (int i = 0; i < 3; i++)
+    ok = ok && readValue(ifs, bounds.max_bound_[i]);
+  ok = ok && readValue(ifs, voxel_width) && readValue(ifs, d);
+  int64_t size, modified;
+  ok = ok && readValue(ifs, size) && readValue(ifs, modified) && readValue(ifs, source.content_hash);
+  source.size = static_cast<long long>(size);
+  source.modified = static_cast<long long>(modified);
+  if (!ok || !(voxel_width > 0.0) || d[0] <= 0 || d[1] <= 0 || d[2] <= 0)
+  {
+    std::cerr << "Error: corrupt density grid file header" << std::endl;
+    return false;
+  }
+  dims = Eigen::Vector3i(d[0], d[1], d[2]);
+  return true;
+}
+}
+
+bool DensityGrid::save(const std::string &file_name, const FileStamp &source) const
+{
+  std::ofstream ofs(file_name.c_str(), std::ios::binary | std::ios::out);
+  if (ofs.fail())
+  {
+    std::cerr << "Error: cannot open " << file_name << " for writing" << std::endl;
+    return false;
+  }
+  ofs.write(density_file_tag, sizeof(density_file_tag));
+  writeValue(ofs, density_file_version);
+  for (int i = 0; i < 3; i++)
+    writeValue(ofs, bounds_.min_bound_[i]);
+  for (int i = 0; i < 3; i++)
+    writeValue(ofs, bounds_.max_bound_[i]);
+  writeValue(ofs, voxel_width_);
+  const int32_t dims[3] = {voxel_dims_[0], voxel_dims_[1], voxel_dims_[2]};
+  writeValue(ofs, dims);
+  writeValue(ofs, static_cast<int64_t>(source.size));
+  writeValue(ofs, static_cast<int64_t>(source.modified));
+  writeValue(ofs, source.content_hash);
+  writeValue(ofs, static_cast<uint64_t>(numBricks()));
+
+  // each brick is its index, a bit mask of its non-empty voxels, then the values of just those voxels
+  std::vector<float> values;
+  values.reserve(3 * brick_size);
+  for (size_t i = 0; i < bricks_.size(); i++)
+  {
+    const Brick *brick = bricks_[i].get();
+    if (!brick)
+      continue;
+    uint64_t mask[brick_mask_words] = {};
+    values.clear();
+    for (int j = 0; j < brick_size; j++)
+    {
+      const Voxel &voxel = brick->voxels[j];
+      if (voxel.numRays() == 0.0f && voxel.numHits() == 0.0f && voxel.pathLength() == 0.0f)
+        continue;
+      mask[j / 64] |= uint64_t(1) << (j % 64);
+      values.push_back(voxel.numHits());
+      values.push_back(voxel.numRays());
+      values.push_back(voxel.pathLength());
+    }
+    writeValue(ofs, static_cast<int32_t>(i));
+    writeValue(ofs, mask);
+    ofs.write(reinterpret_cast<const char *>(values.data()), values.size() * sizeof(float));
+  }
+  if (!ofs.good())
+  {
+    std::cerr << "Error: failed writing density grid to " << file_name << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool DensityGrid::loadHeader(const std::string &file_name, Cuboid &bounds, double &voxel_width, Eigen::Vector3i &dims,
+                             FileStamp &source)
+{
+  std::ifstream ifs(file_name.c_str(), std::ios::binary | std::ios::in);
+  if (ifs.fail())
+    return false;
+  return readDensityHeader(ifs, bounds, voxel_width, dims, source);
+}
+
+std::unique_ptr<DensityGrid> DensityGrid::load(const std::string &file_name)
+{
+  std::ifstream ifs(file_name.c_str(), std::ios::binary | std::ios::in);
+  if (ifs.fail())
+  {
+    std::cerr << "Error: cannot open " << file_name << " for reading" << std::endl;
+    return nullptr;
+  }
+  Cuboid bounds(Eigen::Vector3d::Zero(), Eigen::Vector3d::Zero());
+  double voxel_width;
+  Eigen::Vector3i dims;
+  FileStamp source;
+  uint64_t num_bricks;
+  if (!readDensityHeader(ifs, bounds, voxel_width, dims, source) || !readValue(ifs, num_bricks))
+    return nullptr;
+  std::unique_ptr<DensityGrid> grid(new DensityGrid(bounds, voxel_width, dims));
+  if (num_bricks > grid->bricks_.size())
+  {
+    std::cerr << "Error: corrupt density grid file " << file_name << std::endl;
+    return nullptr;
+  }
+  std::vector<float> values(3 * brick_size);
+  for (uint64_t b = 0; b < num_bricks; b++)
+  {
+    int32_t index;
+    uint64_t mask[brick_mask_words];
+    if (!readValue(ifs, index) || !readValue(ifs, mask) || index < 0 || index >= (int)grid->bricks_.size() || 
+        grid->bricks_[index])
+    {
+      std::cerr << "Error: corrupt density grid file " << file_name << std::endl;
+      return nullptr;
+    }
+    int count = 0;
+    for (int j = 0; j < brick_size; j++)
+    {
+      if (mask[j / 64] & (uint64_t(1) << (j % 64)))
+        count++;
+    }
+    ifs.read(reinterpret_cast<char *>(values.data()), 3 * count * sizeof(float));
+    if (!ifs.good())
+    {
+      std::cerr << "Error: density grid file " << file_name << " is truncated" << std::endl;
+      return nullptr;
+    }
+    Brick *brick = new Brick;
+    grid->bricks_[index].reset(brick);
+    const float *value = values.data();
+    for (int j = 0; j < brick_size; j++)
+    {
+      if (!(mask[j / 64] & (uint64_t(1) << (j % 64))))
+        continue;
+      brick->voxels[j] = Voxel(value[0], value[1], value[2]);
+      value += 3;
+    }
+  }
+  return grid;
+}
+
+void DensityGrid::allocateNeighbourBricks()
+{
+  // find which of the 3x3x3 neighbouring bricks are adjacent to voxels with rays in them, as a bit mask per brick
+  std::vector<int> allocated;
+  for (size_t i = 0; i < bricks_.size(); i++)
+  {
+    if (bricks_[i])
+      allocated.push_back(static_cast<int>(i));
+  }
+  std::vector<uint32_t> adjacency(allocated.size(), 0);
+  const int last = brick_width - 1;
+  const auto find_adjacency = [&](size_t b)
+  {
+    const Brick &brick = *bricks_[allocated[b]];
+    uint32_t mask = 0;
+    for (int z = 0; z < brick_width; z++)
+    {
+      for (int y = 0; y < brick_width; y++)
+      {
+        for (int x = 0; x < brick_width; x++)
         {
-          voxels_[index].addMissRay(static_cast<float>(minL*voxel_width_)); 
+          if (brick.voxels[getIndexInBrick(Eigen::Vector3i(x, y, z))].numRays() == 0.0)
+            continue;
+          for (int i = x == 0 ? -1 : 0; i <= (x == last ? 1 : 0); i++)
+            for (int j = y == 0 ? -1 : 0; j <= (y == last ? 1 : 0); j++)
+              for (int k = z == 0 ? -1 : 0; k <= (z == last ? 1 : 0); k++)
+                mask |= 1u << ((i+1) + 3*(j+1) + 9*(k+1));
         }
-      } while (depth <= maxDist);
+      }
     }
+    adjacency[b] = mask;
   };
-  Cloud::read(file_name, calculate);
+#if RAYLIB_WITH_TBB
+  tbb::parallel_for<size_t>(0, allocated.size(), find_adjacency);
+#else  // RAYLIB_WITH_TBB
+  for (size_t b = 0; b < allocated.size(); b++)
+    find_adjacency(b);
+#endif // RAYLIB_WITH_TBB
+
+  for (size_t b = 0; b < allocated.size(); b++)
+  {
+    const int bx = allocated[b] % brick_dims_[0];
+    const int by = (allocated[b] / brick_dims_[0]) % brick_dims_[1];
+    const int bz = allocated[b] / (brick_dims_[0] * brick_dims_[1]);
+    for (int bit = 0; bit < 27; bit++)
+    {
+      const Eigen::Vector3i neighbour(bx + bit%3 - 1, by + (bit/3)%3 - 1, bz + bit/9 - 1);
+      if (!(adjacency[b] & (1u << bit)) || (neighbour.array() < 0).any() || 
+          (neighbour.array() >= brick_dims_.array()).any())
+        continue;
+      std::unique_ptr<Brick> &neighbour_brick = bricks_[getBrickIndex(neighbour)];
+      if (!neighbour_brick)
+        neighbour_brick.reset(new Brick);
+    }
+  }
+}
+
+namespace
+{
+/// The Moore neighbourhood offsets, in the order that they are accumulated: the 6 faces, 12 edges then 8 corners
+const int neighbour_offsets[26][3] = 
+{
+  {-1,0,0}, {1,0,0}, {0,-1,0}, {0,1,0}, {0,0,-1}, {0,0,1},
+  {-1,-1,0}, {-1,1,0}, {1,-1,0}, {1,1,0}, {-1,0,-1}, {-1,0,1}, {1,0,-1}, {1,0,1}, {0,-1,-1}, {0,-1,1}, {0,1,-1}, {0,1,1},
+  {-1,-1,-1}, {-1,-1,1}, {-1,1,-1}, {1,-1,-1}, {-1,1,1}, {1,-1,1}, {1,1,-1}, {1,1,1}
+};
+const int neighbour_ring_ends[3] = {6, 18, 26};
+
+/// One horizontal plane of voxels from each allocated brick in a z layer of bricks
+struct BrickPlanes
+{
+  std::vector<int> slots; // per brick in the layer, the index of its plane in voxels, or -1 if unallocated
+  std::vector<DensityGrid::Voxel> voxels;
+};
+
+/// Store the voxel plane at local height @c z in each allocated brick of layer @c bz
+void storePlanes(const DensityGrid &grid, int bz, int z, BrickPlanes &planes)
+{
+  const int layer_size = grid.brickDims()[0] * grid.brickDims()[1];
+  const int plane_size = DensityGrid::brick_width * DensityGrid::brick_width;
+  planes.slots.assign(layer_size, -1);
+  planes.voxels.clear();
+  for (int i = 0; i < layer_size; i++)
+  {
+    const DensityGrid::Brick *brick = grid.bricks()[i + bz * layer_size].get();
+    if (!brick)
+      continue;
+    planes.slots[i] = static_cast<int>(planes.voxels.size() / plane_size);
+    planes.voxels.insert(planes.voxels.end(), brick->voxels + z * plane_size, brick->voxels + (z + 1) * plane_size);
+  }
+}
 }
 
 // This is a form of windowed average over the Moore neighbourhood (3x3x3) window.
+// The grid is split into slabs of brick layers, which are processed in parallel. Each slab processes one layer 
+// of bricks at a time, gathering each brick's voxels, and the single voxel border around them, into a small halo 
+// buffer. The convolution reads only unmodified values, while just one layer of output bricks per slab, and the 
+// overwritten planes of voxels adjacent to each layer and slab boundary, are held in addition to the grid.
 void DensityGrid::addNeighbourPriors()
 {
+  allocateNeighbourBricks();
+
+  const int halo_width = brick_width + 2;
+  const int plane_size = brick_width * brick_width;
+  const int layer_size = brick_dims_[0] * brick_dims_[1];
   const int X = 1;
-  const int Y = voxel_dims_[0];
-  const int Z = voxel_dims_[0]*voxel_dims_[1];
-  DensityGrid::Voxel neighbours;
-  double num_hit_points = 0.0;
-  double num_hit_points_unsatisfied = 0.0;
+  const int Y = halo_width;
+  const int Z = halo_width * halo_width;
+  int offsets[26];
+  for (int i = 0; i < 26; i++)
+    offsets[i] = neighbour_offsets[i][0]*X + neighbour_offsets[i][1]*Y + neighbour_offsets[i][2]*Z;
+
+  const int layers_per_slab = 4;
+  const int num_slabs = (brick_dims_[2] + layers_per_slab - 1) / layers_per_slab;
+  // the voxel planes either side of each slab boundary, stored before any slab is modified
+  std::vector<BrickPlanes> slab_below(num_slabs), slab_above(num_slabs);
+  for (int s = 0; s < num_slabs; s++)
+  {
+    const int bz0 = s * layers_per_slab;
+    const int bz1 = std::min(bz0 + layers_per_slab, brick_dims_[2]);
+    if (bz0 > 0)
+      storePlanes(*this, bz0 - 1, brick_width - 1, slab_below[s]);
+    if (bz1 < brick_dims_[2])
+      storePlanes(*this, bz1, 0, slab_above[s]);
+  }
+  std::vector<double> num_hit_points(num_slabs, 0.0), num_hit_points_unsatisfied(num_slabs, 0.0);
 
-  // This simple 3x3x3 convolution needs to be a bit sneaky to avoid having to double the memory cost.
-  // well, not that sneaky, we just shift the output -1,-1,-1 for each cell
-  for (int x = 1; x<voxel_dims_[0]-1; x++)
+  const auto process_slab = [&](int s)
   {
-    for (int y = 1; y<voxel_dims_[1]-1; y++)
+    const int bz0 = s * layers_per_slab;
+    const int bz1 = std::min(bz0 + layers_per_slab, brick_dims_[2]);
+    std::vector<Voxel> halo(halo_width * halo_width * halo_width);
+    BrickPlanes below = std::move(slab_below[s]), next_below;
+    std::vector<int> layer_bricks;
+    std::vector<std::unique_ptr<Brick>> layer_outputs;
+    for (int bz = bz0; bz < bz1; bz++)
     {
-      for (int z = 1; z<voxel_dims_[2]-1; z++)
+      layer_bricks.clear();
+      for (int i = 0; i < layer_size; i++)
       {
-        const int ind = getIndex(Eigen::Vector3i(x,y,z));
-        if (voxels_[ind].numHits() > 0)
-          num_hit_points++;
-        float needed = DENSITY_MIN_RAYS - voxels_[ind].numRays();
-        const DensityGrid::Voxel corner_vox = voxels_[ind - X - Y - Z];
-        voxels_[ind - X - Y - Z] = voxels_[ind]; // move centre up to corner 
-        DensityGrid::Voxel &voxel = voxels_[ind - X - Y - Z]; 
-        if (needed < 0.0)
-          continue;
-        neighbours  = voxels_[ind-X];
-        neighbours += voxels_[ind+X];
-        neighbours += voxels_[ind-Y];
-        neighbours += voxels_[ind+Y];
-        neighbours += voxels_[ind-Z];
-        neighbours += voxels_[ind+Z];
-        if (neighbours.numRays() >= needed)
-        {
-          voxel += neighbours * (needed/neighbours.numRays()); // add minimal amount to reach DENSITY_MIN_RAYS
-          continue;
-        }
-        voxel += neighbours;
-        needed -= neighbours.numRays();
-
-        neighbours  = voxels_[ind-X-Y];
-        neighbours += voxels_[ind-X+Y];
-        neighbours += voxels_[ind+X-Y];
-        neighbours += voxels_[ind+X+Y];
-
-        neighbours += voxels_[ind-X-Z];
-        neighbours += voxels_[ind-X+Z];
-        neighbours += voxels_[ind+X-Z];
-        neighbours += voxels_[ind+X+Z];
-
-        neighbours += voxels_[ind-Y-Z];
-        neighbours += voxels_[ind-Y+Z];
-        neighbours += voxels_[ind+Y-Z];
-        neighbours += voxels_[ind+Y+Z];
-        if (neighbours.numRays() >= needed)
+        if (bricks_[i + bz * layer_size])
+          layer_bricks.push_back(i);
+      }
+      layer_outputs.resize(layer_bricks.size());
+      for (size_t b = 0; b < layer_bricks.size(); b++)
+      {
+        const int bx = layer_bricks[b] % brick_dims_[0];
+        const int by = layer_bricks[b] / brick_dims_[0];
+        // gather the brick and its neighbouring voxels into the halo buffer
+        std::fill(halo.begin(), halo.end(), Voxel());
+        for (int k = -1; k <= 1; k++)
         {
-          voxel += neighbours * (needed/neighbours.numRays()); // add minimal amount to reach DENSITY_MIN_RAYS
-          continue;
+          const int z0 = k == -1 ? brick_width - 1 : 0;
+          const int z1 = k == 1 ? 0 : brick_width - 1;
+          const int hz = k == -1 ? 0 : (k == 0 ? 1 : brick_width + 1);
+          if (bz + k < 0 || bz + k >= brick_dims_[2])
+            continue;
+          for (int j = -1; j <= 1; j++)
+          {
+            const int y0 = j == -1 ? brick_width - 1 : 0;
+            const int y1 = j == 1 ? 0 : brick_width - 1;
+            const int hy = j == -1 ? 0 : (j == 0 ? 1 : brick_width + 1);
+            if (by + j < 0 || by + j >= brick_dims_[1])
+              continue;
+            for (int i = -1; i <= 1; i++)
+            {
+              const int x0 = i == -1 ? brick_width - 1 : 0;
+              const int x1 = i == 1 ? 0 : brick_width - 1;
+              const int hx = i == -1 ? 0 : (i == 0 ? 1 : brick_width + 1);
+              if (bx + i < 0 || bx + i >= brick_dims_[0])
+                continue;
+              const int plane_index = (bx + i) + (by + j) * brick_dims_[0];
+              // the layers below, and the layer above the slab, may already be overwritten so read from stored planes
+              const BrickPlanes *planes = k == -1 ? &below : (k == 1 && bz + 1 == bz1 ? &slab_above[s] : nullptr);
+              const Voxel *source = nullptr;
+              int source_z0 = 0;
+              if (planes)
+              {
+                if (planes->slots[plane_index] >= 0)
+                  source = &planes->voxels[planes->slots[plane_index] * plane_size];
+                source_z0 = z0;
+              }
+              else if (const Brick *brick = bricks_[getBrickIndex(Eigen::Vector3i(bx + i, by + j, bz + k))].get())
+                source = brick->voxels;
+              if (!source)
+                continue;
+              for (int z = z0; z <= z1; z++)
+                for (int y = y0; y <= y1; y++)
+                  for (int x = x0; x <= x1; x++)
+                    halo[(hx + x - x0) + (hy + y - y0) * Y + (hz + z - z0) * Z] = 
+                      source[x + y * brick_width + (z - source_z0) * plane_size];
+            }
+          }
         }
-        voxel += neighbours;
-        needed -= neighbours.numRays();
-
-        neighbours  = corner_vox;          
-        neighbours += voxels_[ind-X-Y+Z];          
-        neighbours += voxels_[ind-X+Y-Z];          
-        neighbours += voxels_[ind+X-Y-Z];          
-        neighbours += voxels_[ind-X+Y+Z];          
-        neighbours += voxels_[ind+X-Y+Z];          
-        neighbours += voxels_[ind+X+Y-Z];          
-        neighbours += voxels_[ind+X+Y+Z];     
-        if (neighbours.numRays() >= needed)
+
+        layer_outputs[b].reset(new Brick);
+        Voxel *output = layer_outputs[b]->voxels;
+        for (int z = 0; z < brick_width; z++)
         {
-          voxel += neighbours * (needed/neighbours.numRays()); // add minimal amount to reach DENSITY_MIN_RAYS
-          continue;
+          for (int y = 0; y < brick_width; y++)
+          {
+            for (int x = 0; x < brick_width; x++)
+            {
+              const int ind = (x + 1) * X + (y + 1) * Y + (z + 1) * Z;
+              const Voxel &centre = halo[ind];
+              Voxel &voxel = output[x + y * brick_width + z * plane_size];
+              voxel = centre;
+              if (centre.numHits() > 0)
+                num_hit_points[s]++;
+              float needed = DENSITY_MIN_RAYS - centre.numRays();
+              if (needed < 0.0)
+                continue;
+              bool satisfied = false;
+              for (int ring = 0, n = 0; ring < 3 && !satisfied; ring++)
+              {
+                Voxel neighbours;
+                for (; n < neighbour_ring_ends[ring]; n++)
+                  neighbours += halo[ind + offsets[n]];
+                if (neighbours.numRays() >= needed)
+                {
+                  voxel += neighbours * (needed/neighbours.numRays()); // add minimal amount to reach DENSITY_MIN_RAYS
+                  satisfied = true;
+                }
+                else
+                {
+                  voxel += neighbours;
+                  needed -= neighbours.numRays();
+                }
+              }
+              if (!satisfied && centre.numHits() > 0)
+                num_hit_points_unsatisfied[s]++;
+            }
+          }
         }
-        voxel += neighbours;    
-        if (voxels_[ind].numHits() > 0)
-          num_hit_points_unsatisfied++;
       }
+
+      // store the unmodified top planes of this layer, for the next layer up, then replace the layer with its output
+      if (bz + 1 < bz1)
+      {
+        storePlanes(*this, bz, brick_width - 1, next_below);
+        std::swap(below, next_below);
+      }
+      for (size_t b = 0; b < layer_bricks.size(); b++)
+        bricks_[layer_bricks[b] + bz * layer_size] = std::move(layer_outputs[b]);
     }
+  };
+#if RAYLIB_WITH_TBB
+  tbb::parallel_for(0, num_slabs, process_slab);
+#else  // RAYLIB_WITH_TBB
+  for (int s = 0; s < num_slabs; s++)
+    process_slab(s);
+#endif // RAYLIB_WITH_TBB
+
+  double total_hit_points = 0.0, total_hit_points_unsatisfied = 0.0;
+  for (int s = 0; s < num_slabs; s++)
+  {
+    total_hit_points += num_hit_points[s];
+    total_hit_points_unsatisfied += num_hit_points_unsatisfied[s];
   }
-  const double percentage = 100.0*num_hit_points_unsatisfied/num_hit_points;
+  const double percentage = 100.0*total_hit_points_unsatisfied/total_hit_points;
   std::cout << "Density calculation: " << percentage << "% of voxels had insufficient (<" 
     << DENSITY_MIN_RAYS << ") rays within them" << std::endl;
   if (percentage > 50.0)
@@ -181,251 +675,1027 @@ void DensityGrid::addNeighbourPriors()
   }
 }
 
-bool renderCloud(const std::string &cloud_file, const Cuboid &bounds, ViewDirection view_direction, 
-                 RenderStyle style, double pix_width, const std::string &image_file)                 
-{
-  // convert the view direction into useable parameters
-  int axis = 0;
-  if (view_direction == ViewDirection::Top)
-    axis = 2;
-  else if (view_direction == ViewDirection::Front || view_direction == ViewDirection::Back)
-    axis = 1;
-  double dir = 1;
-  if (view_direction == ViewDirection::Left || view_direction == ViewDirection::Front)
-    dir = -1;
-  const bool flip_x = view_direction == ViewDirection::Left || view_direction == ViewDirection::Back;
-  
-  // pull out the main image axes (ax1,ax2 are the horiz,vertical axes)
-  const Eigen::Vector3d extent = bounds.max_bound_ - bounds.min_bound_;
-  // for each view axis (side,top,front = 0,1,2) we need to have an image x axis, and y axis.
-  // e.g. x_axes[axis] is the 3D axis to use (x,y,z = 0,1,2) for the image horizontal direction
-  const std::array<int, 3> x_axes = {1, 0, 0};
-  const std::array<int, 3> y_axes = {2, 2, 1};
-  const int ax1 = x_axes[axis];
-  const int ax2 = y_axes[axis];
-  const int width  = 1 + static_cast<int>(extent[ax1] / pix_width);
-  const int height = 1 + static_cast<int>(extent[ax2] / pix_width);
-  const int depth  = 1 + static_cast<int>(extent[axis] / pix_width);
-  std::cout << "outputting " << width << "x" << height << " image" << std::endl;
+namespace
+{
+/// An image of accumulated pixel values, stored as square tiles which are only allocated once they are written to.
+/// Pixels are addressed in render coordinates (which may be mirrored horizontally, and have y up) but stored in 
+/// output image coordinates, so that each tile can be encoded as it is.
+class PixelTiles
+{
+public:
+  PixelTiles() : width_(0), height_(0), tile_size_(1), tiles_x_(0), tiles_y_(0), flip_x_(false), band_begin_(0), 
+    band_end_(0) {}
+  PixelTiles(int width, int height, int tile_size, bool flip_x) : 
+    width_(width), height_(height), tile_size_(tile_size), flip_x_(flip_x)
+  {
+    tiles_x_ = (width + tile_size - 1) / tile_size;
+    tiles_y_ = (height + tile_size - 1) / tile_size;
+    tiles_.resize(tiles_x_ * tiles_y_);
+    setBand(0, tiles_y_);
+  }
+  /// Render only the output tile rows from @c begin_row up to @c end_row. Pixels outside the band are not drawn
+  inline void setBand(int begin_row, int end_row) 
+  { 
+    band_begin_ = begin_row; 
+    band_end_ = end_row; 
+  }
+  /// Whether the tile of index @c tile_index is within the band being rendered
+  inline bool inBand(int tile_index) const 
+  { 
+    return tile_index >= band_begin_ * tiles_x_ && tile_index < band_end_ * tiles_x_; 
+  }
+  /// Free all of the tiles
+  void clear()
+  {
+    for (auto &tile: tiles_)
+      std::vector<Eigen::Vector4f>().swap(tile);
+  }
+  /// The accumulated value at render coordinates @c x, @c y, allocating its tile if necessary
+  inline Eigen::Vector4f &pixel(int x, int y)
+  {
+    return outputPixel(flip_x_ ? width_ - 1 - x : x, height_ - 1 - y);
+  }
+  /// The accumulated value at output image coordinates @c out_x, @c out_y, allocating its tile if necessary
+  inline Eigen::Vector4f &outputPixel(int out_x, int out_y)
+  {
+    std::vector<Eigen::Vector4f> &tile = tiles_[out_x / tile_size_ + tiles_x_ * (out_y / tile_size_)];
+    if (tile.empty())
+      tile.resize(tile_size_ * tile_size_, Eigen::Vector4f(0, 0, 0, 0));
+    return tile[(out_x % tile_size_) + tile_size_ * (out_y % tile_size_)];
+  }
+  /// The index of the tile containing render coordinates @c x, @c y
+  inline int tileIndex(int x, int y) const { return tileX(x) + tiles_x_ * tileY(y); }
+  /// The output tile column containing render coordinate @c x, and the output tile row containing @c y
+  inline int tileX(int x) const { return (flip_x_ ? width_ - 1 - x : x) / tile_size_; }
+  inline int tileY(int y) const { return (height_ - 1 - y) / tile_size_; }
+  /// The largest render coordinate in the same tile column as @c x, and in the same tile row as @c y
+  inline int tileEndX(int x) const { return flip_x_ ? width_ - 1 - tileX(x) * tile_size_ : (tileX(x) + 1) * tile_size_ - 1; }
+  inline int tileEndY(int y) const { return height_ - 1 - tileY(y) * tile_size_; }
+  /// The tile at output tile coordinates @c tx, @c ty. It is empty if no pixels have been written to it
+  inline const std::vector<Eigen::Vector4f> &tile(int tx, int ty) const { return tiles_[tx + tiles_x_ * ty]; }
+  /// The width and height of the tile at output tile coordinates @c tx, @c ty, these are smaller on the far edges
+  inline int tileWidth(int tx) const { return std::min(tile_size_, width_ - tx * tile_size_); }
+  inline int tileHeight(int ty) const { return std::min(tile_size_, height_ - ty * tile_size_); }
+  inline int tilesX() const { return tiles_x_; }
+  inline int tilesY() const { return tiles_y_; }
+  inline int tileSize() const { return tile_size_; }
+  inline int width() const { return width_; }
+  inline int height() const { return height_; }
+  inline int bandBegin() const { return band_begin_; }
+  inline int bandEnd() const { return band_end_; }
 
-  try // there is a possibility of running out of memory here. So provide a helpful message rather than just asserting
+private:
+  int width_, height_, tile_size_;
+  int tiles_x_, tiles_y_;
+  bool flip_x_;
+  int band_begin_, band_end_;
+  std::vector<std::vector<Eigen::Vector4f>> tiles_;
+};
+
+/// Write an image buffer in the format given by @c image_ext. @c float_pixels is used for hdr images, 
+/// and @c pixels otherwise. Rows are written from top to bottom.
+bool writeImage(const std::string &image_file, const std::string &image_ext, int width, int height,
+                const std::vector<RGBA> &pixels, const std::vector<float> &float_pixels)
+{
+  const char *image_name = image_file.c_str();
+  if (image_ext == "png")
+    return stbi_write_png(image_name, width, height, 4, (void *)&pixels[0], 4 * width) != 0;
+  else if (image_ext == "bmp")
+    return stbi_write_bmp(image_name, width, height, 4, (void *)&pixels[0]) != 0;
+  else if (image_ext == "tga")
+    return stbi_write_tga(image_name, width, height, 4, (void *)&pixels[0]) != 0;
+  else if (image_ext == "jpg")
+    return stbi_write_jpg(image_name, width, height, 4, (void *)&pixels[0], 100) != 0; // 100 is maximal quality
+  else if (image_ext == "hdr")
+    return stbi_write_hdr(image_name, width, height, 3, &float_pixels[0]) != 0;
+  return false;
+}
+
+/// Running statistics of the display values of the rendered pixels, used to choose the range of values to shade
+struct PixelStatistics
+{
+  double sum = 0.0;
+  double sum_sqr = 0.0;
+  double num = 0.0;
+  /// limited range, so work out a sensible maximum value, I'm using mean + two standard deviations:
+  double maximumValue() const
+  {
+    const double mean = sum / num;
+    return mean + 2.0*std::sqrt(std::max(0.0, sum_sqr / num - mean*mean));
+  }
+};
+
+inline bool isDensityStyle(RenderStyle style)
+{
+  return style == RenderStyle::Density || style == RenderStyle::Density_rgb;
+}
+
+/// The axes and accumulated pixels of one view being rendered. Large tiled images are rendered in bands of tile rows,
+/// the pixels holding only the band being rendered
+struct ViewImage
+{
+  ViewImage(const RenderView &render_view, const Eigen::Vector3d &extent, double pix_width, int tile_size, 
+            const RenderConfig &config) : 
+    view(render_view), 
+    axis(render_view.direction == ViewDirection::Top ? 2 : 
+      (render_view.direction == ViewDirection::Front || render_view.direction == ViewDirection::Back ? 1 : 0)),
+    // for each view axis (side,top,front = 0,1,2) we need to have an image x axis, and y axis.
+    ax1(axis == 0 ? 1 : 0), 
+    ax2(axis == 2 ? 1 : 2),
+    dir(render_view.direction == ViewDirection::Left || render_view.direction == ViewDirection::Front ? -1 : 1),
+    flip_x(render_view.direction == ViewDirection::Left || render_view.direction == ViewDirection::Back),
+    width(1 + static_cast<int>(extent[ax1] / pix_width)),
+    height(1 + static_cast<int>(extent[ax2] / pix_width)),
+    depth(1 + static_cast<int>(extent[axis] / pix_width)),
+    pixels(width, height, tile_size, flip_x),
+    step(0)
+  {
+    // a single image must be accumulated whole
+    const bool tiled = config.tile_size > 0 || config.pyramid;
+    const size_t row_pixels = static_cast<size_t>(width) * tile_size;
+    rows_per_band = tiled ? static_cast<int>(std::max(config.max_band_pixels / row_pixels, size_t(1))) : pixels.tilesY();
+    rows_per_band = std::min(rows_per_band, pixels.tilesY());
+    num_bands = (pixels.tilesY() + rows_per_band - 1) / rows_per_band;
+    const std::string image_ext = getFileNameExtension(view.image_file);
+    needs_statistics = image_ext != "hdr" && 
+      (view.style == RenderStyle::Sum || view.style == RenderStyle::Density || view.style == RenderStyle::Density_rgb);
+    num_steps = num_bands > 1 && needs_statistics ? 2 * num_bands : num_bands;
+    num_written = 0;
+    setBand();
+  }
+  /// Set the pixels to the band of the current step
+  void setBand()
+  {
+    const int band = step % num_bands;
+    pixels.setBand(band * rows_per_band, std::min((band + 1) * rows_per_band, pixels.tilesY()));
+  }
+  /// Whether the current step only gathers statistics, before a second sweep over the bands writes them
+  bool statisticsStep() const { return step < num_steps - num_bands; }
+  bool finished() const { return step >= num_steps; }
+
+  RenderView view;
+  int axis; // the 3D axis (x,y,z = 0,1,2) that the view is along
+  int ax1, ax2; // the 3D axes for the image horizontal and vertical directions
+  double dir;
+  bool flip_x;
+  int width, height, depth;
+  PixelTiles pixels;
+  int rows_per_band;      // tile rows rendered at a time
+  int num_bands;
+  bool needs_statistics;  // whether the shading is relative to statistics of the whole image
+  int num_steps;          // the number of bands to render, including any sweep for the statistics
+  int step;               // the current step
+  PixelStatistics statistics;
+  PixelTiles coarse_pixels;  // the half resolution level of a pyramid, accumulated as each band is written
+  std::ofstream index;       // lists the tiles written, with their bounds
+  int num_written;           // the number of full resolution tiles written
+};
+
+/// Accumulate a chunk of end (or start) points into the image. The points are projected in bulk, then binned by
+/// image tile, keeping their order within each tile. The tiles are then accumulated in parallel, giving the same 
+/// result as a serial accumulation
+void splatPoints(ViewImage &image, const Cuboid &bounds, double pix_width, const std::vector<Eigen::Vector3d> &points, 
+                 const std::vector<RGBA> &colours)
+{
+  const RenderStyle style = image.view.style;
+  const int axis = image.axis, ax1 = image.ax1, ax2 = image.ax2;
+  const int width = image.width, height = image.height;
+  PixelTiles &pixels = image.pixels;
+  const int num_points = static_cast<int>(points.size());
+  if (num_points == 0)
+    return;
+  const Eigen::Map<const Eigen::Matrix3Xd> cloud_points(points[0].data(), 3, num_points);
+  Eigen::Matrix3Xd positions(3, num_points);
+  std::vector<int> tile_ids(num_points);
+
+  // project the points in blocks, which Eigen vectorises, and find which tile each one lands in
+  const int block_size = 4096;
+  auto project = [&](int block)
   {
-    // accumulated colour buffer
-    std::vector<Eigen::Vector4d> pixels(width * height); 
-    std::fill(pixels.begin(), pixels.end(), Eigen::Vector4d(0,0,0,0));
-    // density calculation is a special case
-    if (style == RenderStyle::Density || style == RenderStyle::Density_rgb) 
+    const int first = block * block_size;
+    const int count = std::min(block_size, num_points - first);
+    positions.middleCols(first, count) = (cloud_points.middleCols(first, count).colwise() - bounds.min_bound_) / pix_width;
+    for (int i = first; i < first + count; i++)
     {
-      Eigen::Vector3i dims = (extent/pix_width).cast<int>() + Eigen::Vector3i(1,1,1);
-      #if DENSITY_MIN_RAYS > 0
-      dims += Eigen::Vector3i(1,1,1); // so that we have extra space to convolve
-      #endif
-      Cuboid grid_bounds = bounds;
-      grid_bounds.min_bound_ -= Eigen::Vector3d(pix_width, pix_width, pix_width);
-      DensityGrid grid(grid_bounds, pix_width, dims);
+      const int x = static_cast<int>(positions(ax1, i)), y = static_cast<int>(positions(ax2, i));
+      // start points can lie outside the image bounds, which only cover the end points
+      if (colours[i].alpha == 0 || x < 0 || x >= width || y < 0 || y >= height)
+        tile_ids[i] = -1;
+      else
+        tile_ids[i] = pixels.inBand(pixels.tileIndex(x, y)) ? pixels.tileIndex(x, y) : -1;
+    }
+  };
+  const int num_blocks = (num_points + block_size - 1) / block_size;
+#if RAYLIB_WITH_TBB
+  tbb::parallel_for(0, num_blocks, project);
+#else  // RAYLIB_WITH_TBB
+  for (int b = 0; b < num_blocks; b++) 
+    project(b);
+#endif // RAYLIB_WITH_TBB
+
+  // counting sort the points by tile. This is stable, so each pixel accumulates its points in cloud order
+  const int num_tiles = pixels.tilesX() * pixels.tilesY();
+  std::vector<int> tile_starts(num_tiles + 1, 0);
+  for (auto &id: tile_ids)
+  {
+    if (id >= 0)
+      tile_starts[id + 1]++;
+  }
+  std::vector<int> occupied_tiles;
+  for (int t = 0; t < num_tiles; t++)
+  {
+    if (tile_starts[t + 1] > 0)
+      occupied_tiles.push_back(t);
+    tile_starts[t + 1] += tile_starts[t];
+  }
+  std::vector<int> ordered_points(tile_starts[num_tiles]);
+  {
+    std::vector<int> tile_ends(tile_starts.begin(), tile_starts.end() - 1);
+    for (int i = 0; i < num_points; i++)
+    {
+      if (tile_ids[i] >= 0)
+        ordered_points[tile_ends[tile_ids[i]]++] = i;
+    }
+  }
 
-      grid.calculateDensities(cloud_file);
+  // each tile is only written to by one task
+  auto splat_tile = [&](int occupied_tile)
+  {
+    const int tile = occupied_tiles[occupied_tile];
+    for (int j = tile_starts[tile]; j < tile_starts[tile + 1]; j++)
+    {
+      const int i = ordered_points[j];
+      const RGBA &colour = colours[i];
+      const Eigen::Vector3f col = Eigen::Vector3f(colour.red, colour.green, colour.blue)/255.0f;
+      // using 4 dimensions helps us to accumulate colours in a greater variety of ways
+      Eigen::Vector4f &pix = pixels.pixel(static_cast<int>(positions(ax1, i)), static_cast<int>(positions(ax2, i)));
+      if (style == RenderStyle::Ends || style == RenderStyle::Starts)
+      {
+        const double depth = positions(axis, i);
+        // TODO: fix the == 0.0 part in future, it can cause incorrect occlusion on points with z=0 precisely
+        if (depth*image.dir > pix[3]*image.dir || pix[3] == 0.0) 
+          pix = Eigen::Vector4f(col[0], col[1], col[2], static_cast<float>(depth));
+      }
+      else // Mean and Sum
+        pix += Eigen::Vector4f(col[0], col[1], col[2], 1.0);
+    }
+  };
+#if RAYLIB_WITH_TBB
+  tbb::parallel_for(0, static_cast<int>(occupied_tiles.size()), splat_tile);
+#else  // RAYLIB_WITH_TBB
+  for (int t = 0; t < static_cast<int>(occupied_tiles.size()); t++) 
+    splat_tile(t);
+#endif // RAYLIB_WITH_TBB
+}
 
-      #if DENSITY_MIN_RAYS > 0
-      grid.addNeighbourPriors();
-      #endif
+/// A ray projected into the image, as a 2D line that steps one pixel at a time along its longer image axis
+struct ImageLine
+{
+  bool x_long;     // whether the long axis is the image x axis
+  int start_long;  // the first and last pixel on the long axis, start_long > end_long for nothing to draw
+  int end_long;
+  double start_height; // the short axis coordinate at the middle of the start_long pixel
+  double gradient;     // change in short axis coordinate per pixel along the long axis
+  /// The pixel on the short axis at @c l on the long axis. This is evaluated directly rather than incrementally
+  /// so that a line can be drawn from any point along it, with the same result
+  inline int shortPixel(int l) const { return static_cast<int>(start_height + static_cast<double>(l - start_long) * gradient); }
+};
+
+/// Project the ray into the image, clipping it to the image bounds
+ImageLine projectRay(const ViewImage &image, const Cuboid &bounds, double pix_width, const Eigen::Vector3d &ray_start, 
+                     const Eigen::Vector3d &ray_end)
+{
+  const int ax1 = image.ax1, ax2 = image.ax2;
+  Eigen::Vector3d cloud_start = ray_start;
+  Eigen::Vector3d cloud_end = ray_end;
+  // clip to within the image (since we exclude unbounded rays from the image bounds)
+  bounds.clipRay(cloud_start, cloud_end); 
+  Eigen::Vector3d start = (cloud_start - bounds.min_bound_) / pix_width;
+  Eigen::Vector3d end = (cloud_end - bounds.min_bound_) / pix_width;
+  const Eigen::Vector3d dir = cloud_end - cloud_start;
+
+  // fast approximate 2D line rendering requires picking the long axis to iterate along
+  ImageLine line;
+  line.x_long = std::abs(dir[ax1]) > std::abs(dir[ax2]);
+  const int axis_long   = line.x_long ? ax1 : ax2;
+  const int axis_short  = line.x_long ? ax2 : ax1;
+
+  // a ray along the view axis is drawn as a single pixel
+  line.gradient = dir[axis_long] == 0.0 ? 0.0 : dir[axis_short] / dir[axis_long]; 
+  if (dir[axis_long] < 0.0)
+    std::swap(start, end); // this lets us iterate from low up to high values
+  line.start_long = static_cast<int>(start[axis_long]);
+  line.end_long = static_cast<int>(end[axis_long]);
+  // place a pixel at the height of each midpoint (of the pixel) in the long axis
+  const double start_mid_point = 0.5 + static_cast<double>(line.start_long);
+  line.start_height = start[axis_short] + (start_mid_point - start[axis_long])*line.gradient;
 
-      for (int x = 0; x < width; x++)
+  // only the pixels within the image can be drawn
+  const int long_size = line.x_long ? image.width : image.height;
+  const int first = std::max(line.start_long, 0);
+  const int last = std::min(line.end_long, long_size - 1);
+  if (first > last)
+  {
+    line.start_long = 1;
+    line.end_long = 0;
+  }
+  else
+  {
+    line.start_height += static_cast<double>(first - line.start_long) * line.gradient;
+    line.start_long = first;
+    line.end_long = last;
+  }
+  return line;
+}
+
+/// Call @c func(tile, first_long, last_long) for each image tile in the band being rendered that the line passes 
+/// through, with the range of the line's long axis pixels that may lie within that tile
+template <class T>
+void forEachLineTile(const ViewImage &image, const ImageLine &line, T func)
+{
+  const PixelTiles &pixels = image.pixels;
+  const int short_size = line.x_long ? image.height : image.width;
+  int l0 = line.start_long;
+  while (l0 <= line.end_long)
+  {
+    // the line section within one column (or row) of tiles
+    const int l1 = std::min(line.end_long, line.x_long ? pixels.tileEndX(l0) : pixels.tileEndY(l0));
+    const int s0 = line.shortPixel(l0), s1 = line.shortPixel(l1);
+    const int s_min = std::max(std::min(s0, s1), 0);
+    const int s_max = std::min(std::max(s0, s1), short_size - 1);
+    if (s_min <= s_max)
+    {
+      if (line.x_long)
+      {
+        const int tx = pixels.tileX(l0);
+        const int ty0 = std::max(pixels.tileY(s_max), pixels.bandBegin());
+        const int ty1 = std::min(pixels.tileY(s_min), pixels.bandEnd() - 1);
+        for (int ty = ty0; ty <= ty1; ty++)
+          func(tx + pixels.tilesX() * ty, l0, l1);
+      }
+      else
       {
-        for (int y = 0; y < height; y++)
+        const int ty = pixels.tileY(l0);
+        if (ty < pixels.bandBegin() || ty >= pixels.bandEnd())
         {
-          double total_density = 0.0;
-          for (int z = 0; z< depth; z++)
+          l0 = l1 + 1;
+          continue;
+        }
+        const int tx0 = std::min(pixels.tileX(s_min), pixels.tileX(s_max));
+        const int tx1 = std::max(pixels.tileX(s_min), pixels.tileX(s_max));
+        for (int tx = tx0; tx <= tx1; tx++)
+          func(tx + pixels.tilesX() * ty, l0, l1);
+      }
+    }
+    l0 = l1 + 1;
+  }
+}
+
+/// Draw a chunk of rays into the image as 2D lines, accumulating their colours. The lines are binned by the 
+/// image tiles they pass through, keeping the ray order within each tile. The tiles are then drawn in parallel, 
+/// so no two threads write to the same pixel, and the result does not depend on the number of threads
+void drawRays(ViewImage &image, const Cuboid &bounds, double pix_width, const std::vector<Eigen::Vector3d> &starts, 
+              const std::vector<Eigen::Vector3d> &ends, const std::vector<RGBA> &colours)
+{
+  PixelTiles &pixels = image.pixels;
+  const int num_rays = static_cast<int>(ends.size());
+  std::vector<ImageLine> lines(num_rays);
+  // number of tile sections per ray, then converted to each ray's first entry in the sections list
+  std::vector<int> ray_sections(num_rays + 1, 0); 
+
+  // project the rays and count their sections, in blocks
+  const int block_size = 1024;
+  const int num_blocks = (num_rays + block_size - 1) / block_size;
+  auto project = [&](int block)
+  {
+    for (int i = block * block_size; i < std::min(num_rays, (block + 1) * block_size); i++)
+    {
+      lines[i] = projectRay(image, bounds, pix_width, starts[i], ends[i]);
+      if (colours[i].alpha == 0)
+      {
+        lines[i].start_long = 1;
+        lines[i].end_long = 0;
+      }
+      int count = 0;
+      forEachLineTile(image, lines[i], [&](int, int, int) { count++; });
+      ray_sections[i + 1] = count;
+    }
+  };
+#if RAYLIB_WITH_TBB
+  tbb::parallel_for(0, num_blocks, project);
+#else  // RAYLIB_WITH_TBB
+  for (int b = 0; b < num_blocks; b++) 
+    project(b);
+#endif // RAYLIB_WITH_TBB
+  for (int i = 0; i < num_rays; i++) 
+    ray_sections[i + 1] += ray_sections[i];
+
+  // list the sections of each ray, in ray order
+  struct Section
+  {
+    int ray, tile, first_long, last_long;
+  };
+  std::vector<Section> sections(ray_sections[num_rays]);
+  auto list_sections = [&](int block)
+  {
+    for (int i = block * block_size; i < std::min(num_rays, (block + 1) * block_size); i++)
+    {
+      int j = ray_sections[i];
+      forEachLineTile(image, lines[i], [&](int tile, int first_long, int last_long) 
+      { 
+        sections[j++] = Section{i, tile, first_long, last_long}; 
+      });
+    }
+  };
+#if RAYLIB_WITH_TBB
+  tbb::parallel_for(0, num_blocks, list_sections);
+#else  // RAYLIB_WITH_TBB
+  for (int b = 0; b < num_blocks; b++) 
+    list_sections(b);
+#endif // RAYLIB_WITH_TBB
+
+  // counting sort the sections by tile. This is stable, so each pixel accumulates its rays in cloud order
+  const int num_tiles = pixels.tilesX() * pixels.tilesY();
+  std::vector<int> tile_starts(num_tiles + 1, 0);
+  for (auto &section: sections) 
+    tile_starts[section.tile + 1]++;
+  std::vector<int> occupied_tiles;
+  for (int t = 0; t < num_tiles; t++)
+  {
+    if (tile_starts[t + 1] > 0)
+      occupied_tiles.push_back(t);
+    tile_starts[t + 1] += tile_starts[t];
+  }
+  std::vector<int> ordered_sections(sections.size());
+  {
+    std::vector<int> tile_ends(tile_starts.begin(), tile_starts.end() - 1);
+    for (size_t i = 0; i < sections.size(); i++) 
+      ordered_sections[tile_ends[sections[i].tile]++] = static_cast<int>(i);
+  }
+
+  auto draw_tile = [&](int occupied_tile)
+  {
+    const int tile = occupied_tiles[occupied_tile];
+    for (int j = tile_starts[tile]; j < tile_starts[tile + 1]; j++)
+    {
+      const Section &section = sections[ordered_sections[j]];
+      const ImageLine &line = lines[section.ray];
+      const RGBA &colour = colours[section.ray];
+      const Eigen::Vector4f col(colour.red / 255.0f, colour.green / 255.0f, colour.blue / 255.0f, 1.0f);
+      for (int l = section.first_long; l <= section.last_long; l++)
+      {
+        const int s = line.shortPixel(l);
+        const int px = line.x_long ? l : s, py = line.x_long ? s : l;
+        if (px >= 0 && px < image.width && py >= 0 && py < image.height && pixels.tileIndex(px, py) == tile)
+          pixels.pixel(px, py) += col;
+      }
+    }
+  };
+#if RAYLIB_WITH_TBB
+  tbb::parallel_for(0, static_cast<int>(occupied_tiles.size()), draw_tile);
+#else  // RAYLIB_WITH_TBB
+  for (int t = 0; t < static_cast<int>(occupied_tiles.size()); t++) 
+    draw_tile(t);
+#endif // RAYLIB_WITH_TBB
+}
+
+/// Accumulate a chunk of rays into the image, for all styles except the density styles
+void splatRays(ViewImage &image, const Cuboid &bounds, double pix_width, const std::vector<Eigen::Vector3d> &starts, 
+               const std::vector<Eigen::Vector3d> &ends, const std::vector<RGBA> &colours)
+{
+  if (image.view.style == RenderStyle::Rays)
+    drawRays(image, bounds, pix_width, starts, ends, colours);
+  else
+    splatPoints(image, bounds, pix_width, image.view.style == RenderStyle::Starts ? starts : ends, colours);
+}
+
+/// Sum the densities along the view axis into the band being rendered, iterating only over the allocated bricks. 
+/// Visiting the bricks in index order, and their voxels in x, y, z order, sums each pixel in increasing view axis order.
+/// The fourth component is 1 for columns that any ray has passed through, and 0 for unobserved columns
+void projectDensities(ViewImage &image, const DensityGrid &grid)
+{
+  Eigen::Vector3i image_max;
+  image_max[image.axis] = image.depth;
+  image_max[image.ax1] = image.width;
+  image_max[image.ax2] = image.height;
+  const Eigen::Vector3i &brick_dims = grid.brickDims();
+  const int bw = DensityGrid::brick_width;
+  for (int bz = 0; bz < brick_dims[2]; bz++)
+  {
+    for (int by = 0; by < brick_dims[1]; by++)
+    {
+      for (int bx = 0; bx < brick_dims[0]; bx++)
+      {
+        const DensityGrid::Brick *brick = grid.bricks()[grid.getBrickIndex(Eigen::Vector3i(bx, by, bz))].get();
+        if (!brick)
+          continue;
+        for (int z = 0; z < bw; z++)
+        {
+          for (int y = 0; y < bw; y++)
           {
-            Eigen::Vector3i ind;
-            ind[axis] = z;
-            ind[ax1] = x;
-            ind[ax2] = y;
-            total_density += grid.voxels()[grid.getIndex(ind)].density();
+            for (int x = 0; x < bw; x++)
+            {
+              // the grid has a one voxel border around the image volume
+              const Eigen::Vector3i ind = Eigen::Vector3i(bx*bw + x, by*bw + y, bz*bw + z) - Eigen::Vector3i(1,1,1);
+              if ((ind.array() < 0).any() || (ind.array() >= image_max.array()).any() || 
+                  !image.pixels.inBand(image.pixels.tileIndex(ind[image.ax1], ind[image.ax2])))
+                continue;
+              const DensityGrid::Voxel &voxel = brick->voxels[DensityGrid::getIndexInBrick(Eigen::Vector3i(x, y, z))];
+              if (voxel.numRays() == 0.0f)
+                continue;
+              const float density = static_cast<float>(voxel.density());
+              Eigen::Vector4f &pixel = image.pixels.pixel(ind[image.ax1], ind[image.ax2]);
+              pixel += Eigen::Vector4f(density, density, density, 0.0f);
+              pixel[3] = 1.0f;
+            }
           }
-          pixels[x + width * y] = Eigen::Vector4d(total_density, total_density, total_density, total_density);
         }
       }
     }
-    else // otherwise we use a common algorithm, specialising on render style only per-ray
+  }
+}
+
+/// Combine each 2x2 block of pixels into one pixel of the half resolution @c coarse image, so that the sums and means 
+/// of the coarser image are those of all of its rays. The nearest point is kept for the ends and starts styles. 
+/// Density pixels hold a numerator (the summed column densities) and denominator (the number of observed columns)
+/// in their first and fourth components, so a coarse density is the mean over its observed columns.
+void downsample(const PixelTiles &pixels, RenderStyle style, double dir, PixelTiles &coarse)
+{
+  for (int ty = 0; ty < pixels.tilesY(); ty++)
+  {
+    for (int tx = 0; tx < pixels.tilesX(); tx++)
     {
-      // this lambda expression lets us chunk load the ray cloud file, so we don't run out of RAM
-      auto render = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends, std::vector<double> &, std::vector<RGBA> &colours)
+      const std::vector<Eigen::Vector4f> &tile = pixels.tile(tx, ty);
+      if (tile.empty())
+        continue;
+      for (int y = 0; y < pixels.tileHeight(ty); y++)
       {
-        for (size_t i = 0; i<ends.size(); i++)
+        for (int x = 0; x < pixels.tileWidth(tx); x++)
         {
-          const RGBA &colour = colours[i];
-          if (colour.alpha == 0)
+          const Eigen::Vector4f &child = tile[x + pixels.tileSize() * y];
+          if (child[3] == 0.0) // empty in all styles
             continue;
-          const Eigen::Vector3d col = Eigen::Vector3d(colour.red, colour.green, colour.blue)/255.0;
-          const Eigen::Vector3d point = style == RenderStyle::Starts ? starts[i] : ends[i];
-          const Eigen::Vector3d pos = (point - bounds.min_bound_) / pix_width;
-          const Eigen::Vector3i p = (pos).cast<int>();
-          const int x = p[ax1], y = p[ax2];
-          // using 4 dimensions helps us to accumulate colours in a greater variety of ways
-          Eigen::Vector4d &pix = pixels[x + width*y]; 
+          Eigen::Vector4f &parent = 
+            coarse.outputPixel((tx * pixels.tileSize() + x) / 2, (ty * pixels.tileSize() + y) / 2);
           switch (style)
           {
-            case RenderStyle::Ends: 
-            case RenderStyle::Starts: 
-              // TODO: fix the == 0.0 part in future, it can cause incorrect occlusion on points with z=0 precisely
-              if (pos[axis]*dir > pix[3]*dir || pix[3] == 0.0) 
-                pix = Eigen::Vector4d(col[0], col[1], col[2], pos[axis]);
+            case RenderStyle::Ends:
+            case RenderStyle::Starts:
+              if (parent[3] == 0.0 || child[3]*dir > parent[3]*dir)
+                parent = child;
               break;
-            case RenderStyle::Mean: 
-              pix += Eigen::Vector4d(col[0], col[1], col[2], 1.0);
-              break;
-            case RenderStyle::Sum: 
-              pix += Eigen::Vector4d(col[0], col[1], col[2], 1.0);
-              break;
-            case RenderStyle::Rays: 
-            {
-              Eigen::Vector3d cloud_start = starts[i];
-              Eigen::Vector3d cloud_end = ends[i];
-              // clip to within the image (since we exclude unbounded rays from the image bounds)
-              bounds.clipRay(cloud_start, cloud_end); 
-              Eigen::Vector3d start = (cloud_start - bounds.min_bound_) / pix_width;
-              Eigen::Vector3d end = (cloud_end - bounds.min_bound_) / pix_width;
-              const Eigen::Vector3d dir = cloud_end - cloud_start;
-
-              // fast approximate 2D line rendering requires picking the long axis to iterate along
-              const bool x_long = std::abs(dir[ax1]) > std::abs(dir[ax2]);
-              const int axis_long   = x_long ? ax1 : ax2;
-              const int axis_short  = x_long ? ax2 : ax1;
-              const int width_long  = x_long ? 1 : width;
-              const int width_short = x_long ? width : 1;
-
-              const double gradient = dir[axis_short] / dir[axis_long]; 
-              if (dir[axis_long] < 0.0)
-                std::swap(start, end); // this lets us iterate from low up to high values
-              const int start_long = static_cast<int>(start[axis_long]);
-              const int end_long = static_cast<int>(end[axis_long]);
-              // place a pixel at the height of each midpoint (of the pixel) in the long axis
-              const double start_mid_point = 0.5 + static_cast<double>(start_long);
-              double height = start[axis_short] + (start_mid_point - start[axis_long])*gradient;
-              for (int l = start_long; l <= end_long; l++, height += gradient)
-              {
-                const int s = static_cast<int>(height);
-                pixels[width_long*l + width_short*s] += Eigen::Vector4d(col[0], col[1], col[2], 1.0);
-              }
-              break;
-            }
             default:
+              parent += child;
               break;
           }
         }
-      };
-      if (!Cloud::read(cloud_file, render))
-        return false;
+      }
     }
+  }
+}
+
+/// Converts the accumulated pixels of a render style into colours
+struct Shader
+{
+  Shader(RenderStyle render_style, bool hdr) : style(render_style), is_hdr(hdr), is_density(isDensityStyle(style)) {}
 
-    double max_val = 1.0;
-    const std::string image_ext = getFileNameExtension(image_file);
-    const bool is_hdr = image_ext == "hdr";
-    if (!is_hdr) // limited range, so work out a sensible maximum value, I'm using mean + two standard deviations:
+  /// The pixel value to shade, for density pixels this is numerator / denominator, which is the column density at 
+  /// full resolution. As at full resolution, columns with no density are transparent 
+  Eigen::Vector4f displayValue(const Eigen::Vector4f &pixel) const
+  {
+    if (!is_density || pixel[3] == 0.0)
+      return pixel;
+    const float density = pixel[0] / pixel[3];
+    return Eigen::Vector4f(density, density, density, density);
+  }
+
+  /// Add the display values of the allocated pixels to @c statistics
+  void addStatistics(const PixelTiles &pixels, PixelStatistics &statistics) const
+  {
+    for (int ty = 0; ty < pixels.tilesY(); ty++)
     {
-      double sum = 0.0;
-      double num = 0.0;
-      for (auto &pixel: pixels)
+      for (int tx = 0; tx < pixels.tilesX(); tx++)
       {
-        sum += pixel[3];
-        if (pixel[3] > 0.0)
-          num++;
+        for (auto &pixel: pixels.tile(tx, ty))
+        {
+          const double value = displayValue(pixel)[3];
+          if (value > 0.0)
+          {
+            statistics.sum += value;
+            statistics.sum_sqr += value*value;
+            statistics.num++;
+          }
+        }
       }
-      double mean = sum / num;
-      double sum_sqr = 0.0;
-      for (auto &pixel: pixels)
+    }
+  }
+
+  /// Convert an accumulated pixel value into its final colour
+  void shade(const Eigen::Vector4f &colour, double max_val, RGBA *col, float *float_col) const
+  {
+    Eigen::Vector3d col3d(colour[0], colour[1], colour[2]);
+    const uint8_t alpha = colour[3] == 0.0 ? 0 : 255; // 'punch-through' alpha
+    switch (style)
+    {
+      case RenderStyle::Mean:
+      case RenderStyle::Rays: 
+        col3d /= colour[3]; // simple mean
+        break;
+      case RenderStyle::Sum: 
+      case RenderStyle::Density: 
+        col3d /= max_val; // rescale to within limited colour range
+        break;
+      case RenderStyle::Density_rgb: 
       {
-        if (pixel[3] > 0.0)
-          sum_sqr += sqr(pixel[3] - mean);
+        if (is_hdr)
+          col3d = colour[0] * redGreenBlueSpectrum(std::log10(std::max(1e-6, (double)colour[0])));
+        else 
+        {
+          double shade = colour[0] / max_val;
+          col3d = redGreenBlueGradient(shade);
+          if (shade < 0.05)
+            col3d *= 20.0*shade; // this blends the lowest densities down to black
+        }
+        break;
       }
-      const double standard_deviation = std::sqrt(sum_sqr / num);
-      max_val = mean + 2.0*standard_deviation;
+      default:
+        break;
     }
-
-    // The final pixel buffer
-    std::vector<RGBA> pixel_colours;
-    std::vector<float> float_pixel_colours;
     if (is_hdr)
-      float_pixel_colours.resize(3 * width * height);
-    else
-      pixel_colours.resize(width*height);
+    {
+      float_col[0] = (float)col3d[0];
+      float_col[1] = (float)col3d[1];
+      float_col[2] = (float)col3d[2];
+    }
+    else 
+    {
+      col->red   = uint8_t(std::min(255.0*col3d[0], 255.0));
+      col->green = uint8_t(std::min(255.0*col3d[1], 255.0));
+      col->blue  = uint8_t(std::min(255.0*col3d[2], 255.0));
+      col->alpha = alpha;
+    }
+  }
+
+  /// Shade the tile at tx,ty into an image buffer of the given width, starting at index @c offset
+  void shadeTile(const PixelTiles &pixels, double max_val, int tx, int ty, int buffer_width, size_t offset, 
+                 std::vector<RGBA> &pixel_colours, std::vector<float> &float_pixel_colours) const
+  {
+    const Eigen::Vector4f empty_pixel(0, 0, 0, 0);
+    const std::vector<Eigen::Vector4f> &tile = pixels.tile(tx, ty);
+    for (int y = 0; y < pixels.tileHeight(ty); y++)
+    {
+      for (int x = 0; x < pixels.tileWidth(tx); x++)
+      {
+        const Eigen::Vector4f colour = displayValue(tile.empty() ? empty_pixel : tile[x + pixels.tileSize() * y]);
+        const size_t ind = offset + x + static_cast<size_t>(buffer_width) * y;
+        shade(colour, max_val, is_hdr ? nullptr : &pixel_colours[ind], is_hdr ? &float_pixel_colours[3*ind] : nullptr);
+      }
+    }
+  }
+
+  RenderStyle style;
+  bool is_hdr;
+  bool is_density;
+};
+
+/// Convert the accumulated pixels into colours and write them as a single image
+bool writeSingleImage(const ViewImage &image, const Shader &shader, double max_val)
+{
+  const PixelTiles &pixels = image.pixels;
+  const std::string &image_file = image.view.image_file;
+  const std::string image_ext = getFileNameExtension(image_file);
+  const int width = pixels.width(), height = pixels.height();
+  // The final pixel buffer
+  std::vector<RGBA> pixel_colours;
+  std::vector<float> float_pixel_colours;
+  if (shader.is_hdr)
+    float_pixel_colours.resize(3 * static_cast<size_t>(width) * height);
+  else
+    pixel_colours.resize(static_cast<size_t>(width) * height);
+  const auto shade_tiles = [&](int ty)
+  {
+    for (int tx = 0; tx < pixels.tilesX(); tx++)
+    {
+      const size_t offset = static_cast<size_t>(tx) * pixels.tileSize() + 
+                            static_cast<size_t>(ty) * pixels.tileSize() * width;
+      shader.shadeTile(pixels, max_val, tx, ty, width, offset, pixel_colours, float_pixel_colours);
+    }
+  };
+#if RAYLIB_WITH_TBB
+  tbb::parallel_for(0, pixels.tilesY(), shade_tiles);
+#else  // RAYLIB_WITH_TBB
+  for (int ty = 0; ty < pixels.tilesY(); ty++)
+    shade_tiles(ty);
+#endif // RAYLIB_WITH_TBB
+  std::cout << "outputting image: " << image_file << std::endl;
+  if (!writeImage(image_file, image_ext, width, height, pixel_colours, float_pixel_colours))
+  {
+    std::cerr << "Error: failed to write image " << image_file << std::endl;
+    return false;
+  }
+  return true;
+}
+
+/// Convert the allocated tiles of @c pixels, which is level @c level of the pyramid, into colours and write each to 
+/// its own image, <image stub>_<column>_<row>.<ext>, or <image stub>_<level>_<column>_<row>.<ext> for a pyramid. 
+/// Each is listed with its bounds in the image's index file, and counted in @c num_written
+bool writeTiles(ViewImage &image, const Shader &shader, const PixelTiles &pixels, int level, double max_val, 
+                const Cuboid &bounds, double pix_width, const RenderConfig &config, int &num_written)
+{
+  const std::string image_ext = getFileNameExtension(image.view.image_file);
+  const std::string image_stub = getFileNameStub(image.view.image_file);
+  const std::string level_stub = config.pyramid ? image_stub + "_" + std::to_string(level) : image_stub;
+  std::vector<int> written(pixels.tilesX() * pixels.tilesY(), 0);
+  const auto write_tile = [&](int t)
+  {
+    const int tx = t % pixels.tilesX();
+    const int ty = t / pixels.tilesX();
+    if (pixels.tile(tx, ty).empty())
+      return;
+    const int tile_width = pixels.tileWidth(tx);
+    const int tile_height = pixels.tileHeight(ty);
+    std::vector<RGBA> pixel_colours(shader.is_hdr ? 0 : tile_width * tile_height);
+    std::vector<float> float_pixel_colours(shader.is_hdr ? 3 * tile_width * tile_height : 0);
+    shader.shadeTile(pixels, max_val, tx, ty, tile_width, 0, pixel_colours, float_pixel_colours);
+    const std::string tile_file = level_stub + "_" + std::to_string(tx) + "_" + std::to_string(ty) + "." + image_ext;
+    written[t] = writeImage(tile_file, image_ext, tile_width, tile_height, pixel_colours, float_pixel_colours) ? 1 : -1;
+  };
+#if RAYLIB_WITH_TBB
+  tbb::parallel_for(0, pixels.tilesX() * pixels.tilesY(), write_tile);
+#else  // RAYLIB_WITH_TBB
+  for (int t = 0; t < pixels.tilesX() * pixels.tilesY(); t++)
+    write_tile(t);
+#endif // RAYLIB_WITH_TBB
+
+  const int scale = 1 << level; // full resolution pixels per pixel of this level
+  for (int t = 0; t < static_cast<int>(written.size()); t++)
+  {
+    if (written[t] == 0)
+      continue;
+    const int tx = t % pixels.tilesX();
+    const int ty = t / pixels.tilesX();
+    if (written[t] < 0)
+    {
+      std::cerr << "Error: failed to write tile " << tx << ", " << ty << std::endl;
+      return false;
+    }
+    // the tile's bounds, from its full resolution pixel range in render coordinates
+    const int width = image.width, height = image.height;
+    const int out_x0 = tx * pixels.tileSize() * scale;
+    const int out_x1 = std::min(width, out_x0 + pixels.tileWidth(tx) * scale);
+    const int out_y0 = ty * pixels.tileSize() * scale;
+    const int out_y1 = std::min(height, out_y0 + pixels.tileHeight(ty) * scale);
+    const int x0 = image.flip_x ? width - out_x1 : out_x0, x1 = image.flip_x ? width - out_x0 : out_x1;
+    const int y0 = height - out_y1, y1 = height - out_y0;
+    Cuboid tile_bounds = bounds;
+    tile_bounds.min_bound_[image.ax1] = bounds.min_bound_[image.ax1] + x0 * pix_width;
+    tile_bounds.max_bound_[image.ax1] = bounds.min_bound_[image.ax1] + x1 * pix_width;
+    tile_bounds.min_bound_[image.ax2] = bounds.min_bound_[image.ax2] + y0 * pix_width;
+    tile_bounds.max_bound_[image.ax2] = bounds.min_bound_[image.ax2] + y1 * pix_width;
+    const Eigen::Vector3d &lo = tile_bounds.min_bound_, &hi = tile_bounds.max_bound_;
+    image.index << level_stub << "_" << tx << "_" << ty << "." << image_ext << ", " << lo[0] << " " << lo[1] << " " 
+                << lo[2] << ", " << hi[0] << " " << hi[1] << " " << hi[2] << std::endl;
+    num_written++;
+  }
+  return true;
+}
 
-    for (int x = 0; x < width; x++)
+/// Finish the band of @c image that has just been rendered. During a statistics sweep this gathers its statistics, 
+/// otherwise it is written, as a single image or as tiles. A pyramid's coarser levels are written after the last band.
+/// The band is then freed, and the next band set for rendering
+bool finishBand(ViewImage &image, const Cuboid &bounds, double pix_width, const RenderConfig &config)
+{
+  const RenderStyle style = image.view.style;
+  const Shader shader(style, getFileNameExtension(image.view.image_file) == "hdr");
+  const std::string index_file = getFileNameStub(image.view.image_file) + "_tiles.txt";
+  stbi_flip_vertically_on_write(0); // the tiles are already stored from top to bottom
+  if (image.statisticsStep())
+  {
+    shader.addStatistics(image.pixels, image.statistics);
+  }
+  else
+  {
+    if (image.num_steps == image.num_bands && image.needs_statistics) // the whole image is in this band
+      shader.addStatistics(image.pixels, image.statistics);
+    const double max_val = image.needs_statistics ? image.statistics.maximumValue() : 1.0;
+    if (config.tile_size <= 0 && !config.pyramid)
     {
-      const int indx = flip_x ? width - 1 - x : x; // possible horizontal flip, depending on view direction
-      for (int y = 0; y < height; y++)
+      if (!writeSingleImage(image, shader, max_val))
+        return false;
+    }
+    else
+    {
+      const PixelTiles &pixels = image.pixels;
+      const bool has_coarse_levels = config.pyramid && (pixels.tilesX() > 1 || pixels.tilesY() > 1);
+      if (image.step == image.num_steps - image.num_bands) // the first band to write
       {
-        const Eigen::Vector4d colour = pixels[x + width*y];
-        Eigen::Vector3d col3d(colour[0], colour[1], colour[2]);
-        const uint8_t alpha = colour[3] == 0.0 ? 0 : 255; // 'punch-through' alpha
-        switch (style)
+        image.index.open(index_file);
+        if (!image.index.is_open())
         {
-          case RenderStyle::Mean:
-          case RenderStyle::Rays: 
-            col3d /= colour[3]; // simple mean
-            break;
-          case RenderStyle::Sum: 
-          case RenderStyle::Density: 
-            col3d /= max_val; // rescale to within limited colour range
-            break;
-          case RenderStyle::Density_rgb: 
+          std::cerr << "Error: cannot open " << index_file << " for writing" << std::endl;
+          return false;
+        }
+        image.index << "# tile image, minimum bound, maximum bound" << std::endl;
+        image.num_written = 0;
+        if (has_coarse_levels)
+          image.coarse_pixels = PixelTiles((pixels.width() + 1) / 2, (pixels.height() + 1) / 2, pixels.tileSize(), false);
+      }
+      if (!writeTiles(image, shader, pixels, 0, max_val, bounds, pix_width, config, image.num_written))
+        return false;
+      if (has_coarse_levels)
+        downsample(pixels, style, image.dir, image.coarse_pixels);
+
+      if (image.step == image.num_steps - 1) // the last band
+      {
+        const auto report = [&](int num_written, int num_tiles, int level)
+        {
+          std::cout << "outputting " << num_written << " of " << num_tiles << " image tiles";
+          if (config.pyramid)
+            std::cout << " for level " << level;
+          std::cout << ", listed in " << index_file << std::endl;
+        };
+        report(image.num_written, pixels.tilesX() * pixels.tilesY(), 0);
+        // the coarser levels are a quarter of the size of the one before, so are held whole
+        for (int level = 1; has_coarse_levels; level++)
+        {
+          PixelTiles &coarse = image.coarse_pixels;
+          double coarse_max_val = 1.0;
+          if (image.needs_statistics)
           {
-            if (is_hdr)
-              col3d = colour[0] * redGreenBlueSpectrum(std::log10(std::max(1e-6, colour[0])));
-            else 
-            {
-              double shade = colour[0] / max_val;
-              col3d = redGreenBlueGradient(shade);
-              if (shade < 0.05)
-                col3d *= 20.0*shade; // this blends the lowest densities down to black
-            }
-            break;
+            PixelStatistics statistics;
+            shader.addStatistics(coarse, statistics);
+            coarse_max_val = statistics.maximumValue();
           }
-          default:
+          int num_written = 0;
+          if (!writeTiles(image, shader, coarse, level, coarse_max_val, bounds, pix_width, config, num_written))
+            return false;
+          report(num_written, coarse.tilesX() * coarse.tilesY(), level);
+          if (coarse.tilesX() == 1 && coarse.tilesY() == 1)
             break;
+          PixelTiles coarser((coarse.width() + 1) / 2, (coarse.height() + 1) / 2, coarse.tileSize(), false);
+          downsample(coarse, style, image.dir, coarser);
+          coarse = std::move(coarser);
         }
-        const int ind = indx + width *y;
-        if (is_hdr)
+        image.coarse_pixels = PixelTiles();
+        image.index.close();
+      }
+    }
+  }
+  image.pixels.clear();
+  image.step++;
+  if (!image.finished())
+    image.setBand();
+  return true;
+}
+}
+
+bool renderCloud(const std::string &cloud_file, const Cuboid &bounds, ViewDirection view_direction, 
+                 RenderStyle style, double pix_width, const std::string &image_file, const RenderConfig &config)
+{
+  return renderCloud(cloud_file, bounds, {RenderView{view_direction, style, image_file}}, pix_width, config);
+}
+
+bool renderCloud(const std::string &cloud_file, const Cuboid &bounds, const std::vector<RenderView> &views, 
+                 double pix_width, const RenderConfig &config)
+{
+  for (auto &view: views)
+  {
+    const std::string image_ext = getFileNameExtension(view.image_file);
+    if (image_ext != "png" && image_ext != "bmp" && image_ext != "tga" && image_ext != "jpg" && image_ext != "hdr")
+    {
+      std::cerr << "Error: image format " << image_ext << " not known" << std::endl;
+      return false;
+    }
+  }
+  const Eigen::Vector3d extent = bounds.max_bound_ - bounds.min_bound_;
+
+  try // there is a possibility of running out of memory here. So provide a helpful message rather than just asserting
+  {
+    // accumulated colour buffers. When not tiled, the tiles just avoid allocating the empty parts of the images
+    const int default_tile_size = 256;
+    std::vector<std::unique_ptr<ViewImage>> images;
+    bool any_density = false;
+    for (auto &view: views)
+    {
+      images.emplace_back(new ViewImage(view, extent, pix_width, config.tile_size > 0 ? config.tile_size : default_tile_size,
+                                        config));
+      std::cout << "outputting " << images.back()->width << "x" << images.back()->height << " image" << std::endl;
+      const ViewImage &image = *images.back();
+      if (image.num_bands > 1)
+      {
+        std::cout << "rendering in " << image.num_bands << " bands of " << image.rows_per_band << " tile rows";
+        if (image.num_steps > image.num_bands)
+          std::cout << ", twice to find the range of values to shade";
+        std::cout << std::endl;
+      }
+      any_density = any_density || isDensityStyle(view.style);
+    }
+    // density calculation is a special case, the density grid is independent of the view, so it is shared
+    std::unique_ptr<DensityGrid> grid;
+    bool grid_loaded = false;
+    FileStamp source;
+    if (any_density) 
+    {
+      Eigen::Vector3i dims = (extent/pix_width).cast<int>() + Eigen::Vector3i(1,1,1);
+      #if DENSITY_MIN_RAYS > 0
+      dims += Eigen::Vector3i(1,1,1); // so that we have extra space to convolve
+      #endif
+      Cuboid grid_bounds = bounds;
+      grid_bounds.min_bound_ -= Eigen::Vector3d(pix_width, pix_width, pix_width);
+      if (!config.density_file.empty())
+      {
+        // only use the saved grid if it is from the same cloud contents and covers the same voxels, the cloud bounds 
+        // are not stored exactly
+        Cuboid saved_bounds(Eigen::Vector3d::Zero(), Eigen::Vector3d::Zero());
+        double saved_width;
+        Eigen::Vector3i saved_dims;
+        FileStamp saved_source;
+        if (!getFileStamp(cloud_file, source))
         {
-          float_pixel_colours[3*ind + 0] = (float)col3d[0];
-          float_pixel_colours[3*ind + 1] = (float)col3d[1];
-          float_pixel_colours[3*ind + 2] = (float)col3d[2];
+          std::cerr << "Error: cannot read " << cloud_file << std::endl;
+          return false;
         }
-        else 
+        if (DensityGrid::loadHeader(config.density_file, saved_bounds, saved_width, saved_dims, saved_source))
         {
-          RGBA col;
-          col.red   = uint8_t(std::min(255.0*col3d[0], 255.0));
-          col.green = uint8_t(std::min(255.0*col3d[1], 255.0));
-          col.blue  = uint8_t(std::min(255.0*col3d[2], 255.0));
-          col.alpha = alpha;
-          pixel_colours[ind] = col;
+          const double eps = 1e-4 * pix_width;
+          if (saved_source == source && saved_dims == dims && std::abs(saved_width - pix_width) < eps && 
+              (saved_bounds.min_bound_ - grid_bounds.min_bound_).cwiseAbs().maxCoeff() < eps &&
+              (saved_bounds.max_bound_ - grid_bounds.max_bound_).cwiseAbs().maxCoeff() < eps)
+          {
+            grid = DensityGrid::load(config.density_file);
+            grid_loaded = grid != nullptr;
+          }
+          if (grid_loaded)
+            std::cout << "loaded density volume " << config.density_file << std::endl;
+          else
+            std::cout << "density volume " << config.density_file << " does not match this render, recalculating" << std::endl;
         }
       }
+      if (!grid_loaded)
+        grid.reset(new DensityGrid(grid_bounds, pix_width, dims));
     }
-    std::cout << "outputting image: " << image_file << std::endl;
-    const char *image_name = image_file.c_str();
-    stbi_flip_vertically_on_write(1);
-    if (image_ext == "png")
-      stbi_write_png(image_name, width, height, 4, (void *)&pixel_colours[0], 4 * width);
-    else if (image_ext == "bmp")
-      stbi_write_bmp(image_name, width, height, 4, (void *)&pixel_colours[0]);
-    else if (image_ext == "tga")
-      stbi_write_tga(image_name, width, height, 4, (void *)&pixel_colours[0]);
-    else if (image_ext == "jpg")
-      stbi_write_jpg(image_name, width, height, 4, (void *)&pixel_colours[0], 100); // 100 is maximal quality
-    else if (image_ext == "hdr")
-      stbi_write_hdr(image_name, width, height, 3, &float_pixel_colours[0]);
-    else
+
+    // this lambda expression lets us chunk load the ray cloud file, so we don't run out of RAM. 
+    // All of the views are accumulated in the one pass, each pass rendering the next band of each unfinished view
+    bool add_to_grid = grid && !grid_loaded;
+    std::vector<ViewImage *> pass_images;
+    auto render = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends, std::vector<double> &, std::vector<RGBA> &colours)
     {
-      std::cerr << "Error: image format " << image_ext << " not known" << std::endl;
-      return false;
+      if (add_to_grid)
+        grid->addRays(starts, ends, colours);
+      for (auto &image: pass_images)
+        splatRays(*image, bounds, pix_width, starts, ends, colours);
+    };
+    for (;;)
+    {
+      pass_images.clear();
+      for (auto &image: images)
+      {
+        if (!isDensityStyle(image->view.style) && !image->finished())
+          pass_images.push_back(image.get());
+      }
+      // a loaded density grid means there is no need to read the cloud unless there are other styles to render
+      if (pass_images.empty() && !add_to_grid)
+        break;
+      if (!Cloud::read(cloud_file, render))
+        return false;
+      add_to_grid = false;
+      for (auto &image: pass_images)
+      {
+        if (!finishBand(*image, bounds, pix_width, config))
+          return false;
+      }
     }
 
+    if (grid)
+    {
+      if (!grid_loaded)
+      {
+        #if DENSITY_MIN_RAYS > 0
+        grid->addNeighbourPriors();
+        #endif
+        if (!config.density_file.empty())
+        {
+          if (!grid->save(config.density_file, source))
+            return false;
+          std::cout << "saved density volume " << config.density_file << std::endl;
+        }
+      }
+      for (auto &image: images)
+      {
+        while (isDensityStyle(image->view.style) && !image->finished())
+        {
+          projectDensities(*image, *grid);
+          if (!finishBand(*image, bounds, pix_width, config))
+            return false;
+        }
+      }
+      grid.reset();
+    }
   }
   catch (std::bad_alloc const&) 
   {
-    std::cout << "Not enough memory to process the " << width << "x" << height << " image." << std::endl;
+    std::cout << "Not enough memory to process the " << views.size() << " images." << std::endl;
     std::cout << "The --pixel_width option can be used to reduce the resolution." << std::endl;
   }
 
@@ -10,6 +10,8 @@
 #include "raycuboid.h"
 #include "rayutils.h"
 #include "raypose.h"
+#include "rayparse.h"
+#include <memory>
 
 namespace ray
 {
@@ -35,9 +37,45 @@ enum class RAYLIB_EXPORT RenderStyle
   Density_rgb
 };
 
+/// Optional settings for rendering a ray cloud
+struct RAYLIB_EXPORT RenderConfig
+{
+  /// When non-zero, the image is written as a grid of tiles of this many pixels square, named 
+  /// <image stub>_<column>_<row>.<ext> from the top left, and listed with their bounds in <image stub>_tiles.txt. 
+  /// Empty tiles are not written
+  int tile_size = 0;
+  /// When tiled, each view accumulates at most this many pixels (16 bytes each) at a time. Larger images are rendered 
+  /// in bands of tile rows, each written and freed once complete, at the cost of one pass over the cloud per band. 
+  /// Styles shaded relative to the whole image (non-hdr sum and density) take a first sweep of the bands to find it
+  size_t max_band_pixels = size_t(1) << 26;
+  /// Also write each coarser level of detail, at half the resolution of the previous one, until the image fits in 
+  /// a single tile. Tiles are named <image stub>_<level>_<column>_<row>.<ext>, where level 0 is full resolution.
+  /// Uses tiles of 256 pixels if tile_size is not set. The half resolution level is held in memory while the full 
+  /// resolution bands are rendered
+  bool pyramid = false;
+  /// When set, density styles load their density grid from this file, if it was calculated from the same cloud file
+  /// contents, bounds and pixel width, rather than recalculating it from the rays. Otherwise the calculated grid is 
+  /// saved to this file for next time
+  std::string density_file;
+};
+
+/// A single image to render from a ray cloud
+struct RAYLIB_EXPORT RenderView
+{
+  ViewDirection direction;
+  RenderStyle style;
+  std::string image_file;
+};
+
 /// Render a ray cloud according to the supplied parameters
 bool RAYLIB_EXPORT renderCloud(const std::string &cloud_file, const Cuboid &bounds, ViewDirection view_direction, 
-                               RenderStyle style, double pix_width, const std::string &image_file);
+                               RenderStyle style, double pix_width, const std::string &image_file, 
+                               const RenderConfig &config = RenderConfig());
+
+/// Render a set of views of a ray cloud in a single pass over the cloud file. Any density styles share one 
+/// density grid
+bool RAYLIB_EXPORT renderCloud(const std::string &cloud_file, const Cuboid &bounds, const std::vector<RenderView> &views,
+                               double pix_width, const RenderConfig &config = RenderConfig());
 
 /// This is used for estimating the per-voxel density of a ray cloud
 /// Density represents the surface area per volume, assuming an unbiased distribution of surface angles
@@ -48,11 +86,16 @@ struct RAYLIB_EXPORT DensityGrid
 {
   static const int min_voxel_hits = 2;
   static constexpr double spherical_distribution_scale = 2.0; // average area scale due to a spherical uniform distribution of leave angles relative to the rays
+  /// Voxels are stored in cubic bricks of brick_width^3 voxels. Only the bricks that rays pass through are allocated
+  static const int brick_bits = 3;
+  static const int brick_width = 1 << brick_bits;
+  static const int brick_size = brick_width * brick_width * brick_width;
   
   DensityGrid(const Cuboid &grid_bounds, double vox_width, const Eigen::Vector3i &dims) : 
     bounds_(grid_bounds), voxel_width_(vox_width), voxel_dims_(dims) 
   {
-    voxels_.resize(dims[0]*dims[1]*dims[2]);
+    brick_dims_ = (dims + Eigen::Vector3i(brick_width-1, brick_width-1, brick_width-1)) / brick_width;
+    bricks_.resize(brick_dims_[0]*brick_dims_[1]*brick_dims_[2]);
   }
   
   /// This specific voxel class represents a density
@@ -60,6 +103,8 @@ struct RAYLIB_EXPORT DensityGrid
   {
   public:
     Voxel(){ num_hits_ = num_rays_ = path_length_ = 0.0; }
+    Voxel(float num_hits, float num_rays, float path_length) : 
+      num_hits_(num_hits), num_rays_(num_rays), path_length_(path_length) {}
     /// return the density that the voxel represents
     inline double density() const;
     /// the densities can be summed element-wise
@@ -80,22 +125,62 @@ struct RAYLIB_EXPORT DensityGrid
     float path_length_;
   };
 
+  /// A brick of voxels, indexed by x + brick_width*y + brick_width*brick_width*z in local brick coordinates
+  struct Brick
+  {
+    Voxel voxels[brick_size];
+  };
+
   /// This streams in a ray cloud file, and fills in the voxel density information
   void calculateDensities(const std::string &file_name);
+  /// Add one chunk of rays to the voxel density information, this allows the densities to be calculated 
+  /// while the ray cloud is streamed for other purposes
+  void addRays(const std::vector<Eigen::Vector3d> &starts, const std::vector<Eigen::Vector3d> &ends, 
+               const std::vector<RGBA> &colours);
   /// To void low-ray-count voxels giving unstable density estimates, we fuse with neighbour information
   /// up to a specified minimum number of rays. Specified in DENSITY_MIN_RAYS 
   void addNeighbourPriors();
-  /// Note, for performance, this index function does not check that the specified indices are in valid bounds. 
+  /// Note, for performance, these index functions do not check that the specified indices are in valid bounds. 
   /// It is up to the calling function to assure this condition
-  inline int getIndex(const Eigen::Vector3i &inds) const;
-  /// Return the vector of density voxels
-  inline const std::vector<Voxel> &voxels() const { return voxels_; }
+  inline int getBrickIndex(const Eigen::Vector3i &brick_inds) const;
+  /// The index of a voxel within its brick
+  static inline int getIndexInBrick(const Eigen::Vector3i &inds);
+  /// Return the voxel at @c inds, or nullptr if its brick is not allocated
+  inline const Voxel *voxel(const Eigen::Vector3i &inds) const;
+  /// Return the voxel at @c inds, allocating its brick if necessary
+  inline Voxel &touchVoxel(const Eigen::Vector3i &inds);
+  /// Return the table of bricks, in brick index order. Unallocated bricks are null
+  inline const std::vector<std::unique_ptr<Brick>> &bricks() const { return bricks_; }
+  /// Return the grid dimensions in voxels and in bricks
+  inline const Eigen::Vector3i &voxelDims() const { return voxel_dims_; }
+  inline const Eigen::Vector3i &brickDims() const { return brick_dims_; }
+  /// The number of allocated bricks
+  size_t numBricks() const;
+  inline const Cuboid &bounds() const { return bounds_; }
+  inline double voxelWidth() const { return voxel_width_; }
+
+  /// Save the grid to a binary file. Only allocated bricks are stored, and within each brick only the non-empty 
+  /// voxels, so the file is typically a small fraction of the grid's memory footprint. The @c source stamp of the 
+  /// ray cloud file that the grid was calculated from is stored, to identify when the grid is out of date
+  bool save(const std::string &file_name, const FileStamp &source) const;
+  /// Load a grid saved with @c save(). Returns nullptr if the file cannot be read
+  static std::unique_ptr<DensityGrid> load(const std::string &file_name);
+  /// Read just the bounds, voxel width, dimensions and source file stamp of a saved grid, without loading its voxels
+  static bool loadHeader(const std::string &file_name, Cuboid &bounds, double &voxel_width, Eigen::Vector3i &dims, 
+                         FileStamp &source);
 
 private:
+  /// Walk the voxels that the ray passes through, calling @c func(voxel_indices, length_in_voxel, is_hit) for each one
+  template <class T> 
+  void walkRay(const Eigen::Vector3d &ray_start, const Eigen::Vector3d &ray_end, bool bounded, T func) const;
+  /// Allocate all empty bricks that may receive density from a neighbouring voxel in @c addNeighbourPriors()
+  void allocateNeighbourBricks();
+
   Cuboid bounds_;
-  std::vector<Voxel> voxels_;
+  std::vector<std::unique_ptr<Brick>> bricks_;
   double voxel_width_;
   Eigen::Vector3i voxel_dims_;
+  Eigen::Vector3i brick_dims_;
 };
 
 // inline functions
@@ -130,9 +215,26 @@ void DensityGrid::Voxel::addMissRay(float length)
   path_length_ += length;
   num_rays_++;
 }
-int DensityGrid::getIndex(const Eigen::Vector3i &inds) const
+int DensityGrid::getBrickIndex(const Eigen::Vector3i &brick_inds) const
+{
+  return brick_inds[0] + brick_inds[1]*brick_dims_[0] + brick_inds[2] * brick_dims_[0]*brick_dims_[1];
+}
+int DensityGrid::getIndexInBrick(const Eigen::Vector3i &inds)
+{
+  const int mask = brick_width - 1;
+  return (inds[0] & mask) + ((inds[1] & mask) << brick_bits) + ((inds[2] & mask) << (2*brick_bits));
+}
+const DensityGrid::Voxel *DensityGrid::voxel(const Eigen::Vector3i &inds) const
+{
+  const Brick *brick = bricks_[getBrickIndex(Eigen::Vector3i(inds[0] >> brick_bits, inds[1] >> brick_bits, inds[2] >> brick_bits))].get();
+  return brick ? &brick->voxels[getIndexInBrick(inds)] : nullptr;
+}
+DensityGrid::Voxel &DensityGrid::touchVoxel(const Eigen::Vector3i &inds)
 {
-  return inds[0] + inds[1]*voxel_dims_[0] + inds[2] * voxel_dims_[0]*voxel_dims_[1];
+  std::unique_ptr<Brick> &brick = bricks_[getBrickIndex(Eigen::Vector3i(inds[0] >> brick_bits, inds[1] >> brick_bits, inds[2] >> brick_bits))];
+  if (!brick)
+    brick.reset(new Brick);
+  return brick->voxels[getIndexInBrick(inds)];
 }
 }
 #endif // RAYLIB_RAYRENDERER_H
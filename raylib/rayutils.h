@@ -20,6 +20,7 @@
 #include <numeric>
 #include <set>
 #include <string>
+#include <unordered_set>
 #include <vector>
 #include <Eigen/Dense>
 
@@ -89,23 +90,32 @@ public:
   }
 };
 
-inline void voxelSubsample(const std::vector<Eigen::Vector3d> &points, double voxel_width, std::vector<int64_t> &indices, std::set<Eigen::Vector3i, Vector3iLess> &vox_set)
+class RAYLIB_EXPORT Vector3iHash
+{
+public:
+  size_t operator()(const Eigen::Vector3i &v) const
+  {
+    return size_t(v[0]) * 73856093u ^ size_t(v[1]) * 19349663u ^ size_t(v[2]) * 83492791u;
+  }
+};
+
+/// Append to @c indices the first of @c points in each voxel of width @c voxel_width that is not already in @c vox_set,
+/// which can be a @c std::set or @c std::unordered_set of voxel indices
+template <class VoxelSet>
+inline void voxelSubsample(const std::vector<Eigen::Vector3d> &points, double voxel_width, std::vector<int64_t> &indices, VoxelSet &vox_set)
 {
   for (int64_t i = 0; i<(int64_t)points.size(); i++)
   {
     Eigen::Vector3i voxel(int(std::floor(points[i][0] / voxel_width)), int(std::floor(points[i][1] / voxel_width)),
                           int(std::floor(points[i][2] / voxel_width)));
-    if (vox_set.find(voxel) == vox_set.end())
-    {
-      vox_set.insert(voxel);
+    if (vox_set.insert(voxel).second)
       indices.push_back(i);
-    }
   }
 }
 
 inline void voxelSubsample(const std::vector<Eigen::Vector3d> &points, double voxel_width, std::vector<int64_t> &indices)
 {
-  std::set<Eigen::Vector3i, Vector3iLess> vox_set; 
+  std::unordered_set<Eigen::Vector3i, Vector3iHash> vox_set; 
   voxelSubsample(points, voxel_width, indices, vox_set);
 }
 
@@ -0,0 +1,219 @@
+// Copyright (c) 2020
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#include "raywarp.h"
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+namespace ray
+{
+namespace
+{
+const char *const kStepFormat = "%step centre_x centre_y centre_z a_x a_y a_z b_x b_y b_z c_x c_y c_z "
+                                "position_x position_y position_z rotation_w rotation_x rotation_y rotation_z";
+
+void writeStep(std::ofstream &ofs, const Warp::Step &step)
+{
+  ofs << "step";
+  for (const Eigen::Vector3d *vec : { &step.centre, &step.a, &step.b, &step.c, &step.pose.position })
+    ofs << " " << (*vec)[0] << " " << (*vec)[1] << " " << (*vec)[2];
+  const Eigen::Quaterniond &q = step.pose.rotation;
+  ofs << " " << q.w() << " " << q.x() << " " << q.y() << " " << q.z() << std::endl;
+}
+
+bool readStep(std::istringstream &iss, Warp::Step &step)
+{
+  for (Eigen::Vector3d *vec : { &step.centre, &step.a, &step.b, &step.c, &step.pose.position })
+    iss >> (*vec)[0] >> (*vec)[1] >> (*vec)[2];
+  Eigen::Quaterniond &q = step.pose.rotation;
+  iss >> q.w() >> q.x() >> q.y() >> q.z();
+  if (iss.fail())
+    return false;
+  q.normalize();
+  return true;
+}
+
+/// Read the warp file @c file_name, calling @c time_found for each time line and @c step_found for each step
+bool readWarpFile(const std::string &file_name, std::function<bool(double time)> time_found,
+                  std::function<void(const Warp::Step &step)> step_found)
+{
+  std::ifstream ifs(file_name.c_str(), std::ios::in);
+  if (!ifs)
+  {
+    std::cerr << "Failed to open warp file: " << file_name << std::endl;
+    return false;
+  }
+  std::string line;
+  int line_number = 0;
+  while (getline(ifs, line))
+  {
+    line_number++;
+    if (line.length() == 0 || line[0] == '%')
+      continue;
+    std::istringstream iss(line);
+    std::string keyword;
+    iss >> keyword;
+    if (keyword == "step")
+    {
+      Warp::Step step;
+      if (!readStep(iss, step))
+      {
+        std::cerr << "Invalid step at line " << line_number << " of " << file_name << std::endl;
+        return false;
+      }
+      step_found(step);
+    }
+    else if (keyword == "time")
+    {
+      double time;
+      iss >> time;
+      if (iss.fail() || !time_found(time))
+      {
+        std::cerr << "Invalid time at line " << line_number << " of " << file_name << std::endl;
+        return false;
+      }
+    }
+    else
+    {
+      std::cerr << "Unknown entry '" << keyword << "' at line " << line_number << " of " << file_name << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+bool openWarpFile(const std::string &file_name, std::ofstream &ofs)
+{
+  ofs.open(file_name.c_str(), std::ios::out);
+  if (ofs.fail())
+  {
+    std::cerr << "error: cannot open file " << file_name << " for writing" << std::endl;
+    return false;
+  }
+  ofs.unsetf(std::ios::floatfield);
+  ofs.precision(17);  // round trips doubles exactly
+  ofs << kStepFormat << std::endl;
+  return true;
+}
+}  // namespace
+
+void Warp::addStep(const Eigen::Vector3d &centre, const Eigen::Vector3d &a, const Eigen::Vector3d &b,
+                   const Eigen::Vector3d &c, const Pose &pose)
+{
+  Step step;
+  step.centre = centre;
+  step.a = a;
+  step.b = b;
+  step.c = c;
+  step.pose = pose;
+  steps_.push_back(step);
+}
+
+void Warp::addStep(const Pose &pose)
+{
+  const Eigen::Vector3d zero(0, 0, 0);
+  addStep(zero, zero, zero, zero, pose);
+}
+
+void Warp::append(const Warp &warp)
+{
+  steps_.insert(steps_.end(), warp.steps_.begin(), warp.steps_.end());
+}
+
+Eigen::Vector3d Warp::apply(const Eigen::Vector3d &pos) const
+{
+  Eigen::Vector3d result = pos;
+  for (const auto &step : steps_)
+  {
+    const Eigen::Vector3d rel_pos = result - step.centre;
+    result += step.a * sqr(rel_pos[0]) + step.b * sqr(rel_pos[1]) + step.c * rel_pos[0] * rel_pos[1];
+    result = step.pose * result;
+  }
+  return result;
+}
+
+bool Warp::save(const std::string &file_name) const
+{
+  std::ofstream ofs;
+  if (!openWarpFile(file_name, ofs))
+    return false;
+  for (const auto &step : steps_)
+    writeStep(ofs, step);
+  return true;
+}
+
+bool Warp::load(const std::string &file_name)
+{
+  steps_.clear();
+  auto time_found = [](double) { return false; }; // a plain warp has no times
+  auto step_found = [this](const Step &step) { steps_.push_back(step); };
+  return readWarpFile(file_name, time_found, step_found);
+}
+
+void TimeVaryingWarp::add(double time, const Warp &warp)
+{
+  ASSERT(times_.empty() || time > times_.back());
+  times_.push_back(time);
+  warps_.push_back(warp);
+}
+
+Eigen::Vector3d TimeVaryingWarp::apply(const Eigen::Vector3d &pos, double time) const
+{
+  if (warps_.empty())
+    return pos;
+  if (time <= times_.front())
+    return warps_.front().apply(pos);
+  if (time >= times_.back())
+    return warps_.back().apply(pos);
+  const size_t index = std::lower_bound(times_.begin(), times_.end(), time) - times_.begin();
+  const double blend = (time - times_[index - 1]) / (times_[index] - times_[index - 1]);
+  return warps_[index - 1].apply(pos) * (1.0 - blend) + warps_[index].apply(pos) * blend;
+}
+
+bool TimeVaryingWarp::save(const std::string &file_name) const
+{
+  std::ofstream ofs;
+  if (!openWarpFile(file_name, ofs))
+    return false;
+  for (size_t i = 0; i < warps_.size(); i++)
+  {
+    ofs << "time " << times_[i] << std::endl;
+    for (const auto &step : warps_[i].steps())
+      writeStep(ofs, step);
+  }
+  return true;
+}
+
+bool TimeVaryingWarp::load(const std::string &file_name)
+{
+  times_.clear();
+  warps_.clear();
+  auto time_found = [this](double time)
+  {
+    if (!times_.empty() && time <= times_.back())
+      return false;
+    add(time, Warp());
+    return true;
+  };
+  bool step_outside_time = false;
+  auto step_found = [&](const Warp::Step &step)
+  {
+    if (warps_.empty())
+      step_outside_time = true;
+    else
+      warps_.back().steps().push_back(step);
+  };
+  if (!readWarpFile(file_name, time_found, step_found))
+    return false;
+  if (step_outside_time)
+  {
+    std::cerr << "Warp steps must follow a time in the time-varying warp file " << file_name << std::endl;
+    return false;
+  }
+  return true;
+}
+}  // namespace ray
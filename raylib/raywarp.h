@@ -0,0 +1,80 @@
+// Copyright (c) 2020
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#ifndef RAYLIB_RAYWARP_H
+#define RAYLIB_RAYWARP_H
+
+#include "raylib/raylibconfig.h"
+
+#include "rayutils.h"
+#include "raypose.h"
+
+namespace ray
+{
+/// A smooth deformation of space, such as the non-rigid transformation found by @c FineAlignment. It is a sequence of
+/// steps applied in order. Each step bends space quadratically in the horizontal coordinates about a centre, then
+/// applies a rigid transformation. A rigid transformation is just a step with no quadratic terms.
+/// A warp does not refer to any cloud, so it can be estimated on decimated clouds, saved, and later streamed through
+/// the full cloud with @c convertCloud()
+class RAYLIB_EXPORT Warp
+{
+public:
+  struct Step
+  {
+    Eigen::Vector3d centre;
+    Eigen::Vector3d a, b, c; // the offset is a*x^2 + b*y^2 + c*x*y, for the position (x,y) relative to the centre
+    Pose pose;
+  };
+
+  /// Append a step with quadratic components @c a, @c b and @c c about @c centre, followed by the rigid @c pose
+  void addStep(const Eigen::Vector3d &centre, const Eigen::Vector3d &a, const Eigen::Vector3d &b,
+               const Eigen::Vector3d &c, const Pose &pose);
+  /// Append a rigid transformation
+  void addStep(const Pose &pose);
+  /// Append all the steps of @c warp, so it is applied after this one
+  void append(const Warp &warp);
+
+  /// The warped position of @c pos
+  Eigen::Vector3d apply(const Eigen::Vector3d &pos) const;
+
+  /// Save the warp to a text file, one step per line
+  bool save(const std::string &file_name) const;
+  /// Load a warp saved with @c save()
+  bool load(const std::string &file_name);
+
+  inline std::vector<Step> &steps() { return steps_; }
+  inline const std::vector<Step> &steps() const { return steps_; }
+
+private:
+  std::vector<Step> steps_;
+};
+
+/// A warp that varies over time, for deformations that accumulate over a scan such as sensor drift. It is piecewise,
+/// with a warp at each of a set of increasing times. A ray is moved by the warps either side of its time,
+/// and the two results interpolated linearly. Rays before the first or after the last time use the nearest warp
+class RAYLIB_EXPORT TimeVaryingWarp
+{
+public:
+  /// Add the @c warp at @c time, which must be later than the previously added times
+  void add(double time, const Warp &warp);
+
+  /// The warped position of @c pos, observed at @c time
+  Eigen::Vector3d apply(const Eigen::Vector3d &pos, double time) const;
+
+  /// Save the warps to a text file, each is written as in @c Warp::save(), following its time
+  bool save(const std::string &file_name) const;
+  /// Load warps saved with @c save()
+  bool load(const std::string &file_name);
+
+  inline const std::vector<double> &times() const { return times_; }
+  inline const std::vector<Warp> &warps() const { return warps_; }
+
+private:
+  std::vector<double> times_;
+  std::vector<Warp> warps_;
+};
+}  // namespace ray
+
+#endif  // RAYLIB_RAYWARP_H
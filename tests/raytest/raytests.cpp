@@ -4,12 +4,20 @@
 //
 // Author: Thomas Lowe
 
+#include "rayalignment.h"
 #include "raycloud.h"
+#include "rayfinealignment.h"
 #include "raymesh.h"
 #include "rayply.h"
+#include "rayrenderer.h"
+#include "raywarp.h"
+#include <algorithm>
 #include <vector>
 #include <gtest/gtest.h>
+#include <cmath>
+#include <cstdio>
 #include <cstdlib>
+#include <fstream>
 
 /// Raycloud testing framework. In each test, the statistics of the resulting clouds are compared to the statistics
 /// of the cloud when it was confirmed to be operating correctly. 
@@ -46,6 +54,59 @@ namespace raytest
     }
   }
 
+  /// Adds the first channel of a radiance .hdr tile, as written by rayrender, to @c image (of width @c image_width) 
+  /// at pixel @c x0, y0. Returns false if the file cannot be read.
+  bool addHdrTile(const std::string &file_name, int x0, int y0, std::vector<float> &image, int image_width)
+  {
+    std::ifstream ifs(file_name, std::ios::binary);
+    std::string line;
+    while (std::getline(ifs, line) && line.compare(0, 2, "-Y") != 0);
+    int width = 0, height = 0;
+    if (!ifs || std::sscanf(line.c_str(), "-Y %d +X %d", &height, &width) != 2)
+      return false;
+    std::vector<unsigned char> rgbe(4 * width);
+    for (int y = 0; y < height; y++)
+    {
+      if (width < 8 || width >= 32768) // stored without run length encoding
+      {
+        ifs.read(reinterpret_cast<char *>(rgbe.data()), rgbe.size());
+      }
+      else // each component of the scanline is run length encoded in turn, after a 4 byte header
+      {
+        unsigned char header[4];
+        ifs.read(reinterpret_cast<char *>(header), 4);
+        for (int c = 0; c < 4; c++)
+        {
+          for (int x = 0; x < width && ifs;)
+          {
+            const int count = ifs.get();
+            if (count > 128)
+            {
+              const int value = ifs.get();
+              for (int i = 0; i < count - 128 && x < width; i++)
+                rgbe[4 * (x++) + c] = static_cast<unsigned char>(value);
+            }
+            else
+            {
+              for (int i = 0; i < count && x < width; i++)
+                rgbe[4 * (x++) + c] = static_cast<unsigned char>(ifs.get());
+            }
+          }
+        }
+      }
+      if (!ifs)
+        return false;
+      for (int x = 0; x < width; x++)
+      {
+        const unsigned char *pixel = &rgbe[4 * x];
+        const size_t ind = static_cast<size_t>(x0 + x) + static_cast<size_t>(y0 + y) * image_width;
+        if (x0 + x < image_width && ind < image.size())
+          image[ind] = pixel[3] == 0 ? 0.0f : static_cast<float>(std::ldexp(pixel[0], pixel[3] - 136));
+      }
+    }
+    return true;
+  }
+
   /// Creates two copies of the same room with a rotational difference, then aligns the first onto the second 
   TEST(Basic, RayAlign)
   {
@@ -57,6 +118,88 @@ namespace raytest
     EXPECT_TRUE(cloud.load("room_aligned.ply"));
     compareMoments(cloud.getMoments(), {-0.0618268, -0.077552, 0.0531072, 7.58334e-08, 7.97642e-08, 1.93877e-08, -0.180532, -0.219257, 0.0654452, 2.47241, 2.08183, 1.28226, 17.539, 10.1994, 0.304682, 0.761892, 0.429502, 0.987362, 0.318932, 0.225742, 0.389901, 0.111705});  }
 
+  /// Aligns rotated and translated copies of a room onto the first room as a batch, comparing each aligned
+  /// copy to the expected results, which lie within a few millimetres of the original room
+  TEST(Basic, RayAlignBatch)
+  {
+    EXPECT_EQ(command("raycreate room 1"), 0);
+    EXPECT_EQ(copy("room.ply room2.ply"), 0);
+    EXPECT_EQ(copy("room.ply room3.ply"), 0);
+    EXPECT_EQ(command("rayrotate room2.ply 0,0,35"), 0);
+    EXPECT_EQ(command("raytranslate room2.ply 0.5,0.3,0"), 0);
+    EXPECT_EQ(command("raytranslate room3.ply -0.4,0.2,0.1"), 0);
+    EXPECT_EQ(command("rayrotate room3.ply 0,0,-20"), 0);
+    EXPECT_EQ(command("rayalign batch room.ply room2.ply room3.ply"), 0);
+    ray::Cloud cloud2, cloud3;
+    EXPECT_TRUE(cloud2.load("room2_aligned.ply"));
+    compareMoments(cloud2.getMoments(), {-0.108439, -0.0427012, 0.0511354, 1.44565e-07, 1.48554e-07, 4.78952e-08, -0.276507, -0.0778004, 0.064619, 2.42461, 2.1373, 1.28228, 17.539, 10.1994, 0.304682, 0.761892, 0.429502, 0.987362, 0.318932, 0.225742, 0.389901, 0.111705}, 0.01);
+    EXPECT_TRUE(cloud3.load("room3_aligned.ply"));
+    compareMoments(cloud3.getMoments(), {-0.107433, -0.0357036, 0.0541281, 1.55338e-07, 1.58913e-07, 4.41359e-08, -0.275531, -0.0706814, 0.0675512, 2.42441, 2.13756, 1.28222, 17.539, 10.1994, 0.304682, 0.761892, 0.429502, 0.987362, 0.318932, 0.225742, 0.389901, 0.111705}, 0.01);
+  }
+
+  /// Aligns a rotated and translated copy of a room with the coarse translation refined to 2cm. The coarse alignment
+  /// alone should be within a centimetre on average, about twice as close as without the refinement, and the aligned
+  /// room is compared to the expected results
+  TEST(Basic, RayAlignRefine)
+  {
+    EXPECT_EQ(command("raycreate room 1"), 0);
+    EXPECT_EQ(copy("room.ply room2.ply"), 0);
+    EXPECT_EQ(command("raytranslate room2.ply 0.33,0.21,0"), 0);
+    EXPECT_EQ(command("rayrotate room2.ply 0,0,35"), 0);
+    ray::Cloud clouds[2];
+    EXPECT_TRUE(clouds[0].load("room.ply"));
+    EXPECT_TRUE(clouds[1].load("room2.ply"));
+    ray::alignCloud0ToCloud1(clouds, 0.5, false, 0.02);
+    double error = 0.0;
+    for (size_t i = 0; i < clouds[0].rayCount(); i++)
+      error += (clouds[0].ends[i] - clouds[1].ends[i]).norm();
+    EXPECT_LT(error / (double)clouds[0].rayCount(), 0.01);
+
+    EXPECT_EQ(command("rayalign room.ply room2.ply --refine_width 0.02"), 0);
+    ray::Cloud cloud;
+    EXPECT_TRUE(cloud.load("room_aligned.ply"));
+    compareMoments(cloud.getMoments(), {0.0840345, 0.26647, 0.0522547, 1.12686e-07, 1.07803e-07, 5.43426e-08, -0.0335476, 0.141354, 0.0657148, 2.47233, 2.08193, 1.28226, 17.539, 10.1994, 0.304682, 0.761892, 0.429502, 0.987362, 0.318932, 0.225742, 0.389901, 0.111705}, 0.01);
+  }
+
+  /// Fine aligns a room onto an identical copy, so every update is negligible. The iterations should stop early, but
+  /// only once the robustly weighted iterations after the first have also settled, leaving the room where it was
+  TEST(Basic, RayFineAlignConverged)
+  {
+    EXPECT_EQ(command("raycreate room 1"), 0);
+    ray::Cloud clouds[2];
+    EXPECT_TRUE(clouds[0].load("room.ply"));
+    EXPECT_TRUE(clouds[1].load("room.ply"));
+    ray::FineAlignment fine_align(clouds, false, false);
+    fine_align.align();
+    // at least the first, unweighted iteration then two settled ones, but fewer than the maximum of 8
+    EXPECT_GE(fine_align.warp().steps().size(), 3u);
+    EXPECT_LT(fine_align.warp().steps().size(), 8u);
+    double max_error = 0.0;
+    for (size_t i = 0; i < clouds[0].rayCount(); i++)
+      max_error = std::max(max_error, (clouds[0].ends[i] - clouds[1].ends[i]).norm());
+    EXPECT_LT(max_error, 1e-4);
+  }
+
+  /// Loads a decimated room through the cache, then moves the room and loads it again, checking that the stale 
+  /// cached copy is replaced rather than reused
+  TEST(Basic, RayLoadDecimatedCache)
+  {
+    EXPECT_EQ(command("raycreate room 1"), 0);
+    double width = 0.0;
+    ray::Cloud first, cached, moved;
+    EXPECT_TRUE(first.loadDecimated("room.ply", width, true));
+    ASSERT_GT(first.rayCount(), 0u);
+    double cached_width = 0.0;
+    EXPECT_TRUE(cached.loadDecimated("room.ply", cached_width, true));
+    EXPECT_EQ(cached_width, width);
+    EXPECT_EQ(cached.rayCount(), first.rayCount());
+
+    EXPECT_EQ(command("raytranslate room.ply 1,0,0"), 0);
+    double moved_width = 0.0;
+    EXPECT_TRUE(moved.loadDecimated("room.ply", moved_width, true));
+    EXPECT_NEAR(moved.getMoments()[0], first.getMoments()[0] + 1.0, 1e-3);  // mean start x
+  }
+
   /// Colours a room according to the normal direction of the surfaces, comparing to the expected results
   TEST(Basic, RayColour)
   {
@@ -79,6 +222,66 @@ namespace raytest
     EXPECT_TRUE(cloud.load("room_combined.ply"));
     compareMoments(cloud.getMoments(), {-0.0867714, -0.0679941, 0.546619, 0.0215326, 0.0272819, 0.499969, -0.305657, -0.186353, 0.582642, 2.95777, 2.47531, 1.63323, 17.4967, 10.1789, 0.305355, 0.763356, 0.427376, 0.979005, 0.318409, 0.225661, 0.389366, 0.143369});
   }
+
+  /// Combines the same two rooms incrementally, by generating a merge state for the first room, and checks that the
+  /// result matches the standard combine.
+  TEST(Basic, RayCombineIncremental)
+  {
+    EXPECT_EQ(command("raycreate room 1"), 0);
+    EXPECT_EQ(copy("room.ply room2.ply"), 0);
+    EXPECT_EQ(command("raytranslate room2.ply 0,0,1"), 0);
+    EXPECT_EQ(command("rayrotate room2.ply 0,0,35"), 0);
+    EXPECT_EQ(command("raycombine min room.ply room2.ply 1 rays"), 0);
+    std::remove("room.state");
+    EXPECT_EQ(command("raycombine min room.ply room2.ply 1 rays --incremental room.state --output room_incremental.ply"), 0);
+    ray::Cloud cloud, incremental_cloud;
+    EXPECT_TRUE(cloud.load("room_combined.ply"));
+    EXPECT_TRUE(incremental_cloud.load("room_incremental.ply"));
+    EXPECT_EQ(cloud.rayCount(), incremental_cloud.rayCount());
+    const Eigen::ArrayXd moments = cloud.getMoments();
+    compareMoments(incremental_cloud.getMoments(), std::vector<double>(moments.data(), moments.data() + moments.size()), 1e-5);
+  }
+  
+  /// Combines the same two rooms in 2 m tiles, streamed through temporary tile files, and checks that the result
+  /// matches the standard combine.
+  TEST(Basic, RayCombineTiled)
+  {
+    EXPECT_EQ(command("raycreate room 1"), 0);
+    EXPECT_EQ(copy("room.ply room2.ply"), 0);
+    EXPECT_EQ(command("raytranslate room2.ply 0,0,1"), 0);
+    EXPECT_EQ(command("rayrotate room2.ply 0,0,35"), 0);
+    EXPECT_EQ(command("raycombine min room.ply room2.ply 1 rays"), 0);
+    EXPECT_EQ(command("raycombine min room.ply room2.ply 1 rays --tile_width 2 --output room_tiled.ply"), 0);
+    ray::Cloud cloud, tiled_cloud;
+    EXPECT_TRUE(cloud.load("room_combined.ply"));
+    EXPECT_TRUE(tiled_cloud.load("room_tiled.ply"));
+    EXPECT_EQ(cloud.rayCount(), tiled_cloud.rayCount());
+    const Eigen::ArrayXd moments = cloud.getMoments();
+    compareMoments(tiled_cloud.getMoments(), std::vector<double>(moments.data(), moments.data() + moments.size()), 1e-5);
+  }
+
+  /// Merges a third room into the incremental result using the saved merge state, and checks that the two increments
+  /// closely approximate combining all three rooms at once.
+  TEST(Basic, RayCombineIncrementalTwice)
+  {
+    EXPECT_EQ(command("raycreate room 1"), 0);
+    EXPECT_EQ(copy("room.ply room2.ply"), 0);
+    EXPECT_EQ(copy("room.ply room3.ply"), 0);
+    EXPECT_EQ(command("raytranslate room2.ply 0,0,1"), 0);
+    EXPECT_EQ(command("rayrotate room2.ply 0,0,35"), 0);
+    EXPECT_EQ(command("raytranslate room3.ply 0.5,0,0"), 0);
+    EXPECT_EQ(command("rayrotate room3.ply 0,0,-20"), 0);
+    EXPECT_EQ(command("raycombine min room.ply room2.ply room3.ply 1 rays"), 0);
+    std::remove("room.state");
+    EXPECT_EQ(command("raycombine min room.ply room2.ply 1 rays --incremental room.state --output room_incremental.ply"), 0);
+    EXPECT_EQ(command("raycombine min room_incremental.ply room3.ply 1 rays --incremental room.state --output room_incremental2.ply"), 0);
+    ray::Cloud cloud, incremental_cloud;
+    EXPECT_TRUE(cloud.load("room_combined.ply"));
+    EXPECT_TRUE(incremental_cloud.load("room_incremental2.ply"));
+    EXPECT_NEAR((double)incremental_cloud.rayCount(), (double)cloud.rayCount(), 0.01 * (double)cloud.rayCount());
+    const Eigen::ArrayXd moments = cloud.getMoments();
+    compareMoments(incremental_cloud.getMoments(), std::vector<double>(moments.data(), moments.data() + moments.size()), 0.02);
+  }
   
   /// Creates a building with random seed 1, and compares to the expected results
   TEST(Basic, RayCreate)
@@ -176,6 +379,233 @@ namespace raytest
     compareMoments(cloud.getMoments(), {9.8432, 20.3123, 34.1676, 7.50948, 6.22758, 2.98594, 9.94944, 20.3467, 34.1428, 7.10014, 6.08883, 3.06454, 148.554, 85.768, 0.493815, 0.499403, 0.436111, 1, 0.371176, 0.374394, 0.389949, 0});
   }
 
+  /// Saves a warp that is a pure translation and applies it to a forest, which should match the translated forest 
+  TEST(Basic, RayWarp)
+  {
+    EXPECT_EQ(command("raycreate forest 1"), 0);
+    ray::Warp warp;
+    warp.addStep(ray::Pose(Eigen::Vector3d(10, 20, 30), Eigen::Quaterniond::Identity()));
+    EXPECT_TRUE(warp.save("forest_warp.txt"));
+    EXPECT_EQ(command("raywarp forest.ply forest_warp.txt"), 0);
+    ray::Cloud cloud;
+    EXPECT_TRUE(cloud.load("forest.ply"));
+    compareMoments(cloud.getMoments(), {9.8432, 20.3123, 34.1676, 7.50948, 6.22758, 2.98594, 9.94944, 20.3467, 34.1428, 7.10014, 6.08883, 3.06454, 148.554, 85.768, 0.493815, 0.499403, 0.436111, 1, 0.371176, 0.374394, 0.389949, 0});
+  }
+
+  /// Warps a forest by a non-rigid step (quadratic bend then rotation and translation), checking that the warp file
+  /// round trips exactly and that every ray start and end moves to its expected position
+  TEST(Basic, RayWarpNonRigid)
+  {
+    EXPECT_EQ(command("raycreate forest 1"), 0);
+    ray::Cloud forest;
+    EXPECT_TRUE(forest.load("forest.ply"));
+    const Eigen::Vector3d centre(1.0, -2.0, 0.5);
+    const Eigen::Vector3d a(0.001, -0.002, 0.003), b(-0.002, 0.001, 0.002), c(0.0015, 0.0005, -0.001);
+    const Eigen::Quaterniond rotation(Eigen::AngleAxisd(0.3, Eigen::Vector3d(0, 0, 1)));
+    const ray::Pose pose(Eigen::Vector3d(0.5, -0.3, 0.2), rotation);
+    ray::Warp warp;
+    warp.addStep(centre, a, b, c, pose);
+    EXPECT_TRUE(warp.save("forest_warp.txt"));
+
+    ray::Warp loaded;
+    EXPECT_TRUE(loaded.load("forest_warp.txt"));
+    ASSERT_EQ(loaded.steps().size(), 1u);
+    const ray::Warp::Step &step = loaded.steps()[0];
+    EXPECT_EQ(step.centre, centre);
+    EXPECT_EQ(step.a, a);
+    EXPECT_EQ(step.b, b);
+    EXPECT_EQ(step.c, c);
+    EXPECT_EQ(step.pose.position, pose.position);
+    EXPECT_TRUE(step.pose.rotation.isApprox(pose.rotation, 1e-12));  // renormalised on load
+
+    EXPECT_EQ(command("raywarp forest.ply forest_warp.txt"), 0);
+    ray::Cloud cloud;
+    EXPECT_TRUE(cloud.load("forest.ply"));
+    ASSERT_EQ(cloud.rayCount(), forest.rayCount());
+    auto expected = [&](const Eigen::Vector3d &pos)
+    {
+      const Eigen::Vector3d rel = pos - centre;
+      return pose * (pos + a * rel[0] * rel[0] + b * rel[1] * rel[1] + c * rel[0] * rel[1]);
+    };
+    double max_error = 0.0;
+    for (size_t i = 0; i < cloud.rayCount(); i++)
+    {
+      max_error = std::max(max_error, (cloud.starts[i] - expected(forest.starts[i])).norm());
+      max_error = std::max(max_error, (cloud.ends[i] - expected(forest.ends[i])).norm());
+    }
+    EXPECT_LT(max_error, 1e-4);
+  }
+
+  /// Warps a forest by a time varying warp, which bends the forest at its first ray time and translates it at its
+  /// last, checking the round trip of the warp file and that each ray is interpolated according to its time
+  TEST(Basic, RayWarpTimeVarying)
+  {
+    EXPECT_EQ(command("raycreate forest 1"), 0);
+    ray::Cloud forest;
+    EXPECT_TRUE(forest.load("forest.ply"));
+    const double time0 = *std::min_element(forest.times.begin(), forest.times.end());
+    const double time1 = *std::max_element(forest.times.begin(), forest.times.end());
+    ASSERT_GT(time1, time0);
+    const Eigen::Vector3d zero(0, 0, 0), a(0.002, 0, -0.001), shift(2.0, -1.0, 0.5);
+    ray::Warp bend, translate;
+    bend.addStep(zero, a, zero, zero, ray::Pose::identity());
+    translate.addStep(ray::Pose(shift, Eigen::Quaterniond::Identity()));
+    ray::TimeVaryingWarp warp;
+    warp.add(time0, bend);
+    warp.add(time1, translate);
+    EXPECT_TRUE(warp.save("forest_warp.txt"));
+
+    ray::TimeVaryingWarp loaded;
+    EXPECT_TRUE(loaded.load("forest_warp.txt"));
+    EXPECT_EQ(loaded.times(), warp.times());
+    ASSERT_EQ(loaded.warps().size(), 2u);
+    EXPECT_EQ(loaded.warps()[0].steps()[0].a, a);
+    EXPECT_EQ(loaded.warps()[1].steps()[0].pose.position, shift);
+
+    EXPECT_EQ(command("raywarp forest.ply forest_warp.txt --time_varying"), 0);
+    ray::Cloud cloud;
+    EXPECT_TRUE(cloud.load("forest.ply"));
+    ASSERT_EQ(cloud.rayCount(), forest.rayCount());
+    double max_error = 0.0;
+    for (size_t i = 0; i < cloud.rayCount(); i++)
+    {
+      const double blend = (forest.times[i] - time0) / (time1 - time0);
+      auto expected = [&](const Eigen::Vector3d &pos)
+      {
+        return (pos + a * pos[0] * pos[0]) * (1.0 - blend) + (pos + shift) * blend;
+      };
+      max_error = std::max(max_error, (cloud.starts[i] - expected(forest.starts[i])).norm());
+      max_error = std::max(max_error, (cloud.ends[i] - expected(forest.ends[i])).norm());
+    }
+    EXPECT_LT(max_error, 1e-4);
+  }
+
+  /// Renders a density pyramid of a checkerboard of surfaces and free space, where every pixel column is observed,
+  /// and checks that each pyramid level is the 2x2 mean of the level below, including the zero density columns
+  TEST(Basic, RayRenderPyramid)
+  {
+    ray::Cloud cloud;
+    const double spacing = 0.02;
+    for (int i = 0; i < 200; i++)
+    {
+      for (int j = 0; j < 200; j++)
+      {
+        const Eigen::Vector3d end((i + 0.5) * spacing, (j + 0.5) * spacing, 0.05 * ((i + 2 * j) % 5));
+        const bool surface = ((i / 25) + (j / 25)) % 2 == 0;
+        const uint8_t alpha = surface ? 255 : 0;
+        cloud.addRay(end + Eigen::Vector3d(0.01, 0.02, 1.0), end, i * 200 + j, ray::RGBA{127, 127, 127, alpha});
+      }
+    }
+    cloud.save("checker.ply");
+    EXPECT_EQ(command("rayrender checker.ply top density --pixel_width 0.1 --tile_size 16 --pyramid --output checker.hdr"), 0);
+
+    const int tile_size = 16, num_tiles = 4, width = tile_size * num_tiles;
+    std::vector<std::vector<float>> levels(3, std::vector<float>(width * width, 0.0f));
+    int num_tiles_read = 0;
+    for (int level = 0; level < 3; level++)
+    {
+      for (int tx = 0; tx < num_tiles; tx++)
+      {
+        for (int ty = 0; ty < num_tiles; ty++)
+        {
+          const std::string tile_file = "checker_" + std::to_string(level) + "_" + std::to_string(tx) + "_" + 
+                                        std::to_string(ty) + ".hdr";
+          if (addHdrTile(tile_file, tx * tile_size, ty * tile_size, levels[level], width))
+            num_tiles_read++;
+        }
+      }
+    }
+    EXPECT_GT(num_tiles_read, 9);
+    int num_checked = 0;
+    for (int level = 1; level < 3; level++)
+    {
+      const int level_width = width >> level;
+      for (int y = 0; y < level_width; y++)
+      {
+        for (int x = 0; x < level_width; x++)
+        {
+          const std::vector<float> &fine = levels[level - 1];
+          const float mean = 0.25f * (fine[2 * x + 2 * y * width] + fine[2 * x + 1 + 2 * y * width] +
+                                      fine[2 * x + (2 * y + 1) * width] + fine[2 * x + 1 + (2 * y + 1) * width]);
+          const float value = levels[level][x + y * width];
+          // the .hdr format has an 8 bit mantissa
+          EXPECT_NEAR(value, mean, 0.02f * std::max(value, mean) + 1e-6f);
+          num_checked += value > 0.0f ? 1 : 0;
+        }
+      }
+    }
+    EXPECT_GT(num_checked, 400);
+  }
+
+  /// Reads a whole file into @c contents, returning false if it cannot be read
+  bool readFile(const std::string &file_name, std::string &contents)
+  {
+    std::ifstream ifs(file_name, std::ios::binary);
+    if (!ifs)
+      return false;
+    contents.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+    return true;
+  }
+
+  /// Renders a tiled pyramid one tile row at a time, and checks that the tiles match those rendered in one pass
+  TEST(Basic, RayRenderBands)
+  {
+    ray::Cloud cloud;
+    const double spacing = 0.02;
+    for (int i = 0; i < 200; i++)
+    {
+      for (int j = 0; j < 200; j++)
+      {
+        const Eigen::Vector3d end((i + 0.5) * spacing, (j + 0.5) * spacing, 0.05 * ((i + 2 * j) % 5));
+        const uint8_t shade = static_cast<uint8_t>((i * 7 + j * 3) % 256);
+        cloud.addRay(end + Eigen::Vector3d(0.3, 0.2, 1.0), end, i * 200 + j, ray::RGBA{shade, 127, 127, 255});
+      }
+    }
+    cloud.save("bands.ply");
+    ray::Cloud::Info info;
+    EXPECT_TRUE(ray::Cloud::getInfo("bands.ply", info));
+
+    const std::vector<std::string> styles = {"sum", "rays", "density_rgb"};
+    const ray::RenderStyle render_styles[] = {ray::RenderStyle::Sum, ray::RenderStyle::Rays, ray::RenderStyle::Density_rgb};
+    ray::RenderConfig config;
+    config.tile_size = 16;
+    config.pyramid = true;
+    std::vector<ray::RenderView> views, band_views;
+    for (size_t i = 0; i < styles.size(); i++)
+    {
+      views.push_back(ray::RenderView{ray::ViewDirection::Top, render_styles[i], "whole_" + styles[i] + ".png"});
+      band_views.push_back(ray::RenderView{ray::ViewDirection::Top, render_styles[i], "band_" + styles[i] + ".png"});
+    }
+    const double pixel_width = 0.05;
+    EXPECT_TRUE(ray::renderCloud("bands.ply", info.ends_bound, views, pixel_width, config));
+    config.max_band_pixels = 1; // one tile row per band
+    EXPECT_TRUE(ray::renderCloud("bands.ply", info.ends_bound, band_views, pixel_width, config));
+
+    int num_compared = 0;
+    for (auto &style: styles)
+    {
+      for (int level = 0; level < 4; level++)
+      {
+        for (int tx = 0; tx < 6; tx++)
+        {
+          for (int ty = 0; ty < 6; ty++)
+          {
+            const std::string tile = "_" + std::to_string(level) + "_" + std::to_string(tx) + "_" +
+                                     std::to_string(ty) + ".png";
+            std::string whole, band;
+            const bool has_whole = readFile("whole_" + style + tile, whole);
+            EXPECT_EQ(has_whole, readFile("band_" + style + tile, band));
+            if (!has_whole)
+              continue;
+            EXPECT_EQ(whole, band);
+            num_compared++;
+          }
+        }
+      }
+    }
+    EXPECT_GT(num_compared, 60);
+  }
+
 #if RAYLIB_WITH_QHULL
   /// Creates a terrain ray cloud, then wraps it from below, comparing the mesh to the expected results
   TEST(Basic, RayWrap)